@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "AtomicUnorderedMap.h"
+#include "AtomicUnorderedMapUtils.h"
+
+namespace folly {
+
+/// A read-only view of bytes in a BlobLog, standing in for
+/// std::string_view until the tree moves past C++14.  A default
+/// constructed BlobRange is null, which find() uses for a miss.
+class BlobRange {
+ public:
+  BlobRange() = default;
+  BlobRange(const char *data, size_t size) : data_(data), size_(size) {}
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  explicit operator bool() const { return data_ != nullptr; }
+
+  std::string str() const { return std::string(data_, size_); }
+
+  bool operator==(const BlobRange &rhs) const {
+    return size_ == rhs.size_ && memcmp(data_, rhs.data_, size_) == 0;
+  }
+  bool operator!=(const BlobRange &rhs) const { return !(*this == rhs); }
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+namespace detail {
+
+/// An append-only byte log made of fixed-size chunks, which are mapped
+/// on first use.  append() reserves space with a CAS on the tail offset
+/// and never blocks.  A blob never straddles two chunks, so the rest of a
+/// chunk is skipped if a blob doesn't fit.  Bytes are only released when
+/// the log is destroyed.
+template <typename Allocator = MMapAlloc>
+class BlobLog {
+ public:
+  BlobLog(size_t maxBytes, size_t chunkBytes)
+      : chunkBytes_(chunkBytes),
+        numChunks_(chunkBytes ? (maxBytes + chunkBytes - 1) / chunkBytes : 0),
+        chunks_(new std::atomic<char *>[numChunks_]) {
+    if (chunkBytes == 0 || numChunks_ == 0) {
+      throw std::invalid_argument("BlobLog needs a non-empty capacity");
+    }
+    for (size_t i = 0; i < numChunks_; ++i) {
+      chunks_[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  BlobLog(const BlobLog &) = delete;
+  BlobLog &operator=(const BlobLog &) = delete;
+
+  ~BlobLog() {
+    for (size_t i = 0; i < numChunks_; ++i) {
+      auto chunk = chunks_[i].load(std::memory_order_relaxed);
+      if (chunk != nullptr) {
+        allocator_.deallocate(chunk, chunkBytes_);
+      }
+    }
+  }
+
+  /// Copies len bytes to the log and returns their offset.  Throws
+  /// std::invalid_argument if len is larger than a chunk and
+  /// std::bad_alloc once the log is full.
+  uint64_t append(const void *data, size_t len) {
+    if (len > chunkBytes_) {
+      throw std::invalid_argument("BlobLog blob is larger than a chunk");
+    }
+    auto tail = tail_.load(std::memory_order_relaxed);
+    uint64_t start;
+    do {
+      start = tail;
+      if (start % chunkBytes_ + len > chunkBytes_) {
+        start += chunkBytes_ - start % chunkBytes_;
+      }
+      // an empty blob still needs a mapped chunk to point into
+      if (start + std::max<size_t>(len, 1) > numChunks_ * chunkBytes_) {
+        throw std::bad_alloc();
+      }
+    } while (!tail_.compare_exchange_weak(tail, start + len,
+                                          std::memory_order_relaxed));
+    auto dst = chunk(start / chunkBytes_) + start % chunkBytes_;
+    if (len > 0) {
+      memcpy(dst, data, len);
+    }
+    return start;
+  }
+
+  /// The bytes at offset, which the caller must have received from
+  /// append() (or read from a location published after it)
+  const char *at(uint64_t offset) const {
+    return chunks_[offset / chunkBytes_].load(std::memory_order_acquire) +
+           offset % chunkBytes_;
+  }
+
+  /// Bytes handed out so far, including those skipped at chunk ends
+  uint64_t usedBytes() const { return tail_.load(std::memory_order_relaxed); }
+
+  size_t chunkBytes() const { return chunkBytes_; }
+
+ private:
+  // maps chunk i if nobody has yet; racing threads free their copy
+  char *chunk(size_t i) {
+    auto p = chunks_[i].load(std::memory_order_acquire);
+    if (LIKELY(p != nullptr)) {
+      return p;
+    }
+    auto fresh = static_cast<char *>(allocator_.allocate(chunkBytes_));
+    if (chunks_[i].compare_exchange_strong(p, fresh,
+                                           std::memory_order_acq_rel)) {
+      return fresh;
+    }
+    allocator_.deallocate(fresh, chunkBytes_);
+    return p;
+  }
+
+  size_t chunkBytes_;
+  size_t numChunks_;
+  std::unique_ptr<std::atomic<char *>[]> chunks_;
+  std::atomic<uint64_t> tail_{0};
+  Allocator allocator_;
+};
+
+/// Where a value lives in the BlobLog
+struct BlobRef {
+  uint64_t offset;
+  uint64_t size;
+};
+
+}  // namespace detail
+
+/// AtomicUnorderedBlobMap maps keys to variable-length byte strings,
+/// such as serialized records, without a heap allocation per entry.
+/// Values are copied into a chunked append-only log owned by the map,
+/// and each slot of the underlying AtomicUnorderedInsertMap holds just
+/// the offset and length.  Values of neighboring inserts sit next to
+/// each other in the log.
+///
+/// The concurrency guarantees are those of AtomicUnorderedInsertMap: find
+/// is wait-free and insert is lock-free.  As with findOrConstruct, a
+/// thread that loses an insert race for the same key has already copied
+/// its value, and those log bytes are wasted.  insert() checks for the
+/// key first, so that only happens under a real race.
+///
+/// Usage:
+///
+///  AtomicUnorderedBlobMap<uint64_t> m(100000, 64 << 20);
+///  m.insert(id, record.data(), record.size());
+///  BlobRange r = m.find(id);
+///  if (r) { parse(r.data(), r.size()); }
+template <typename Key, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>,
+          template <typename> class Atom = std::atomic,
+          typename Allocator = folly::detail::MMapAlloc>
+class AtomicUnorderedBlobMap {
+  typedef AtomicUnorderedInsertMap<Key, detail::BlobRef, Hash, KeyEqual,
+                                   std::is_trivially_destructible<Key>::value,
+                                   Atom, uint32_t, Allocator>
+      Map;
+
+ public:
+  typedef Key key_type;
+
+  enum : size_t { kDefaultChunkBytes = 1 << 20 };
+
+  /// A map of up to maxSize keys whose values total at most maxLogBytes
+  /// (less the ends of chunks skipped by values that didn't fit).  No
+  /// value may be longer than chunkBytes.
+  AtomicUnorderedBlobMap(size_t maxSize, size_t maxLogBytes,
+                         float maxLoadFactor = 0.8f,
+                         size_t chunkBytes = kDefaultChunkBytes)
+      : map_(maxSize, maxLoadFactor), log_(maxLogBytes, chunkBytes) {}
+
+  /// Copies len bytes at data into the log and maps key to them, unless
+  /// key is already present.  Returns the value for key and whether this
+  /// call inserted it.
+  std::pair<BlobRange, bool> insert(const Key &key, const void *data,
+                                    size_t len) {
+    auto existing = map_.find(key);
+    if (existing != map_.cend()) {
+      return std::make_pair(range(existing->second), false);
+    }
+    detail::BlobRef ref = {log_.append(data, len), len};
+    auto rv = map_.findOrConstruct(
+        key, [&](void *raw) { new (raw) detail::BlobRef(ref); });
+    return std::make_pair(range(rv.first->second), rv.second);
+  }
+
+  std::pair<BlobRange, bool> insert(const Key &key, const std::string &value) {
+    return insert(key, value.data(), value.size());
+  }
+
+  /// The value of key, or a null BlobRange if key isn't present
+  BlobRange find(const Key &key) const {
+    auto iter = map_.find(key);
+    return iter == map_.cend() ? BlobRange() : range(iter->second);
+  }
+
+  /// Calls func(const Key&, BlobRange) for every entry
+  template <typename Func>
+  void forEach(Func &&func) const {
+    for (auto iter = map_.cbegin(); iter != map_.cend(); ++iter) {
+      func(iter->first, range(iter->second));
+    }
+  }
+
+  /// Log bytes handed out so far, see BlobLog::usedBytes()
+  uint64_t logBytes() const { return log_.usedBytes(); }
+
+  /// Memory used by the slot array, see AtomicUnorderedInsertMap
+  typename Map::MemoryStats memoryStats() const { return map_.memoryStats(); }
+
+ private:
+  BlobRange range(const detail::BlobRef &ref) const {
+    return BlobRange(log_.at(ref.offset), size_t(ref.size));
+  }
+
+  Map map_;
+  detail::BlobLog<Allocator> log_;
+};
+
+}  // namespace folly
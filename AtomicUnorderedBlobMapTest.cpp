@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "AtomicUnorderedBlobMap.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace folly;
+
+namespace {
+
+std::string record(int i) {
+  return std::string(20 + (i * 37) % 4077, char('a' + i % 26));
+}
+
+}  // namespace
+
+TEST(AtomicUnorderedBlobMap, insert_find) {
+  AtomicUnorderedBlobMap<int> m(1000, 4 << 20);
+  EXPECT_FALSE(m.find(1));
+
+  auto rv = m.insert(1, "first");
+  EXPECT_TRUE(rv.second);
+  EXPECT_EQ(rv.first.str(), "first");
+  rv = m.insert(1, "second");
+  EXPECT_FALSE(rv.second);
+  EXPECT_EQ(rv.first.str(), "first");
+  EXPECT_EQ(m.logBytes(), 5);
+
+  // an empty value is present, unlike a miss
+  EXPECT_TRUE(m.insert(2, "").second);
+  EXPECT_TRUE(bool(m.find(2)));
+  EXPECT_TRUE(m.find(2).empty());
+
+  size_t count = 0;
+  m.forEach([&](int key, BlobRange value) {
+    EXPECT_EQ(value.str(), key == 1 ? "first" : "");
+    ++count;
+  });
+  EXPECT_EQ(count, 2);
+}
+
+TEST(AtomicUnorderedBlobMap, chunk_boundaries) {
+  AtomicUnorderedBlobMap<int> m(1000, 64 << 10, 0.8f, 4096);
+  for (int i = 0; i < 30; ++i) {
+    m.insert(i, record(i));
+  }
+  for (int i = 0; i < 30; ++i) {
+    EXPECT_EQ(m.find(i).str(), record(i));
+  }
+  EXPECT_THROW(m.insert(100, std::string(4097, 'x')), std::invalid_argument);
+  EXPECT_THROW(
+      {
+        for (int i = 30; i < 1000; ++i) {
+          m.insert(i, record(i));
+        }
+      },
+      std::bad_alloc);
+}
+
+TEST(AtomicUnorderedBlobMap, concurrent_insert) {
+  AtomicUnorderedBlobMap<int> m(10000, 64 << 20);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 2000; ++i) {
+        int k = (i * 3 + t * 500) % 4000;
+        auto rv = m.insert(k, record(k));
+        EXPECT_EQ(rv.first.str(), record(k));
+      }
+    });
+  }
+  for (auto &thr : threads) {
+    thr.join();
+  }
+  for (int k = 0; k < 4000; ++k) {
+    auto r = m.find(k);
+    if (r) {
+      EXPECT_EQ(r.str(), record(k));
+    }
+  }
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "AtomicUnorderedMap.h"
+#include "AtomicUnorderedMapUtils.h"
+
+namespace folly {
+
+/// AtomicUnorderedDirectMap is a sibling of AtomicUnorderedInsertMap for
+/// integer keys drawn from a dense range [minKey, minKey + keyCount) that
+/// is known up front, such as IDs 0..N.  It has the same find,
+/// findOrConstruct, emplace and iteration API, but key k simply lives in
+/// slot k - minKey + 1, so there is no hashing, no chain and no
+/// allocateNear probing:
+///
+/// * find is one load of the slot state
+/// * an insert is a single CAS of the slot state from EMPTY to
+///   CONSTRUCTING, then a store of LINKED once the value is built.
+///   Threads that lose the race for a key wait for the winner's value,
+///   so unlike the hashed map a value is never constructed and thrown away.
+/// * slots have no head or next index, just a one byte state
+///
+/// The price is a slot per key of the range whether or not it is present,
+/// so it only pays off when most of the range gets filled.  find() of a
+/// key outside the range returns cend(); inserting one throws
+/// std::out_of_range.
+///
+/// As in AtomicUnorderedInsertMap, slot 0 is the nil slot that cend()
+/// points to and iteration goes from the highest key down.
+template <typename Key, typename Value,
+          bool SkipKeyValueDeletion =
+              (std::is_trivially_destructible<Key>::value &&
+               std::is_trivially_destructible<Value>::value),
+          template <typename> class Atom = std::atomic,
+          typename Allocator = folly::detail::MMapAlloc>
+struct AtomicUnorderedDirectMap {
+  static_assert(std::is_integral<Key>::value,
+                "AtomicUnorderedDirectMap needs an integral key");
+
+  typedef Key key_type;
+  typedef Value mapped_type;
+  typedef std::pair<Key, Value> value_type;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const value_type &const_reference;
+
+  typedef struct ConstIterator {
+    ConstIterator(const AtomicUnorderedDirectMap &owner, size_t slot)
+        : owner_(owner), slot_(slot) {}
+
+    ConstIterator(const ConstIterator &) = default;
+    ConstIterator &operator=(const ConstIterator &) = default;
+
+    const value_type &operator*() const {
+      return owner_.slots_[slot_].keyValue();
+    }
+
+    const value_type *operator->() const {
+      return &owner_.slots_[slot_].keyValue();
+    }
+
+    size_t get_internal_slot() const { return slot_; }
+
+    // pre-increment
+    const ConstIterator &operator++() {
+      while (slot_ > 0) {
+        --slot_;
+        if (owner_.slots_[slot_].state() == LINKED) {
+          break;
+        }
+      }
+      return *this;
+    }
+
+    // post-increment
+    ConstIterator operator++(int /* dummy */) {
+      auto prev = *this;
+      ++*this;
+      return prev;
+    }
+
+    bool operator==(const ConstIterator &rhs) const {
+      return slot_ == rhs.slot_;
+    }
+    bool operator!=(const ConstIterator &rhs) const { return !(*this == rhs); }
+
+   private:
+    const AtomicUnorderedDirectMap &owner_;
+    size_t slot_;
+  } const_iterator;
+
+  friend ConstIterator;
+
+  /// Constructs a map for the keys minKey .. minKey + keyCount - 1
+  AtomicUnorderedDirectMap(Key minKey, size_t keyCount,
+                           const Allocator &alloc = Allocator())
+      : minKey_(minKey), numSlots_(keyCount + 1), allocator_(alloc) {
+    if (keyCount == 0 || numSlots_ < keyCount) {
+      throw std::invalid_argument(
+          "AtomicUnorderedDirectMap needs a non-empty key range");
+    }
+    mmapRequested_ = sizeof(Slot) * numSlots_;
+    slots_ = reinterpret_cast<Slot *>(allocator_.allocate(mmapRequested_));
+    if (!folly::detail::GivesZeroFilledMemory<Allocator>::value) {
+      memset(static_cast<void *>(slots_), 0, mmapRequested_);
+    }
+    // the nil slot is never LINKED, so iteration stops there
+    slots_[0].state_.store(CONSTRUCTING, std::memory_order_relaxed);
+  }
+
+  AtomicUnorderedDirectMap(const AtomicUnorderedDirectMap &) = delete;
+  AtomicUnorderedDirectMap &operator=(const AtomicUnorderedDirectMap &) =
+      delete;
+
+  ~AtomicUnorderedDirectMap() {
+    if (!SkipKeyValueDeletion) {
+      for (size_t i = 1; i < numSlots_; ++i) {
+        slots_[i].~Slot();
+      }
+    }
+    allocator_.deallocate(reinterpret_cast<char *>(slots_), mmapRequested_);
+  }
+
+  size_t SlotsNum() const { return numSlots_; }
+  size_t MemoryCost() const { return mmapRequested_; }
+
+  /// As AtomicUnorderedInsertMap::findOrConstruct, except that func is
+  /// only called by the thread that claims the slot.  Other threads
+  /// inserting the same key spin until the value is constructed.  If func
+  /// throws the slot is released and the exception propagates.
+  template <typename Func>
+  std::pair<const_iterator, bool> findOrConstruct(const Key &key, Func &&func) {
+    auto const slot = keyToSlotIdx(key);
+    if (slot == 0) {
+      throw std::out_of_range("AtomicUnorderedDirectMap key out of range");
+    }
+    auto &s = slots_[slot];
+    while (true) {
+      auto state = s.state_.load(std::memory_order_acquire);
+      if (LIKELY(state == LINKED)) {
+        return std::make_pair(ConstIterator(*this, slot), false);
+      }
+      if (state == EMPTY &&
+          s.state_.compare_exchange_strong(state, uint8_t(CONSTRUCTING),
+                                           std::memory_order_acquire)) {
+        auto kv = static_cast<value_type *>(static_cast<void *>(&s.raw_));
+        new (&kv->first) Key(key);
+        try {
+          func(static_cast<void *>(&kv->second));
+        } catch (...) {
+          kv->first.~Key();
+          s.state_.store(EMPTY, std::memory_order_release);
+          throw;
+        }
+        s.state_.store(LINKED, std::memory_order_release);
+        return std::make_pair(ConstIterator(*this, slot), true);
+      }
+      // another thread is constructing this key
+      detail::SpinBackoff backoff;
+      while (s.state_.load(std::memory_order_acquire) == CONSTRUCTING) {
+        backoff.wait();
+      }
+    }
+  }
+
+  /// This isn't really emplace, but it is what we need to test.
+  template <class K, class V>
+  std::pair<const_iterator, bool> emplace(const K &key, V &&value) {
+    return findOrConstruct(
+        key, [&](void *raw) { new (raw) Value(std::forward<V>(value)); });
+  }
+
+  const_iterator find(const Key &key) const {
+    auto const slot = keyToSlotIdx(key);
+    return ConstIterator(
+        *this, slot != 0 && slots_[slot].state() == LINKED ? slot : 0);
+  }
+
+  const_iterator cbegin() const {
+    size_t slot = numSlots_ - 1;
+    while (slot > 0 && slots_[slot].state() != LINKED) {
+      --slot;
+    }
+    return ConstIterator(*this, slot);
+  }
+
+  const_iterator cend() const { return ConstIterator(*this, 0); }
+
+ private:
+  enum : uint8_t {
+    EMPTY = 0,
+    CONSTRUCTING = 1,
+    LINKED = 2,
+  };
+
+  struct Slot {
+    Atom<uint8_t> state_;
+
+    /// Key and Value
+    aligned_storage_for_t<value_type> raw_;
+
+    ~Slot() {
+      if (state() == LINKED) {
+        keyValue().first.~Key();
+        keyValue().second.~Value();
+      }
+    }
+
+    uint8_t state() const { return state_.load(std::memory_order_acquire); }
+
+    const value_type &keyValue() const {
+      assert(state() == LINKED);
+      return *static_cast<const value_type *>(static_cast<const void *>(&raw_));
+    }
+
+    value_type &keyValue() {
+      assert(state() == LINKED);
+      return *static_cast<value_type *>(static_cast<void *>(&raw_));
+    }
+  };
+
+  Key minKey_;
+  size_t numSlots_;
+  size_t mmapRequested_;
+  Allocator allocator_;
+  Slot *slots_;
+
+  /// The slot of key, or 0 if key is outside the range
+  size_t keyToSlotIdx(const Key &key) const {
+    // unsigned arithmetic turns keys below minKey into huge offsets.
+    // Keys narrower than int are promoted to int by the subtraction, so
+    // the difference is cast back to wrap at the key's width.
+    typedef typename std::make_unsigned<Key>::type UKey;
+    auto offset = size_t(UKey(UKey(key) - UKey(minKey_)));
+    return offset < numSlots_ - 1 ? offset + 1 : 0;
+  }
+};
+
+}  // namespace folly
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "AtomicUnorderedDirectMap.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace folly;
+
+TEST(AtomicUnorderedDirectMap, basic) {
+  AtomicUnorderedDirectMap<int, std::string> m(-10, 100);
+  EXPECT_TRUE(m.find(0) == m.cend());
+  EXPECT_TRUE(m.cbegin() == m.cend());
+
+  EXPECT_TRUE(m.emplace(-10, "lo").second);
+  EXPECT_TRUE(m.emplace(89, "hi").second);
+  EXPECT_FALSE(m.emplace(89, "again").second);
+  EXPECT_EQ(m.find(-10)->second, "lo");
+  EXPECT_EQ(m.find(89)->first, 89);
+  EXPECT_EQ(m.find(89)->second, "hi");
+
+  EXPECT_TRUE(m.find(-11) == m.cend());
+  EXPECT_TRUE(m.find(90) == m.cend());
+  EXPECT_THROW(m.emplace(90, "out"), std::out_of_range);
+  EXPECT_THROW(m.emplace(-11, "out"), std::out_of_range);
+
+  size_t count = 0;
+  for (auto iter = m.cbegin(); iter != m.cend(); ++iter) {
+    ++count;
+  }
+  EXPECT_EQ(count, 2);
+}
+
+TEST(AtomicUnorderedDirectMap, narrow_keys) {
+  // ranges that cross zero, where the difference of two promoted keys
+  // would be negative
+  AtomicUnorderedDirectMap<int16_t, int> m(-100, 300);
+  EXPECT_TRUE(m.emplace(-100, 1).second);
+  EXPECT_TRUE(m.emplace(20, 2).second);
+  EXPECT_TRUE(m.emplace(199, 3).second);
+  EXPECT_EQ(m.find(20)->second, 2);
+  EXPECT_TRUE(m.find(-101) == m.cend());
+  EXPECT_TRUE(m.find(200) == m.cend());
+  EXPECT_THROW(m.emplace(200, 4), std::out_of_range);
+
+  AtomicUnorderedDirectMap<int8_t, int> small(-128, 256);
+  for (int k = -128; k < 128; ++k) {
+    EXPECT_TRUE(small.emplace(int8_t(k), k).second);
+  }
+  for (int k = -128; k < 128; ++k) {
+    EXPECT_EQ(small.find(int8_t(k))->second, k);
+  }
+
+  AtomicUnorderedDirectMap<uint16_t, int> wide(65000, 536);
+  EXPECT_TRUE(wide.emplace(65535, 1).second);
+  EXPECT_THROW(wide.emplace(0, 2), std::out_of_range);
+  EXPECT_THROW(wide.emplace(64999, 3), std::out_of_range);
+}
+
+TEST(AtomicUnorderedDirectMap, throwing_constructor) {
+  AtomicUnorderedDirectMap<uint32_t, int> m(0, 10);
+  EXPECT_THROW(m.findOrConstruct(3, [](void *) { throw std::runtime_error(""); }),
+               std::runtime_error);
+  EXPECT_TRUE(m.find(3) == m.cend());
+  EXPECT_TRUE(m.emplace(3, 30).second);
+  EXPECT_EQ(m.find(3)->second, 30);
+}
+
+TEST(AtomicUnorderedDirectMap, concurrent_construct_once) {
+  AtomicUnorderedDirectMap<uint64_t, int> m(1000, 1000);
+  std::atomic<int> constructed{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (uint64_t k = 1000; k < 2000; ++k) {
+        auto rv = m.findOrConstruct(k, [&](void *raw) {
+          ++constructed;
+          new (raw) int(int(k));
+        });
+        EXPECT_EQ(rv.first->second, int(k));
+      }
+    });
+  }
+  for (auto &thr : threads) {
+    thr.join();
+  }
+  EXPECT_EQ(constructed.load(), 1000);
+}
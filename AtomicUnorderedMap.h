@@ -16,7 +16,9 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <functional>
@@ -36,6 +38,7 @@
 //#include <folly/Traits.h>
 #include "AtomicUnorderedMapUtils.h"
 #include "Bits.h"
+#include "HashReduce.h"
 //#include <folly/lang/Bits.h>
 //#include <folly/portability/SysMman.h>
 //#include <folly/portability/Unistd.h>
@@ -51,6 +54,97 @@ template <typename T>
 using aligned_storage_for_t =
     typename std::aligned_storage<sizeof(T), alignof(T)>::type;
 
+namespace detail {
+
+/// Holds a possibly stateful functor or policy.  Empty types are stored
+/// as a base class so that they take no space (the empty base
+/// optimization); Tag distinguishes holders of the same type.  mut()
+/// hands out a mutable reference through a const holder, for state like
+/// a tracer's that a const map still updates.
+template <typename T, int Tag,
+          bool = std::is_empty<T>::value && !std::is_final<T>::value>
+struct EboHolder : private T {
+  EboHolder() : T() {}
+  explicit EboHolder(const T &t) : T(t) {}
+  const T &get() const { return *this; }
+  T &mut() const { return const_cast<EboHolder &>(*this); }
+};
+
+template <typename T, int Tag>
+struct EboHolder<T, Tag, false> {
+  EboHolder() : value_() {}
+  explicit EboHolder(const T &t) : value_(t) {}
+  const T &get() const { return value_; }
+  T &mut() const { return value_; }
+
+ private:
+  mutable T value_;
+};
+
+}  // namespace detail
+
+/// The public operations whose duration a tracer can observe, see
+/// NoopTracer::onOpBegin
+enum class TracedOp : uint8_t {
+  FIND = 0,  // find() and resolve()
+  FIND_OR_CONSTRUCT = 1,  // findOrConstruct() and emplace()
+};
+
+/// NoopTracer is the default Tracer policy of AtomicUnorderedInsertMap.
+/// Every hook is an empty inline function, so a map instantiated with it
+/// compiles to exactly the code it would have without any tracing, and
+/// since the map holds its tracer as an empty base, it adds no bytes.
+///
+/// A custom tracer should derive from NoopTracer and hide only the hooks
+/// it cares about, which keeps it source compatible if hooks are added.
+/// Hooks are called from both readers and writers, concurrently and
+/// through a const map, so they must be const and thread-safe.  Slot
+/// indexes are passed as uint64_t regardless of the map's IndexType.
+struct NoopTracer {
+  /// find() walked the chain of home slot `home` comparing `probes` keys,
+  /// and found the key in slot `found` (0 on a miss)
+  void onLookup(uint64_t /* home */, uint64_t /* found */,
+                uint64_t /* probes */) const {}
+
+  /// findOrConstruct() is about to prepend to the non-empty chain of
+  /// `home` whose current first bucket is `chainHead`
+  void onCollision(uint64_t /* home */, uint64_t /* chainHead */) const {}
+
+  /// allocateNear(start) claimed `slot` after `tries` failed attempts
+  void onAllocate(uint64_t /* start */, uint64_t /* slot */,
+                  uint64_t /* tries */) const {}
+
+  /// allocationAttempt gave up on linear probing near `start` and is
+  /// picking a random slot for attempt number `tries`
+  void onRandomFallback(uint64_t /* start */, uint64_t /* tries */) const {}
+
+  /// allocateNear(start) ran out of attempts and is about to throw
+  void onAllocateFailed(uint64_t /* start */) const {}
+
+  /// the CAS that links a new bucket into the chain of `home` failed for
+  /// the `retries`-th time because of a concurrent insert
+  void onCasRetry(uint64_t /* home */, uint64_t /* retries */) const {}
+
+  /// findOrConstruct() finished; `slot` holds the key and `inserted` is
+  /// true iff this call was the one that linked it
+  void onInsert(uint64_t /* home */, uint64_t /* slot */,
+                bool /* inserted */) const {}
+
+  /// findOrConstruct() was called for a key whose hash is `hash`,
+  /// whether or not the key was already present
+  void onInsertHash(uint64_t /* hash */) const {}
+
+  /// updateValue() lost the CAS on the value in `slot` for the
+  /// `retries`-th time because of a concurrent update
+  void onValueRetry(uint64_t /* slot */, uint64_t /* retries */) const {}
+
+  /// a public operation is starting; the result is passed to the
+  /// matching onOpEnd, which is called even if the operation throws
+  uint64_t onOpBegin(TracedOp /* op */) const { return 0; }
+
+  void onOpEnd(TracedOp /* op */, uint64_t /* begin */) const {}
+};
+
 /// You're probably reading this because you are looking for an
 /// AtomicUnorderedMap<K,V> that is fully general, highly concurrent (for
 /// reads, writes, and iteration), and makes no performance compromises.
@@ -133,7 +227,18 @@ using aligned_storage_for_t =
 ///   assignment, and it is no longer lock-free.  It scales very well,
 ///   because the readers are still invisible (no cache line writes).
 ///
-///   LOCK: folly's SharedMutex would be a good choice here.
+///   LOCK: folly's SharedMutex would be a good choice here, but at
+///   per-entry granularity its size adds up.  LockedValue in
+///   RWSpinLock.h pairs each value with a 4 byte reader-writer spinlock.
+///
+///   RCU: the value holds an atomic pointer to an immutable version.
+///   Readers load it once; writers copy, modify and CAS in a new version
+///   and defer freeing the old one until no reader can see it.  See
+///   RcuValue in Rcu.h.
+///
+///   MVCC: like RCU, but old versions are kept while a snapshot may read
+///   them, so a reader can see many values as of one instant.  See
+///   MvccValue in Mvcc.h.
 ///
 /// MEMORY ALLOCATION
 ///
@@ -144,15 +249,39 @@ using aligned_storage_for_t =
 /// which is much faster than destructing all of the keys and values.
 /// Feel free to override if std::is_trivial_destructor isn't recognizing
 /// the triviality of your destructors.
+///
+/// For tiny maps (even the default size of ATOMIC_INSERT_MAP_SIZE rounds
+/// up to a page) use detail::SmallMapAlloc, which takes small slot arrays
+/// from the heap or from inline storage in the map, skipping the syscall.
+///
+/// HASHING
+///
+/// The map keeps the Hash and KeyEqual instances it was constructed with,
+/// so they may carry state (taking no space when they are empty).  If
+/// keys can come from untrusted input, use SeededHash from SeededHash.h,
+/// which gives every map instance its own random seed so that nobody can
+/// build long collision chains without knowing it.
+///
+/// TRACING
+///
+/// The Tracer template param receives a callback at each interesting
+/// point of find, findOrConstruct and slot allocation (see NoopTracer for
+/// the list), and around each public find and findOrConstruct so that it
+/// can time them.  The default NoopTracer compiles to nothing; see
+/// AtomicUnorderedMapTracers.h for tracers that record events or sample
+/// latencies.
 template <
     typename Key, typename Value, typename Hash = std::hash<Key>,
     typename KeyEqual = std::equal_to<Key>,
     bool SkipKeyValueDeletion = (std::is_trivially_destructible<Key>::value &&
                                  std::is_trivially_destructible<Value>::value),
     template <typename> class Atom = std::atomic, typename IndexType = uint32_t,
-    typename Allocator = folly::detail::MMapAlloc>
+    typename Allocator = folly::detail::MMapAlloc,
+    typename Tracer = NoopTracer>
 
-struct AtomicUnorderedInsertMap {
+struct AtomicUnorderedInsertMap : private detail::EboHolder<Hash, 0>,
+                                  private detail::EboHolder<KeyEqual, 1>,
+                                  private detail::EboHolder<Tracer, 2> {
   typedef Key key_type;
   typedef Value mapped_type;
   typedef std::pair<Key, Value> value_type;
@@ -162,6 +291,7 @@ struct AtomicUnorderedInsertMap {
   typedef KeyEqual key_equal;
   typedef const value_type &const_reference;
   typedef IndexType IndexType_t;
+  typedef Tracer tracer_type;
 
   typedef struct ConstIterator {
     ConstIterator(const AtomicUnorderedInsertMap &owner, IndexType slot)
@@ -221,7 +351,18 @@ struct AtomicUnorderedInsertMap {
   /// beyond which we will throw invalid_argument.
   explicit AtomicUnorderedInsertMap(size_t maxSize, float maxLoadFactor = 0.8f,
                                     const Allocator &alloc = Allocator())
-      : allocator_(alloc) {
+      : AtomicUnorderedInsertMap(maxSize, maxLoadFactor, Hash(), KeyEqual(),
+                                 alloc) {}
+
+  /// As above, but hashes and compares keys with copies of the given
+  /// functors, for example a SeededHash with a chosen seed.
+  AtomicUnorderedInsertMap(size_t maxSize, float maxLoadFactor,
+                           const Hash &hash,
+                           const KeyEqual &keyEqual = KeyEqual(),
+                           const Allocator &alloc = Allocator())
+      : detail::EboHolder<Hash, 0>(hash),
+        detail::EboHolder<KeyEqual, 1>(keyEqual),
+        allocator_(alloc) {
     size_t capacity = size_t(maxSize / std::min(1.0f, maxLoadFactor) + 128);
     size_t avail = size_t{1} << (8 * sizeof(IndexType) - 2);
     if (capacity > avail && maxSize < avail) {
@@ -247,12 +388,60 @@ struct AtomicUnorderedInsertMap {
   size_t SlotsNum() const { return numSlots_; }
   size_t MemoryCost() const { return mmapRequested_; }
 
-  ~AtomicUnorderedInsertMap() {
-    if (!SkipKeyValueDeletion) {
-      for (size_t i = 1; i < numSlots_; ++i) {
-        slots_[i].~Slot();
+  /// Measured memory usage of a map, see memoryStats()
+  struct MemoryStats {
+    /// bytes requested from the allocator for the slot array
+    size_t reservedBytes;
+    /// bytes of the slot array that are backed by resident pages, which
+    /// counts a partially resident page in full (clamped to reservedBytes)
+    size_t residentBytes;
+    /// bytes of the slot array that are backed by transparent huge pages
+    size_t hugePageBytes;
+    /// number of linked key-value pairs
+    size_t liveEntries;
+    /// bytes of slots that don't hold an entry (including the nil slot)
+    size_t emptySlotBytes;
+    /// per-slot bytes spent on the chain head and next index
+    size_t slotOverheadBytes;
+
+    double reservedBytesPerEntry() const {
+      return liveEntries ? double(reservedBytes) / liveEntries : 0.0;
+    }
+    double residentBytesPerEntry() const {
+      return liveEntries ? double(residentBytes) / liveEntries : 0.0;
+    }
+  };
+
+  /// Unlike MemoryCost(), which is the reservation, this asks the kernel
+  /// which pages of the slot array are actually resident.  It scans every
+  /// slot to count live entries, so it is O(SlotsNum()) and intended for
+  /// capacity planning and monitoring rather than hot paths.
+  MemoryStats memoryStats() const {
+    MemoryStats rv;
+    rv.reservedBytes = mmapRequested_;
+    rv.residentBytes = std::min(
+        mmapRequested_, detail::residentBytes(slots_, mmapRequested_));
+    rv.hugePageBytes = detail::hugePageBytes(slots_, mmapRequested_);
+    rv.liveEntries = 0;
+    for (size_t i = 1; i < numSlots_; ++i) {
+      if (slots_[i].state() == LINKED) {
+        ++rv.liveEntries;
       }
     }
+    rv.emptySlotBytes = (numSlots_ - rv.liveEntries) * sizeof(Slot);
+    rv.slotOverheadBytes = sizeof(Slot) - sizeof(value_type);
+    return rv;
+  }
+
+  hasher hash_function() const { return detail::EboHolder<Hash, 0>::get(); }
+
+  key_equal key_eq() const { return detail::EboHolder<KeyEqual, 1>::get(); }
+
+  /// The tracer instance that receives this map's hooks
+  Tracer &tracer() const { return detail::EboHolder<Tracer, 2>::mut(); }
+
+  ~AtomicUnorderedInsertMap() {
+    destroySlots(slots_);
     allocator_.deallocate(reinterpret_cast<char *>(slots_), mmapRequested_);
   }
 
@@ -277,11 +466,15 @@ struct AtomicUnorderedInsertMap {
   ///  })->first;
   template <typename Func>
   std::pair<const_iterator, bool> findOrConstruct(const Key &key, Func &&func) {
-    auto const slot = keyToSlotIdx(key);
+    OpScope scope(hooks(), TracedOp::FIND_OR_CONSTRUCT);
+    size_t const h = detail::EboHolder<Hash, 0>::get()(key);
+    hooks().onInsertHash(h);
+    auto const slot = hashToSlotIdx(h);
     auto prev = slots_[slot].headAndState_.load(std::memory_order_acquire);
 
     auto existing = find(key, slot);
     if (existing != 0) {
+      hooks().onInsert(slot, existing, false);
       return std::make_pair(ConstIterator(*this, existing), false);
     }
 
@@ -289,7 +482,10 @@ struct AtomicUnorderedInsertMap {
     new (&slots_[idx].keyValue().first) Key(key);
     func(static_cast<void *>(&slots_[idx].keyValue().second));
 
-    while (true) {
+    if ((prev >> 2) != 0) {
+      hooks().onCollision(slot, prev >> 2);
+    }
+    for (uint64_t retries = 1;; ++retries) {
       slots_[idx].next_ = prev >> 2;
 
       // we can merge the head update and the CONSTRUCTING -> LINKED update
@@ -306,10 +502,15 @@ struct AtomicUnorderedInsertMap {
         if (idx != slot) {
           slots_[idx].stateUpdate(CONSTRUCTING, LINKED);
         }
+        if (UNLIKELY(waiters_.load() != 0)) {
+          wakeWaiters(slot);
+        }
+        hooks().onInsert(slot, idx, true);
         return std::make_pair(ConstIterator(*this, idx), true);
       }
       // compare_exchange_strong updates its first arg on failure, so
       // there is no need to reread prev
+      hooks().onCasRetry(slot, retries);
 
       existing = find(key, slot);
       if (existing != 0) {
@@ -318,6 +519,7 @@ struct AtomicUnorderedInsertMap {
         slots_[idx].keyValue().second.~Value();
         slots_[idx].stateUpdate(CONSTRUCTING, EMPTY);
 
+        hooks().onInsert(slot, existing, false);
         return std::make_pair(ConstIterator(*this, existing), false);
       }
     }
@@ -333,10 +535,229 @@ struct AtomicUnorderedInsertMap {
         key, [&](void *raw) { new (raw) Value(std::forward<V>(value)); });
   }
 
+  /// Atomically replaces the value at iter, which must be a MutableAtom,
+  /// with func(current) and returns the new value.  func may be called
+  /// more than once if other threads update the value concurrently; each
+  /// failed CAS is reported to Tracer::onValueRetry.
+  template <typename Func, typename V = Value>
+  auto updateValue(const_iterator iter, Func &&func) const
+      -> decltype(std::declval<const V &>().data.load()) {
+    auto &data = iter->second.data;
+    auto prev = data.load(std::memory_order_relaxed);
+    for (uint64_t retries = 1;; ++retries) {
+      auto next = func(prev);
+      // strong, so that every reported retry was a real conflict
+      if (data.compare_exchange_strong(prev, next, std::memory_order_acq_rel,
+                                       std::memory_order_relaxed)) {
+        return next;
+      }
+      hooks().onValueRetry(iter.get_internal_slot(), retries);
+    }
+  }
+
   const_iterator find(const Key &key) const {
+    OpScope scope(hooks(), TracedOp::FIND);
     return ConstIterator(*this, find(key, keyToSlotIdx(key)));
   }
 
+  /// The first half of a split-phase lookup, see prepare()
+  class LookupToken {
+   public:
+    IndexType homeSlot() const { return home_; }
+
+   private:
+    friend struct AtomicUnorderedInsertMap;
+    LookupToken(const Key &key, IndexType home) : key_(&key), home_(home) {}
+
+    const Key *key_;
+    IndexType home_;
+  };
+
+  /// Split-phase find.  prepare(key) hashes key and prefetches its home
+  /// slot, which holds the chain head and usually the first key as
+  /// well; resolve(token) later walks the chain and returns the same
+  /// iterator find(key) would at that point.  Doing unrelated work in
+  /// between hides the cache miss of a large map without restructuring
+  /// the caller into batches:
+  ///
+  ///   auto token = m.prepare(key);
+  ///   ... parse, look at other tables ...
+  ///   auto iter = m.resolve(token);
+  ///
+  /// The token refers to key, which must stay alive until resolve.
+  LookupToken prepare(const Key &key) const {
+    auto const slot = keyToSlotIdx(key);
+    prefetchSlot(slot);
+    return LookupToken(key, slot);
+  }
+
+  const_iterator resolve(const LookupToken &token) const {
+    OpScope scope(hooks(), TracedOp::FIND);
+    return ConstIterator(*this, find(*token.key_, token.home_));
+  }
+
+  /// Looks up keys[0] .. keys[n - 1] and calls func(i, iter) with the
+  /// result for keys[i], in order.  Home slots are computed kBatchKeys at
+  /// a time, with the SIMD kernels of HashReduce.h when Hash is std::hash
+  /// or SeededHash of an integer key, and a chunk's home slots are all
+  /// prefetched before its chains are walked, which overlaps the cache
+  /// misses of a large map.  The tracer sees each lookup as a FIND.
+  template <typename Func>
+  void findBatch(const Key *keys, size_t n, Func &&func) const {
+    IndexType homes[kBatchKeys];
+    for (size_t base = 0; base < n; base += kBatchKeys) {
+      auto count = std::min<size_t>(kBatchKeys, n - base);
+      homeSlots(keys + base, count, homes, detail::BatchHash<Hash, Key>());
+      for (size_t i = 0; i < count; ++i) {
+        prefetchSlot(homes[i]);
+      }
+      for (size_t i = 0; i < count; ++i) {
+        IndexType found;
+        {
+          OpScope scope(hooks(), TracedOp::FIND);
+          found = find(keys[base + i], homes[i]);
+        }
+        func(base + i, ConstIterator(*this, found));
+      }
+    }
+  }
+
+  /// Blocks until key is present or timeout expires, returning the
+  /// iterator for key or cend() on timeout.  Waiters park on a futex
+  /// keyed by the key's home slot, and findOrConstruct only makes the
+  /// wake-up syscall while some thread is waiting on this map, so inserts
+  /// pay one load of an otherwise untouched counter when nobody waits.
+  template <class Rep, class Period>
+  const_iterator waitFor(const Key &key,
+                         std::chrono::duration<Rep, Period> timeout) const {
+    auto const slot = keyToSlotIdx(key);
+    auto existing = find(key, slot);
+    if (existing != 0) {
+      return ConstIterator(*this, existing);
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    auto &epoch = detail::ParkingLot::bucket(this, slot);
+    waiters_.fetch_add(1);
+    // order the waiter registration before the re-check of the chain, so
+    // that an insert either sees us waiting or we see its key
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (true) {
+      auto e = epoch.load(std::memory_order_acquire);
+      existing = find(key, slot);
+      auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           deadline - std::chrono::steady_clock::now())
+                           .count();
+      if (existing != 0 || remaining <= 0) {
+        break;
+      }
+      detail::futexWait(&epoch, e, remaining);
+    }
+    waiters_.fetch_sub(1);
+    return ConstIterator(*this, existing);
+  }
+
+  /// Rebuilds the slot array so that every chain occupies consecutive
+  /// slots starting at its home slot (or at the first free slot after
+  /// it, if an earlier chain spilled over), undoing the scatter that
+  /// allocateNear's random fallback leaves behind.  find() then walks a
+  /// chain within one or two cache lines, which mostly helps misses.
+  ///
+  /// This is an offline operation for maps that have reached a quiescent
+  /// phase, such as right after a batch load:
+  ///
+  /// * it must not run concurrently with any other access to the map
+  /// * it invalidates all iterators, internal slot indexes and pointers
+  ///   or references to keys and values, because entries are moved
+  /// * it temporarily needs a second slot array
+  ///
+  /// Entries are moved if neither the key's nor the value's move
+  /// constructor can throw, and copied otherwise, so if a copy throws
+  /// the map is left unchanged.  (Like std::move_if_noexcept, a key or
+  /// value that can't be copied is moved anyway, without that promise.)
+  void compact() {
+    // moving only one half of an entry could leave it behind if the
+    // other half's copy throws
+    typedef std::integral_constant<
+        bool, (std::is_nothrow_move_constructible<Key>::value &&
+               std::is_nothrow_move_constructible<Value>::value) ||
+                  !std::is_copy_constructible<Key>::value ||
+                  !std::is_copy_constructible<Value>::value>
+        MoveEntries;
+    typedef typename std::conditional<MoveEntries::value, Key &&,
+                                      const Key &>::type KeySource;
+    typedef typename std::conditional<MoveEntries::value, Value &&,
+                                      const Value &>::type ValueSource;
+
+    Slot *fresh = reinterpret_cast<Slot *>(allocator_.allocate(mmapRequested_));
+    if (!folly::detail::GivesZeroFilledMemory<Allocator>::value) {
+      memset(static_cast<void *>(fresh), 0, mmapRequested_);
+    }
+    fresh[0].stateUpdate(EMPTY, CONSTRUCTING);
+
+    // cursor only moves forward; chains that run off the end wrap around
+    // to free slots from the front
+    size_t cursor = 1;
+    size_t wrapCursor = 1;
+    auto nextFree = [&](size_t home) {
+      cursor = std::max(cursor, home);
+      while (cursor < numSlots_ && fresh[cursor].state() != EMPTY) {
+        ++cursor;
+      }
+      if (cursor < numSlots_) {
+        return IndexType(cursor++);
+      }
+      while (fresh[wrapCursor].state() != EMPTY) {
+        ++wrapCursor;
+      }
+      return IndexType(wrapCursor++);
+    };
+
+    try {
+      for (size_t home = 0; home < numSlots_; ++home) {
+        IndexType newHead = 0;
+        IndexType tail = 0;
+        auto hs = slots_[home].headAndState_.load(std::memory_order_acquire);
+        for (IndexType src = hs >> 2; src != 0; src = slots_[src].next_) {
+          assert(slots_[src].state() == LINKED);
+          auto dst = nextFree(home);
+          fresh[dst].stateUpdate(EMPTY, CONSTRUCTING);
+          try {
+            auto &kv = slots_[src].keyValue();
+            new (&fresh[dst].keyValue().first)
+                Key(static_cast<KeySource>(const_cast<Key &>(kv.first)));
+            try {
+              new (&fresh[dst].keyValue().second)
+                  Value(static_cast<ValueSource>(kv.second));
+            } catch (...) {
+              fresh[dst].keyValue().first.~Key();
+              throw;
+            }
+          } catch (...) {
+            fresh[dst].stateUpdate(CONSTRUCTING, EMPTY);
+            throw;
+          }
+          fresh[dst].stateUpdate(CONSTRUCTING, LINKED);
+          if (tail == 0) {
+            newHead = dst;
+          } else {
+            fresh[tail].next_ = dst;
+          }
+          tail = dst;
+        }
+        fresh[home].headAndState_ += IndexType(newHead << 2);
+      }
+    } catch (...) {
+      destroySlots(fresh);
+      allocator_.deallocate(reinterpret_cast<char *>(fresh), mmapRequested_);
+      throw;
+    }
+
+    destroySlots(slots_);
+    allocator_.deallocate(reinterpret_cast<char *>(slots_), mmapRequested_);
+    slots_ = fresh;
+  }
+
   const_iterator cbegin() const {
     IndexType slot = numSlots_ - 1;
     while (slot > 0 && slots_[slot].state() != LINKED) {
@@ -352,6 +773,8 @@ struct AtomicUnorderedInsertMap {
     kMaxAllocationTries = 1000,  // after this we throw
   };
 
+  enum : size_t { kBatchKeys = 16 };
+
   enum BucketState : IndexType {
     EMPTY = 0,
     CONSTRUCTING = 1,
@@ -420,8 +843,34 @@ struct AtomicUnorderedInsertMap {
   Allocator allocator_;
   Slot *slots_;
 
+  /// The tracer, for calling its hooks
+  const Tracer &hooks() const { return detail::EboHolder<Tracer, 2>::get(); }
+
+  /// Brackets a public operation with the tracer's onOpBegin/onOpEnd
+  struct OpScope {
+    OpScope(const Tracer &tracer, TracedOp op)
+        : tracer_(tracer), op_(op), begin_(tracer.onOpBegin(op)) {}
+    ~OpScope() { tracer_.onOpEnd(op_, begin_); }
+
+    const Tracer &tracer_;
+    TracedOp op_;
+    uint64_t begin_;
+  };
+
+  /// Number of threads blocked in waitFor
+  mutable std::atomic<uint32_t> waiters_{0};
+
+  void wakeWaiters(IndexType slot) {
+    auto &epoch = detail::ParkingLot::bucket(this, slot);
+    epoch.fetch_add(1, std::memory_order_release);
+    detail::futexWakeAll(&epoch);
+  }
+
   IndexType keyToSlotIdx(const Key &key) const {
-    size_t h = hasher()(key);
+    return hashToSlotIdx(detail::EboHolder<Hash, 0>::get()(key));
+  }
+
+  IndexType hashToSlotIdx(size_t h) const {
     h &= slotMask_;
     while (h >= numSlots_) {
       h -= numSlots_;
@@ -429,14 +878,53 @@ struct AtomicUnorderedInsertMap {
     return h;
   }
 
+  /// keyToSlotIdx of n <= kBatchKeys keys, vectorized where possible
+  void homeSlots(const Key *keys, size_t n, IndexType *out,
+                 std::true_type) const {
+    typedef detail::BatchHash<Hash, Key> BatchHash;
+    uint64_t wide[kBatchKeys];
+    uint64_t homes[kBatchKeys];
+    for (size_t i = 0; i < n; ++i) {
+      wide[i] = BatchHash::key(keys[i]);
+    }
+    detail::hashReduce(BatchHash::params(hash_function(), slotMask_, numSlots_),
+                       wide, n, homes);
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = IndexType(homes[i]);
+    }
+  }
+
+  void homeSlots(const Key *keys, size_t n, IndexType *out,
+                 std::false_type) const {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = keyToSlotIdx(keys[i]);
+    }
+  }
+
+  void prefetchSlot(IndexType slot) const {
+#if defined(__GNUC__)
+    auto p = reinterpret_cast<const char *>(&slots_[slot]);
+    __builtin_prefetch(p);
+    // a slot with a large key or value can straddle two lines
+    __builtin_prefetch(p + sizeof(Slot) - 1);
+#else
+    (void)slot;
+#endif
+  }
+
   IndexType find(const Key &key, IndexType slot) const {
-    KeyEqual ke = {};
+    auto const &ke = detail::EboHolder<KeyEqual, 1>::get();
+    auto const home = slot;
+    uint64_t probes = 0;
     auto hs = slots_[slot].headAndState_.load(std::memory_order_acquire);
     for (slot = hs >> 2; slot != 0; slot = slots_[slot].next_) {
+      ++probes;
       if (ke(key, slots_[slot].keyValue().first)) {
+        hooks().onLookup(home, slot, probes);
         return slot;
       }
     }
+    hooks().onLookup(home, 0, probes);
     return 0;
   }
 
@@ -449,15 +937,19 @@ struct AtomicUnorderedInsertMap {
       if ((prev & 3) == EMPTY &&
           slots_[slot].headAndState_.compare_exchange_strong(
               prev, prev + CONSTRUCTING - EMPTY)) {
+        hooks().onAllocate(start, slot, tries);
         return slot;
       }
     }
+    hooks().onAllocateFailed(start);
     throw std::bad_alloc();
   }
 
 	template <typename INT>
   static INT random_num(size_t max) {
-    static thread_local std::mt19937 generator;
+    // seeded per thread, otherwise every thread probes the same sequence
+    // of random slots and trails behind the slots the others claimed
+    static thread_local std::mt19937 generator{std::random_device{}()};
     std::uniform_int_distribution<INT> distribution(0, max);
 
     return distribution(generator);
@@ -470,12 +962,21 @@ struct AtomicUnorderedInsertMap {
     if (LIKELY(tries < 8 && start + tries < numSlots_)) {
       return IndexType(start + tries);
     } else {
-      IndexType rv = random_num<IndexType>(numSlots_);
+      hooks().onRandomFallback(start, tries);
+      IndexType rv = random_num<IndexType>(numSlots_ - 1);
       assert(rv < numSlots_);
       return rv;
     }
   }
 
+  void destroySlots(Slot *slots) {
+    if (!SkipKeyValueDeletion) {
+      for (size_t i = 1; i < numSlots_; ++i) {
+        slots[i].~Slot();
+      }
+    }
+  }
+
   void zeroFillSlots() {
     using folly::detail::GivesZeroFilledMemory;
     if (!GivesZeroFilledMemory<Allocator>::value) {
@@ -494,10 +995,11 @@ template <typename Key, typename Value, typename Hash = std::hash<Key>,
               (std::is_trivially_destructible<Key>::value &&
                std::is_trivially_destructible<Value>::value),
           template <typename> class Atom = std::atomic,
-          typename Allocator = folly::detail::MMapAlloc>
+          typename Allocator = folly::detail::MMapAlloc,
+          typename Tracer = NoopTracer>
 using AtomicUnorderedInsertMap64 =
     AtomicUnorderedInsertMap<Key, Value, Hash, KeyEqual, SkipKeyValueDeletion,
-                             Atom, uint64_t, Allocator>;
+                             Atom, uint64_t, Allocator, Tracer>;
 
 /// MutableAtom is a tiny wrapper than gives you the option of atomically
 /// updating values inserted into an AtomicUnorderedInsertMap<K,
@@ -0,0 +1,1134 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Benchmarks for AtomicUnorderedInsertMap.  Build with `make bench` and
+// pass suite names (or substrings of them) to run a subset, and --perf to
+// add hardware counters per operation where perf_event_open allows it.
+// --pin=compact|scatter|physical pins multi-threaded suites' threads
+// according to the CPU topology:
+//
+//   ./bench footprint --perf
+//   ./bench scaling --pin=physical
+
+#include <malloc.h>
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "AtomicUnorderedBlobMap.h"
+#include "AtomicUnorderedDirectMap.h"
+#include "AtomicUnorderedMap.h"
+#include "AtomicUnorderedMapTracers.h"
+#include "Benchmark.h"
+#include "HashReduce.h"
+#include "KeyDictionary.h"
+#include "SeededHash.h"
+#include "TieredMap.h"
+
+using namespace folly;
+using namespace folly::bench;
+
+namespace {
+
+struct Counter {
+  Counter() = default;
+  Counter(const Counter &other) {
+    a.store(other.a.load());
+    b.store(other.b.load());
+    c.store(other.c.load());
+  }
+
+  std::atomic_int a{0};
+  std::atomic_int b{0};
+  std::atomic_int c{0};
+};
+
+struct Frame {
+  uintptr_t frame[32];
+};
+
+bool operator==(const Frame &lhs, const Frame &rhs) {
+  return std::equal(lhs.frame, lhs.frame + 32, rhs.frame, rhs.frame + 32);
+}
+
+struct FrameHash {
+  size_t operator()(const Frame &f) const {
+    size_t res = 0;
+    for (size_t i = 0; i < 32; ++i) {
+      res ^= f.frame[i];
+    }
+    return res;
+  }
+};
+
+template <typename K>
+struct KeyTraits;
+
+template <>
+struct KeyTraits<int> {
+  typedef std::hash<int> Hash;
+  static const char *name() { return "int"; }
+  static int make(size_t i) { return int(i); }
+};
+
+template <>
+struct KeyTraits<uint64_t> {
+  typedef std::hash<uint64_t> Hash;
+  static const char *name() { return "u64"; }
+  static uint64_t make(size_t i) { return i * 0x9e3779b97f4a7c15ULL; }
+};
+
+template <>
+struct KeyTraits<Frame> {
+  typedef FrameHash Hash;
+  static const char *name() { return "Frame"; }
+  static Frame make(size_t i) {
+    Frame f = {};
+    f.frame[0] = i;
+    f.frame[1] = i * 31;
+    return f;
+  }
+};
+
+template <typename V>
+struct ValueTraits;
+
+template <>
+struct ValueTraits<int> {
+  static const char *name() { return "int"; }
+  static int make(size_t i) { return int(i); }
+};
+
+template <>
+struct ValueTraits<uint64_t> {
+  static const char *name() { return "u64"; }
+  static uint64_t make(size_t i) { return i; }
+};
+
+template <>
+struct ValueTraits<MutableAtom<uint32_t>> {
+  static const char *name() { return "MutableAtom<u32>"; }
+  static uint32_t make(size_t i) { return uint32_t(i); }
+};
+
+template <>
+struct ValueTraits<MutableData<Counter>> {
+  static const char *name() { return "MutableData<Counter>"; }
+  static Counter make(size_t) { return Counter(); }
+};
+
+template <typename IndexType>
+const char *indexName() {
+  return sizeof(IndexType) == 2 ? "u16" : sizeof(IndexType) == 4 ? "u32"
+                                                                 : "u64";
+}
+
+// Mirrors IndexTypesToTest in AtomicUnorderedMapTest.cpp
+using IndexTypesToBench = TypeList<uint16_t, uint32_t, uint64_t>;
+
+template <typename K, typename V>
+struct KV {};
+
+using KeyValuesToBench =
+    TypeList<KV<int, int>, KV<uint64_t, uint64_t>,
+             KV<uint64_t, MutableAtom<uint32_t>>,
+             KV<Frame, MutableData<Counter>>>;
+
+template <typename K, typename V, typename IndexType>
+void footprintRow(Table &table, size_t size, float loadFactor) {
+  typedef AtomicUnorderedInsertMap<K, V, typename KeyTraits<K>::Hash,
+                                   std::equal_to<K>, true, std::atomic,
+                                   IndexType>
+      Map;
+
+  std::string label = std::string(KeyTraits<K>::name()) + "->" +
+                      ValueTraits<V>::name();
+  std::unique_ptr<Map> m;
+  double constructNs;
+  try {
+    constructNs = timeNs([&] { m.reset(new Map(size, loadFactor)); });
+  } catch (std::invalid_argument &) {
+    // doesn't fit in IndexType
+    return;
+  }
+
+  double insertNs;
+  try {
+    insertNs = timeNs([&] {
+      for (size_t i = 0; i < size; ++i) {
+        m->emplace(KeyTraits<K>::make(i), ValueTraits<V>::make(i));
+      }
+    });
+  } catch (std::bad_alloc &) {
+    table.addRow({label, indexName<IndexType>(), fmt(loadFactor, 2),
+                  std::to_string(size), "bad_alloc"});
+    return;
+  }
+
+  size_t lookups = std::max<size_t>(size, 1000000);
+  auto lookup = measure(lookups, [&] {
+    for (size_t i = 0; i < lookups; ++i) {
+      auto k = KeyTraits<K>::make(((i * 7919) ^ (i * 4001)) % size);
+      auto iter = m->find(k);
+      doNotOptimizeAway(iter);
+    }
+  });
+
+  auto stats = m->memoryStats();
+  table.addRow(concat({label, indexName<IndexType>(), fmt(loadFactor, 2),
+                       std::to_string(size),
+                       fmt(stats.reservedBytesPerEntry(), 1),
+                       fmt(stats.residentBytesPerEntry(), 1),
+                       fmt(constructNs / 1000, 1),
+                       fmt(size * 1e3 / insertNs, 2)},
+                      lookup.cells()));
+}
+
+template <typename K, typename V, typename IndexType>
+void footprintRowFor(KV<K, V>, IndexType, Table &table, size_t size,
+                     float loadFactor) {
+  footprintRow<K, V, IndexType>(table, size, loadFactor);
+}
+
+void footprint() {
+  Table table("footprint: bytes per entry, insert throughput and lookup "
+              "latency by (Key->Value, IndexType, load factor, size)",
+              concat({"key->value", "index", "lf", "size", "rsvd B/e",
+                      "res B/e", "ctor us", "insert M/s"},
+                     Measurement::columns("lookup")));
+  forEachType(KeyValuesToBench{}, [&](auto kv) {
+    forEachType(IndexTypesToBench{}, [&](auto index) {
+      for (size_t size : {1000, 10000, 100000}) {
+        for (float lf : {0.5f, 0.8f, 0.95f}) {
+          footprintRowFor(kv, index, table, size, lf);
+        }
+      }
+    });
+  });
+  table.print();
+}
+
+template <typename Allocator>
+Measurement createDestroy(size_t size, size_t rounds) {
+  typedef AtomicUnorderedInsertMap<uint64_t, uint64_t, std::hash<uint64_t>,
+                                   std::equal_to<uint64_t>, true, std::atomic,
+                                   uint32_t, Allocator>
+      Map;
+  // warm up the pool (a no-op for MMapAlloc)
+  { Map m(size); }
+  return measure(rounds, [&] {
+    for (size_t i = 0; i < rounds; ++i) {
+      Map m(size);
+      m.emplace(i, i);
+      doNotOptimizeAway(m.find(i));
+    }
+  });
+}
+
+// Resident memory of the whole process, from /proc/self/statm
+size_t processResidentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0;
+  size_t resident = 0;
+  statm >> pages >> resident;
+  return resident * size_t(sysconf(_SC_PAGESIZE));
+}
+
+// Constructs a map of n entries, fills it and destroys it, repeatedly,
+// then measures the resident memory of liveMaps filled maps
+template <typename Allocator>
+std::vector<std::string> smallMapCells(size_t n, size_t rounds,
+                                       size_t liveMaps) {
+  typedef AtomicUnorderedInsertMap<uint32_t, uint32_t, std::hash<uint32_t>,
+                                   std::equal_to<uint32_t>, true, std::atomic,
+                                   uint32_t, Allocator>
+      Map;
+  auto cycle = measure(rounds, [&] {
+    for (size_t i = 0; i < rounds; ++i) {
+      std::unique_ptr<Map> m(new Map(n));
+      for (uint32_t k = 0; k < n; ++k) {
+        m->emplace(k, k);
+      }
+      doNotOptimizeAway(m->find(0));
+    }
+  });
+  auto before = processResidentBytes();
+  std::vector<std::unique_ptr<Map>> maps;
+  for (size_t i = 0; i < liveMaps; ++i) {
+    maps.emplace_back(new Map(n));
+    for (uint32_t k = 0; k < n; ++k) {
+      maps.back()->emplace(k, k);
+    }
+  }
+  auto perMap = double(processResidentBytes() - before) / liveMaps;
+  return concat(cycle.cells(), {fmt(perMap, 0)});
+}
+
+void smallMaps() {
+  Table table("small_maps: build, fill and destroy a map of N u32 -> u32 "
+              "entries; resident bytes per map with 1000 alive",
+              concat(concat(concat({"N"}, concat(Measurement::columns("mmap"),
+                                                 {"mmap B"})),
+                            concat(Measurement::columns("heap"), {"heap B"})),
+                     concat(Measurement::columns("inline"), {"inline B"})));
+  for (size_t n : {1, 10, 100, 1000}) {
+    size_t rounds = std::max<size_t>(1000, 100000 / n);
+    table.addRow(concat(
+        concat(concat({std::to_string(n)},
+                      smallMapCells<detail::MMapAlloc>(n, rounds, 1000)),
+               smallMapCells<detail::SmallMapAlloc<>>(n, rounds, 1000)),
+        smallMapCells<detail::SmallMapAlloc<4096>>(n, rounds, 1000)));
+  }
+  table.print();
+}
+
+void construction() {
+  Table table("construction: create, insert one key and destroy a map",
+              concat(concat({"size"}, Measurement::columns("mmap")),
+                     Measurement::columns("pooled")));
+  for (size_t size : {100, 1000, 10000, 100000, 1000000}) {
+    size_t rounds = std::max<size_t>(10, 1000000 / size);
+    table.addRow(
+        concat(concat({std::to_string(size)},
+                      createDestroy<detail::MMapAlloc>(size, rounds).cells()),
+               createDestroy<detail::PooledMMapAlloc>(size, rounds).cells()));
+  }
+  table.print();
+}
+
+struct ChainTracer : NoopTracer {
+  mutable uint64_t maxProbes = 0;
+  void onLookup(uint64_t, uint64_t, uint64_t probes) const {
+    maxProbes = std::max(maxProbes, probes);
+  }
+};
+
+template <typename Hash>
+void collisionAttackRow(Table &table, const char *hashName, size_t numKeys,
+                        bool attack) {
+  typedef AtomicUnorderedInsertMap<uint64_t, uint64_t, Hash,
+                                   std::equal_to<uint64_t>, true, std::atomic,
+                                   uint32_t, detail::MMapAlloc, ChainTracer>
+      Map;
+  size_t maxSize = 100000;
+  Map m(maxSize);
+
+  // An attacker who knows maxSize (and so the slot mask) picks multiples
+  // of the mask + 1, which std::hash sends to the same home slot
+  uint64_t stride = nextPowTwo(size_t(maxSize / 0.8f + 128) * 4);
+  auto key = [&](size_t i) {
+    return attack ? i * stride : i * 0x9e3779b97f4a7c15ULL;
+  };
+  auto insert = measure(numKeys, [&] {
+    for (size_t i = 0; i < numKeys; ++i) {
+      m.emplace(key(i), i);
+    }
+  });
+  m.tracer().maxProbes = 0;
+  size_t lookups = std::max<size_t>(numKeys, 100000);
+  auto lookup = measure(lookups, [&] {
+    for (size_t i = 0; i < lookups; ++i) {
+      doNotOptimizeAway(m.find(key((i * 7919) % numKeys)));
+    }
+  });
+  table.addRow(concat(concat({hashName, attack ? "attack" : "benign",
+                              std::to_string(numKeys),
+                              std::to_string(m.tracer().maxProbes)},
+                             insert.cells()),
+                      lookup.cells()));
+}
+
+void collisionAttack() {
+  Table table("collision_attack: keys crafted to share a home slot under "
+              "std::hash, vs per-map SeededHash",
+              concat(concat({"hash", "keys", "count", "max chain"},
+                            Measurement::columns("insert")),
+                     Measurement::columns("lookup")));
+  for (bool attack : {false, true}) {
+    for (size_t numKeys : {1000, 5000}) {
+      collisionAttackRow<std::hash<uint64_t>>(table, "std::hash", numKeys,
+                                              attack);
+      collisionAttackRow<SeededHash<uint64_t>>(table, "SeededHash", numKeys,
+                                               attack);
+    }
+  }
+  table.print();
+}
+
+template <typename Map>
+Measurement lookupAll(const Map &m, size_t numKeys, uint64_t salt) {
+  size_t lookups = std::max<size_t>(numKeys, 1000000);
+  return measure(lookups, [&] {
+    for (size_t i = 0; i < lookups; ++i) {
+      uint64_t k = ((i * 7919) % numKeys) * 0x9e3779b97f4a7c15ULL + salt;
+      doNotOptimizeAway(m.find(k));
+    }
+  });
+}
+
+void compaction() {
+  Table table("compaction: lookups before and after compact() of a map "
+              "filled to its load factor",
+              concat(concat(concat(concat({"lf", "keys"},
+                                          Measurement::columns("hit")),
+                                   Measurement::columns("miss")),
+                            concat({"compact ms"}, Measurement::columns("hit'"))),
+                     Measurement::columns("miss'")));
+  for (float loadFactor : {0.8f, 0.95f}) {
+    for (size_t numKeys : {10000, 1000000}) {
+      AtomicUnorderedInsertMap<uint64_t, uint64_t> m(numKeys, loadFactor);
+      for (size_t i = 0; i < numKeys; ++i) {
+        m.emplace(i * 0x9e3779b97f4a7c15ULL, i);
+      }
+      auto hit = lookupAll(m, numKeys, 0);
+      auto miss = lookupAll(m, numKeys, 1);
+      auto ms = timeNs([&] { m.compact(); }) / 1e6;
+      auto hitAfter = lookupAll(m, numKeys, 0);
+      auto missAfter = lookupAll(m, numKeys, 1);
+      table.addRow(concat(
+          concat(concat(concat({fmt(loadFactor), std::to_string(numKeys)},
+                               hit.cells()),
+                        miss.cells()),
+                 concat({fmt(ms)}, hitAfter.cells())),
+          missAfter.cells()));
+    }
+  }
+  table.print();
+}
+
+// The maps compared by the baseline suite, behind a common find/insert
+// interface.  Each is sized for the whole key space up front.
+
+struct AtomicMapAdapter {
+  static const char *name() { return "AtomicUIM"; }
+  explicit AtomicMapAdapter(size_t capacity) : map(capacity) {}
+  bool find(uint64_t key) const { return map.find(key) != map.cend(); }
+  void insert(uint64_t key, uint64_t value) { map.emplace(key, value); }
+
+  AtomicUnorderedInsertMap<uint64_t, uint64_t> map;
+};
+
+struct MutexMapAdapter {
+  static const char *name() { return "mutex"; }
+  explicit MutexMapAdapter(size_t capacity) { map.reserve(capacity); }
+  bool find(uint64_t key) {
+    std::lock_guard<std::mutex> g(lock);
+    return map.find(key) != map.end();
+  }
+  void insert(uint64_t key, uint64_t value) {
+    std::lock_guard<std::mutex> g(lock);
+    map.emplace(key, value);
+  }
+
+  std::mutex lock;
+  std::unordered_map<uint64_t, uint64_t> map;
+};
+
+// std::shared_mutex is C++17; shared_timed_mutex is the C++14 equivalent
+struct SharedMutexMapAdapter {
+  static const char *name() { return "shared_mutex"; }
+  explicit SharedMutexMapAdapter(size_t capacity) { map.reserve(capacity); }
+  bool find(uint64_t key) {
+    std::shared_lock<std::shared_timed_mutex> g(lock);
+    return map.find(key) != map.end();
+  }
+  void insert(uint64_t key, uint64_t value) {
+    std::lock_guard<std::shared_timed_mutex> g(lock);
+    map.emplace(key, value);
+  }
+
+  std::shared_timed_mutex lock;
+  std::unordered_map<uint64_t, uint64_t> map;
+};
+
+struct ShardedMapAdapter {
+  enum : size_t { kShards = 64 };
+
+  static const char *name() { return "sharded64"; }
+  explicit ShardedMapAdapter(size_t capacity) {
+    for (auto &shard : shards) {
+      shard.map.reserve(capacity / kShards + 1);
+    }
+  }
+  bool find(uint64_t key) {
+    auto &shard = shardFor(key);
+    std::lock_guard<std::mutex> g(shard.lock);
+    return shard.map.find(key) != shard.map.end();
+  }
+  void insert(uint64_t key, uint64_t value) {
+    auto &shard = shardFor(key);
+    std::lock_guard<std::mutex> g(shard.lock);
+    shard.map.emplace(key, value);
+  }
+
+  struct alignas(64) Shard {
+    std::mutex lock;
+    std::unordered_map<uint64_t, uint64_t> map;
+  };
+
+  // the top bits, so that shard choice is independent of bucket choice
+  Shard &shardFor(uint64_t key) {
+    return shards[(twang_mix64(key) >> 58) % kShards];
+  }
+
+  Shard shards[kShards];
+};
+
+// Each thread draws keys uniformly from keySpace keys, half of which are
+// present at the start, and inserts instead of finding with probability
+// writePct / 100.  Returns aggregate millions of ops per second.
+template <typename Adapter>
+double baselineMops(size_t keySpace, int writePct, size_t numThreads,
+                    size_t totalOps) {
+  Adapter adapter(keySpace);
+  for (size_t i = 0; i < keySpace; i += 2) {
+    adapter.insert(KeyTraits<uint64_t>::make(i), i);
+  }
+  size_t opsPerThread = totalOps / numThreads;
+  auto ns = timeThreadsNs(numThreads, [&](size_t t) {
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (t + 1);
+    size_t hits = 0;
+    for (size_t i = 0; i < opsPerThread; ++i) {
+      rng ^= rng << 13;
+      rng ^= rng >> 7;
+      rng ^= rng << 17;
+      auto k = (rng >> 8) % keySpace;
+      if (int(rng % 100) < writePct) {
+        adapter.insert(KeyTraits<uint64_t>::make(k), k);
+      } else {
+        hits += adapter.find(KeyTraits<uint64_t>::make(k)) ? 1 : 0;
+      }
+    }
+    doNotOptimizeAway(hits);
+  });
+  return opsPerThread * numThreads / ns * 1e3;
+}
+
+void baseline() {
+  size_t keySpace = 100000;
+  size_t totalOps = 2000000;
+  Table table("baseline: Mops/s of AtomicUnorderedInsertMap vs "
+              "std::unordered_map under a mutex, a shared mutex and 64 "
+              "mutex shards; " +
+                  std::to_string(keySpace) + " keys, half present",
+              {"write %", "threads", AtomicMapAdapter::name(),
+               MutexMapAdapter::name(), SharedMutexMapAdapter::name(),
+               ShardedMapAdapter::name()});
+  for (int writePct : {0, 5, 50}) {
+    for (size_t numThreads : {1, 2, 4, 8, 16, 32, 64}) {
+      table.addRow(
+          {std::to_string(writePct), std::to_string(numThreads),
+           fmt(baselineMops<AtomicMapAdapter>(keySpace, writePct, numThreads,
+                                              totalOps)),
+           fmt(baselineMops<MutexMapAdapter>(keySpace, writePct, numThreads,
+                                             totalOps)),
+           fmt(baselineMops<SharedMutexMapAdapter>(keySpace, writePct,
+                                                   numThreads, totalOps)),
+           fmt(baselineMops<ShardedMapAdapter>(keySpace, writePct,
+                                               numThreads, totalOps))});
+    }
+  }
+  table.print();
+}
+
+enum class ScalingWorkload { FIND, EMPLACE, MIXED };
+
+// Millions of ops per second for numThreads threads sharing one map.
+// FIND looks up present keys, EMPLACE inserts keys private to each
+// thread, and MIXED does 90% FIND and 10% EMPLACE.
+double scalingMops(ScalingWorkload workload, size_t numThreads,
+                   size_t opsPerThread) {
+  size_t prefill = 100000;
+  AtomicUnorderedInsertMap<uint64_t, uint64_t> m(prefill +
+                                                 numThreads * opsPerThread);
+  for (size_t i = 0; i < prefill; ++i) {
+    m.emplace(KeyTraits<uint64_t>::make(i), i);
+  }
+  auto ns = timeThreadsNs(numThreads, [&](size_t t) {
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (t + 1);
+    size_t next = prefill + t * opsPerThread;
+    size_t hits = 0;
+    for (size_t i = 0; i < opsPerThread; ++i) {
+      rng ^= rng << 13;
+      rng ^= rng >> 7;
+      rng ^= rng << 17;
+      bool insert = workload == ScalingWorkload::EMPLACE ||
+                    (workload == ScalingWorkload::MIXED && rng % 10 == 0);
+      if (insert) {
+        m.emplace(KeyTraits<uint64_t>::make(next), next);
+        ++next;
+      } else {
+        hits += m.find(KeyTraits<uint64_t>::make((rng >> 8) % prefill)) !=
+                m.cend();
+      }
+    }
+    doNotOptimizeAway(hits);
+  });
+  return numThreads * opsPerThread / ns * 1e3;
+}
+
+std::string cpuListName(const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return "-";
+  }
+  std::string rv;
+  for (size_t i = 0; i < cpus.size() && i < 8; ++i) {
+    rv += (i == 0 ? "" : ",") + std::to_string(cpus[i]);
+  }
+  return cpus.size() > 8 ? rv + ",..." : rv;
+}
+
+void scaling() {
+  auto topo = readCpuTopology();
+  size_t cores = 0;
+  size_t packages = 0;
+  for (size_t i = 0; i < topo.size(); ++i) {
+    cores += topo[i].sibling == 0;
+    packages += i == 0 || topo[i].package != topo[i - 1].package;
+  }
+  Table table("scaling: one shared map, " + std::to_string(topo.size()) +
+                  " cpus on " + std::to_string(cores) + " cores and " +
+                  std::to_string(packages) + " packages, --pin=" +
+                  pinPolicyName(pinPolicy()),
+              {"workload", "threads", "cpus", "Mops/s", "speedup",
+               "efficiency"});
+  std::vector<size_t> threadCounts;
+  for (size_t n = 1; n <= std::max<size_t>(2 * topo.size(), 4); n *= 2) {
+    threadCounts.push_back(n);
+  }
+  if (std::find(threadCounts.begin(), threadCounts.end(), topo.size()) ==
+      threadCounts.end()) {
+    threadCounts.push_back(topo.size());
+    std::sort(threadCounts.begin(), threadCounts.end());
+  }
+  const char *names[] = {"find", "emplace", "mixed"};
+  for (auto workload : {ScalingWorkload::FIND, ScalingWorkload::EMPLACE,
+                        ScalingWorkload::MIXED}) {
+    double single = 0;
+    for (size_t n : threadCounts) {
+      auto mops = scalingMops(workload, n, 200000);
+      single = n == 1 ? mops : single;
+      auto speedup = mops / single;
+      table.addRow({names[int(workload)], std::to_string(n),
+                    cpuListName(pinPlan(pinPolicy(), n, topo)), fmt(mops),
+                    fmt(speedup), fmt(speedup / n)});
+    }
+  }
+  table.print();
+}
+
+// Stands in for the parsing and other table lookups a request handler
+// does between map lookups: work that doesn't touch the map
+uint64_t otherWork(uint64_t x, int rounds) {
+  for (int i = 0; i < rounds; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+  }
+  return x;
+}
+
+void splitPhase() {
+  Table table("split_phase: find then unrelated work, vs prepare, the "
+              "same work, then resolve",
+              concat(concat({"keys", "work"}, Measurement::columns("find")),
+                     Measurement::columns("prepare/resolve")));
+  for (size_t numKeys : {10000, 4000000}) {
+    AtomicUnorderedInsertMap<uint64_t, uint64_t> m(numKeys);
+    for (size_t i = 0; i < numKeys; ++i) {
+      m.emplace(KeyTraits<uint64_t>::make(i), i);
+    }
+    size_t lookups = 2000000;
+    for (int rounds : {0, 20, 100}) {
+      auto key = [&](size_t i) {
+        return KeyTraits<uint64_t>::make((i * 7919) % numKeys);
+      };
+      // the work doesn't depend on the lookups in either loop, so only
+      // the placement of the lookup differs
+      auto plain = measure(lookups, [&] {
+        uint64_t acc = 1;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < lookups; ++i) {
+          sum += m.find(key(i))->second;
+          acc = otherWork(acc, rounds);
+        }
+        doNotOptimizeAway(acc + sum);
+      });
+      auto split = measure(lookups, [&] {
+        uint64_t acc = 1;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < lookups; ++i) {
+          auto k = key(i);
+          auto token = m.prepare(k);
+          acc = otherWork(acc, rounds);
+          sum += m.resolve(token)->second;
+        }
+        doNotOptimizeAway(acc + sum);
+      });
+      table.addRow(concat(
+          concat({std::to_string(numKeys), std::to_string(rounds)},
+                 plain.cells()),
+          split.cells()));
+    }
+  }
+  table.print();
+}
+
+// A map per time window over the same 256 byte Frame keys, either keyed
+// by the Frame itself or by its ID in a shared KeyDictionary
+void keyDictionary() {
+  Table table("key_dictionary: per-window maps keyed by Frame vs by "
+              "KeyDictionary ID; each window inserts the same frames",
+              concat(concat({"keys", "layout"}, Measurement::columns("insert")),
+                     {"window bytes", "shared bytes"}));
+  size_t numWindows = 8;
+  for (size_t numKeys : {1000, 100000}) {
+    std::vector<Frame> frames;
+    for (size_t i = 0; i < numKeys; ++i) {
+      frames.push_back(KeyTraits<Frame>::make(i));
+    }
+
+    typedef AtomicUnorderedInsertMap<Frame, uint64_t, FrameHash> FrameMap;
+    std::vector<std::unique_ptr<FrameMap>> direct;
+    auto directInsert = measure(numKeys * numWindows, [&] {
+      for (size_t w = 0; w < numWindows; ++w) {
+        direct.emplace_back(new FrameMap(numKeys));
+        for (size_t i = 0; i < numKeys; ++i) {
+          direct.back()->emplace(frames[i], w);
+        }
+      }
+    });
+    table.addRow(concat(
+        concat({std::to_string(numKeys), "Frame key"}, directInsert.cells()),
+        {std::to_string(direct[0]->memoryStats().reservedBytes), "0"}));
+
+    // the dictionary is filled by the first window, as it would be in
+    // steady state by earlier windows
+    KeyDictionary<Frame, FrameHash> dict(numKeys);
+    std::vector<std::unique_ptr<KeyIdMap<uint64_t>>> windows;
+    auto dictInsert = measure(numKeys * numWindows, [&] {
+      for (size_t w = 0; w < numWindows; ++w) {
+        windows.emplace_back(new KeyIdMap<uint64_t>(numKeys));
+        for (size_t i = 0; i < numKeys; ++i) {
+          windows.back()->emplace(dict.intern(frames[i]), w);
+        }
+      }
+    });
+    auto windowBytes =
+        std::to_string(windows[0]->memoryStats().reservedBytes);
+    auto sharedBytes = std::to_string(dict.memoryStats().reservedBytes);
+    table.addRow(concat(concat({std::to_string(numKeys), "intern + ID key"},
+                               dictInsert.cells()),
+                        {windowBytes, sharedBytes}));
+
+    // callers that carry the ID along with the frame skip the intern
+    std::vector<uint32_t> ids;
+    for (auto &f : frames) {
+      ids.push_back(dict.lookup(f));
+    }
+    windows.clear();
+    auto idInsert = measure(numKeys * numWindows, [&] {
+      for (size_t w = 0; w < numWindows; ++w) {
+        windows.emplace_back(new KeyIdMap<uint64_t>(numKeys));
+        for (size_t i = 0; i < numKeys; ++i) {
+          windows.back()->emplace(ids[i], w);
+        }
+      }
+    });
+    table.addRow(concat(
+        concat({std::to_string(numKeys), "ID key"}, idInsert.cells()),
+        {windowBytes, sharedBytes}));
+  }
+  table.print();
+}
+
+template <typename Map>
+std::vector<std::string> denseRow(Map &m, size_t numKeys, size_t numThreads) {
+  auto insertNs = timeThreadsNs(numThreads, [&](size_t t) {
+    for (size_t i = t; i < numKeys; i += numThreads) {
+      m.emplace(uint32_t(i), uint32_t(i));
+    }
+  });
+  size_t lookups = std::max<size_t>(numKeys, 1000000);
+  auto hit = measure(lookups, [&] {
+    for (size_t i = 0; i < lookups; ++i) {
+      doNotOptimizeAway(m.find(uint32_t((i * 7919) % numKeys)));
+    }
+  });
+  return concat(concat({fmt(insertNs / numKeys)}, hit.cells()),
+                {std::to_string(m.MemoryCost())});
+}
+
+void directMap() {
+  Table table("direct_map: dense keys 0..N-1 in AtomicUnorderedInsertMap vs "
+              "AtomicUnorderedDirectMap (u32 -> u32)",
+              concat(concat({"keys", "threads", "mode", "insert ns"},
+                            Measurement::columns("find")),
+                     {"bytes"}));
+  for (size_t numKeys : {10000, 1000000, 10000000}) {
+    for (size_t numThreads : {1, 4}) {
+      auto prefix = [&](const char *mode) {
+        return std::vector<std::string>{std::to_string(numKeys),
+                                        std::to_string(numThreads), mode};
+      };
+      {
+        AtomicUnorderedInsertMap<uint32_t, uint32_t> m(numKeys);
+        table.addRow(concat(prefix("hashed"), denseRow(m, numKeys, numThreads)));
+      }
+      {
+        AtomicUnorderedDirectMap<uint32_t, uint32_t> m(0, numKeys);
+        table.addRow(concat(prefix("direct"), denseRow(m, numKeys, numThreads)));
+      }
+    }
+  }
+  table.print();
+}
+
+// Bytes currently allocated with malloc, or 0 where unknown
+size_t heapBytesInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+// A serialized record of 20 to 4096 bytes
+std::string blobRecord(size_t i) {
+  return std::string(20 + (i * 2654435761u) % 4077, char('a' + i % 26));
+}
+
+struct StringValueAdapter {
+  static const char *name() { return "std::string"; }
+  explicit StringValueAdapter(size_t numKeys) : map(numKeys) {}
+  void insert(uint64_t key, const std::string &value) {
+    map.emplace(key, value);
+  }
+  size_t read(uint64_t key) const {
+    auto iter = map.find(key);
+    return iter->second.size() + size_t(iter->second[0]);
+  }
+
+  size_t logBytes() const { return 0; }
+
+  AtomicUnorderedInsertMap<uint64_t, std::string> map;
+};
+
+struct BlobValueAdapter {
+  static const char *name() { return "blob log"; }
+  explicit BlobValueAdapter(size_t numKeys)
+      : map(numKeys, numKeys * 2100 + (4 << 20)) {}
+  void insert(uint64_t key, const std::string &value) {
+    map.insert(key, value.data(), value.size());
+  }
+  size_t read(uint64_t key) const {
+    auto r = map.find(key);
+    return r.size() + size_t(r.data()[0]);
+  }
+
+  size_t logBytes() const { return map.logBytes(); }
+
+  AtomicUnorderedBlobMap<uint64_t> map;
+};
+
+template <typename Adapter>
+std::vector<std::string> blobValueRow(size_t numKeys, size_t numThreads,
+                                      const std::vector<std::string> &records) {
+  auto before = heapBytesInUse();
+  Adapter adapter(numKeys);
+  // every thread inserts every key, so most inserts find it present
+  auto insertNs = timeThreadsNs(numThreads, [&](size_t t) {
+    for (size_t i = 0; i < numKeys; ++i) {
+      auto k = (i + t * numKeys / numThreads) % numKeys;
+      adapter.insert(k, records[k]);
+    }
+  });
+  auto bytes = heapBytesInUse() - before + adapter.logBytes();
+  size_t lookups = std::max<size_t>(numKeys, 1000000);
+  auto read = measure(lookups, [&] {
+    size_t sum = 0;
+    for (size_t i = 0; i < lookups; ++i) {
+      sum += adapter.read((i * 7919) % numKeys);
+    }
+    doNotOptimizeAway(sum);
+  });
+  return concat(concat({std::to_string(numKeys), std::to_string(numThreads),
+                        Adapter::name(),
+                        fmt(insertNs / (numKeys * numThreads))},
+                       read.cells()),
+                {fmt(double(bytes) / numKeys, 0)});
+}
+
+void blobValues() {
+  Table table("blob_values: 20 B - 4 KB records as std::string values vs "
+              "AtomicUnorderedBlobMap; value bytes per entry are malloc'd "
+              "bytes plus the blob log",
+              concat(concat({"keys", "threads", "values", "insert ns"},
+                            Measurement::columns("read")),
+                     {"value B/entry"}));
+  for (size_t numKeys : {10000, 200000}) {
+    std::vector<std::string> records;
+    for (size_t i = 0; i < numKeys; ++i) {
+      records.push_back(blobRecord(i));
+    }
+    for (size_t numThreads : {1, 4}) {
+      table.addRow(
+          blobValueRow<StringValueAdapter>(numKeys, numThreads, records));
+      table.addRow(blobValueRow<BlobValueAdapter>(numKeys, numThreads, records));
+    }
+  }
+  table.print();
+}
+
+template <typename Tracer>
+using LatencyMap =
+    AtomicUnorderedInsertMap<uint64_t, uint64_t, std::hash<uint64_t>,
+                             std::equal_to<uint64_t>, true, std::atomic,
+                             uint32_t, detail::MMapAlloc, Tracer>;
+
+template <typename Tracer>
+Measurement latencyFinds(LatencyMap<Tracer> &m, size_t numKeys,
+                         size_t lookups) {
+  for (size_t i = 0; i < numKeys; ++i) {
+    m.emplace(KeyTraits<uint64_t>::make(i), i);
+  }
+  return measure(lookups, [&] {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < lookups; ++i) {
+      sum += m.find(KeyTraits<uint64_t>::make((i * 7919) % numKeys))->second;
+    }
+    doNotOptimizeAway(sum);
+  });
+}
+
+// The cost of SampledLatencyTracer on find, and the percentiles it saw
+void latencySampling() {
+  Table table("latency_sampling: find with NoopTracer vs "
+              "SampledLatencyTracer<128>; percentiles are of the sampled "
+              "finds",
+              concat(concat(concat({"keys"}, Measurement::columns("noop")),
+                            Measurement::columns("sampled")),
+                     {"samples", "p50 ns", "p99 ns", "p99.9 ns"}));
+  size_t lookups = 4000000;
+  for (size_t numKeys : {10000, 4000000}) {
+    LatencyMap<NoopTracer> plain(numKeys);
+    LatencyMap<SampledLatencyTracer<128>> sampled(numKeys);
+    auto noop = latencyFinds(plain, numKeys, lookups);
+    sampled.tracer().resetLatencies();
+    auto traced = latencyFinds(sampled, numKeys, lookups);
+    auto hist = sampled.tracer().latencySnapshot().find;
+    table.addRow(concat(concat(concat({std::to_string(numKeys)}, noop.cells()),
+                               traced.cells()),
+                        {std::to_string(hist.count()),
+                         fmt(hist.percentileNs(0.5)),
+                         fmt(hist.percentileNs(0.99)),
+                         fmt(hist.percentileNs(0.999))}));
+  }
+  table.print();
+}
+
+// Keys per TSC tick of each hash reduction kernel, then find in a loop
+// vs findBatch, which uses the best kernel and prefetches home slots
+void hashReduceSuite() {
+  Table kernels("hash_reduce: keys per TSC tick hashing and reducing 4096 "
+                "keys into a 1M-slot map's home slots",
+                {"kernel", "hash", "keys/tick", "ns/key"});
+  std::vector<uint64_t> keys(4096);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    keys[i] = KeyTraits<uint64_t>::make(i);
+  }
+  std::vector<uint64_t> homes(keys.size());
+  std::vector<detail::HashReduceIsa> isas{detail::HashReduceIsa::SCALAR};
+  if (detail::bestHashReduceIsa() >= detail::HashReduceIsa::AVX2) {
+    isas.push_back(detail::HashReduceIsa::AVX2);
+  }
+  if (detail::bestHashReduceIsa() >= detail::HashReduceIsa::AVX512) {
+    isas.push_back(detail::HashReduceIsa::AVX512);
+  }
+  size_t rounds = 2000;
+  for (auto isa : isas) {
+    for (bool mix : {false, true}) {
+      detail::HashReduceParams p{mix, 0x1234567, nextPowTwo(uint64_t(4) << 20) - 1,
+                                 1 << 20};
+      auto c0 = detail::cycleCount();
+      auto m = measure(rounds * keys.size(), [&] {
+        for (size_t r = 0; r < rounds; ++r) {
+          detail::hashReduce(isa, p, keys.data(), keys.size(), homes.data());
+          doNotOptimizeAway(homes[r % homes.size()]);
+        }
+      });
+      auto ticks = double(detail::cycleCount() - c0);
+      kernels.addRow({detail::hashReduceIsaName(isa),
+                      mix ? "SeededHash" : "std::hash",
+                      fmt(rounds * keys.size() / ticks, 2), fmt(m.ns, 2)});
+    }
+  }
+  kernels.print();
+
+  Table lookups("hash_reduce: SeededHash<uint64_t> map, find in a loop vs "
+                "findBatch",
+                concat(concat({"keys"}, Measurement::columns("find")),
+                       Measurement::columns("findBatch")));
+  for (size_t numKeys : {10000, 4000000}) {
+    AtomicUnorderedInsertMap<uint64_t, uint64_t, SeededHash<uint64_t>> m(
+        numKeys);
+    for (size_t i = 0; i < numKeys; ++i) {
+      m.emplace(KeyTraits<uint64_t>::make(i), i);
+    }
+    std::vector<uint64_t> probe(4000000);
+    for (size_t i = 0; i < probe.size(); ++i) {
+      probe[i] = KeyTraits<uint64_t>::make((i * 7919) % numKeys);
+    }
+    auto loop = measure(probe.size(), [&] {
+      uint64_t sum = 0;
+      for (auto k : probe) {
+        sum += m.find(k)->second;
+      }
+      doNotOptimizeAway(sum);
+    });
+    auto batch = measure(probe.size(), [&] {
+      uint64_t sum = 0;
+      m.findBatch(probe.data(), probe.size(),
+                  [&](size_t, decltype(m.cend()) it) { sum += it->second; });
+      doNotOptimizeAway(sum);
+    });
+    lookups.addRow(concat(concat({std::to_string(numKeys)}, loop.cells()),
+                          batch.cells()));
+  }
+  lookups.print();
+}
+
+struct ColdRow {
+  uint64_t fields[6];
+};
+
+// Drops the file's pages from the page cache, so that the next lookups
+// that touch them go to the device
+void dropPageCache(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+template <typename Find>
+std::vector<std::string> coldTierRow(const std::string &config,
+                                     const std::string &cache,
+                                     const std::vector<uint64_t> &probes,
+                                     Find &&find) {
+  LatencyHistogram hist;
+  uint64_t sum = 0;
+  auto start = detail::cycleCount();
+  for (auto k : probes) {
+    auto t0 = detail::cycleCount();
+    auto row = find(k);
+    sum += row == nullptr ? 0 : row->fields[0];
+    hist.add(LatencyHistogram::bucketIndex(detail::cycleCount() - t0), 1);
+  }
+  doNotOptimizeAway(sum);
+  auto totalNs = (detail::cycleCount() - start) / detail::cycleCountsPerNs();
+  return {config, cache, fmt(totalNs / probes.size()),
+          fmt(hist.percentileNs(0.5)), fmt(hist.percentileNs(0.99)),
+          fmt(hist.percentileNs(0.999))};
+}
+
+// 2M keys on disk of which 5% get 95% of the lookups, served from a
+// ColdTable alone, from a TieredMap with a 5% hot map and two promotion
+// rates, and from a map holding everything in memory
+void coldTier() {
+  Table table("cold_tier: 2M 56 B rows, 95% of lookups on 5% of the keys; "
+              "'dropped' evicts the table file from the page cache first",
+              {"config", "cache", "mean ns", "p50 ns", "p99 ns", "p99.9 ns"});
+  size_t numKeys = 2000000;
+  size_t hotKeys = numKeys / 20;
+  auto path = std::string("/tmp/cold_tier_bench.") + std::to_string(getpid());
+  {
+    AtomicUnorderedInsertMap<uint64_t, ColdRow> all(numKeys);
+    for (size_t i = 0; i < numKeys; ++i) {
+      all.emplace(KeyTraits<uint64_t>::make(i), ColdRow{{i}});
+    }
+    writeColdTable<uint64_t, ColdRow>(path, all.cbegin(), all.cend());
+  }
+  std::vector<uint64_t> probes(1000000);
+  std::mt19937_64 rng(1);
+  for (auto &k : probes) {
+    auto i = rng() % 100 < 95 ? rng() % hotKeys : rng() % numKeys;
+    k = KeyTraits<uint64_t>::make(i);
+  }
+
+  // each row maps the table afresh, since pages already mapped by this
+  // process aren't dropped from the cache
+  for (const char *cache : {"dropped", "warm"}) {
+    bool drop = std::string(cache) == "dropped";
+    for (uint32_t promoteEvery : {0, 1, 8}) {
+      if (drop) {
+        dropPageCache(path);
+      }
+      ColdTable<uint64_t, ColdRow> cold(path);
+      if (promoteEvery == 0) {
+        table.addRow(coldTierRow("cold table only", cache, probes,
+                                 [&](uint64_t k) { return cold.find(k); }));
+        continue;
+      }
+      TieredMap<uint64_t, ColdRow> tiered(cold, hotKeys, promoteEvery);
+      table.addRow(coldTierRow(
+          "tiered, promote 1/" + std::to_string(promoteEvery), cache, probes,
+          [&](uint64_t k) { return tiered.find(k); }));
+    }
+  }
+  unlink(path.c_str());
+
+  AtomicUnorderedInsertMap<uint64_t, ColdRow> all(numKeys);
+  for (size_t i = 0; i < numKeys; ++i) {
+    all.emplace(KeyTraits<uint64_t>::make(i), ColdRow{{i}});
+  }
+  table.addRow(coldTierRow("all in memory", "-", probes, [&](uint64_t k) {
+    auto iter = all.find(k);
+    return iter == all.cend() ? nullptr : &iter->second;
+  }));
+  table.print();
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  return runSuites(argc, argv, {
+                                   {"footprint", footprint},
+                                   {"construction", construction},
+                                   {"small_maps", smallMaps},
+                                   {"collision_attack", collisionAttack},
+                                   {"compaction", compaction},
+                                   {"baseline", baseline},
+                                   {"scaling", scaling},
+                                   {"split_phase", splitPhase},
+                                   {"key_dictionary", keyDictionary},
+                                   {"direct_map", directMap},
+                                   {"blob_values", blobValues},
+                                   {"latency_sampling", latencySampling},
+                                   {"hash_reduce", hashReduceSuite},
+                                   {"cold_tier", coldTier},
+                               });
+}
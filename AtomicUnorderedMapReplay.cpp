@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Replays a workload trace recorded with RecordingMap (see
+// WorkloadTrace.h) against a freshly built AtomicUnorderedInsertMap.
+// Every recorded thread becomes one replay thread that issues exactly
+// the recorded sequence of operations, so per-thread interleaving, hot
+// keys and miss ratios match production.  With --timing each thread also
+// waits until the recorded timestamp of each op, preserving burstiness.
+// Integer keys are replayed with the recorded integer type and any other
+// keys as std::string, per the key kind in the trace header.
+//
+//   make replay
+//   ./replay /tmp/workload.trace --index=u64 --load-factor=0.5
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+#include "Benchmark.h"
+#include "WorkloadTrace.h"
+
+using namespace folly;
+using namespace folly::bench;
+
+namespace {
+
+struct Options {
+  std::string path;
+  std::string index = "u32";
+  float loadFactor = 0.8f;
+  size_t capacity = 0;  // 0 = number of distinct inserted keys
+  bool timing = false;
+};
+
+typedef std::vector<std::vector<WorkloadEvent>> Trace;
+
+struct ThreadResult {
+  size_t ops = 0;
+  size_t hits = 0;
+  size_t agreements = 0;  // ops whose hit/miss matches the recording
+  size_t badAllocs = 0;
+};
+
+template <typename K, typename IndexType>
+void replay(const Trace &trace, const Options &opts) {
+  typedef AtomicUnorderedInsertMap<K, uint64_t, std::hash<K>, std::equal_to<K>,
+                                   true, std::atomic, IndexType>
+      Map;
+
+  // decode up front so that replay threads only touch the map
+  std::vector<std::vector<K>> keys(trace.size());
+  std::unordered_set<std::string> inserted;
+  for (size_t t = 0; t < trace.size(); ++t) {
+    for (auto &ev : trace[t]) {
+      keys[t].push_back(KeyBytes<K>::decode(ev.key));
+      if (ev.record.op == WorkloadOp::FIND_OR_CONSTRUCT) {
+        inserted.insert(ev.key);
+      }
+    }
+  }
+  size_t capacity = opts.capacity ? opts.capacity : inserted.size();
+  Map map(std::max<size_t>(capacity, 1), opts.loadFactor);
+
+  std::atomic<bool> go{false};
+  std::vector<ThreadResult> results(trace.size());
+  std::vector<std::thread> threads;
+  Clock::time_point start;
+  for (size_t t = 0; t < trace.size(); ++t) {
+    threads.emplace_back([&, t] {
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      auto &events = trace[t];
+      auto &res = results[t];
+      for (size_t i = 0; i < events.size(); ++i) {
+        auto &rec = events[i].record;
+        if (opts.timing) {
+          auto due = start + std::chrono::nanoseconds(rec.timestampNs);
+          while (Clock::now() < due) {
+          }
+        }
+        bool hit;
+        if (rec.op == WorkloadOp::FIND) {
+          hit = map.find(keys[t][i]) != map.cend();
+        } else {
+          try {
+            hit = !map.emplace(keys[t][i], uint64_t(i)).second;
+          } catch (std::bad_alloc &) {
+            ++res.badAllocs;
+            hit = false;
+          }
+        }
+        ++res.ops;
+        res.hits += hit;
+        res.agreements += hit == (rec.hit != 0);
+      }
+    });
+  }
+
+  start = Clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto &thr : threads) {
+    thr.join();
+  }
+  double elapsedNs =
+      std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+  Table table("replay of " + opts.path + " (index " + opts.index +
+                  ", load factor " + fmt(opts.loadFactor) + ", capacity " +
+                  std::to_string(capacity) + ")",
+              {"thread", "ops", "hit %", "agree %", "bad_alloc"});
+  ThreadResult total;
+  for (size_t t = 0; t < results.size(); ++t) {
+    auto &r = results[t];
+    table.addRow({std::to_string(t), std::to_string(r.ops),
+                  fmt(100.0 * r.hits / std::max<size_t>(r.ops, 1)),
+                  fmt(100.0 * r.agreements / std::max<size_t>(r.ops, 1)),
+                  std::to_string(r.badAllocs)});
+    total.ops += r.ops;
+    total.hits += r.hits;
+    total.agreements += r.agreements;
+    total.badAllocs += r.badAllocs;
+  }
+  table.addRow({"total", std::to_string(total.ops),
+                fmt(100.0 * total.hits / std::max<size_t>(total.ops, 1)),
+                fmt(100.0 * total.agreements / std::max<size_t>(total.ops, 1)),
+                std::to_string(total.badAllocs)});
+  table.print();
+  std::cout << "wall " << fmt(elapsedNs / 1e6) << " ms, "
+            << fmt(total.ops * 1e3 / elapsedNs) << " Mops/s, "
+            << fmt(elapsedNs / std::max<size_t>(total.ops, 1)) << " ns/op"
+            << std::endl;
+}
+
+template <typename K>
+void replayWithIndex(const Trace &trace, const Options &opts) {
+  if (opts.index == "u16") {
+    replay<K, uint16_t>(trace, opts);
+  } else if (opts.index == "u64") {
+    replay<K, uint64_t>(trace, opts);
+  } else {
+    // main() only accepts u16, u32 and u64
+    replay<K, uint32_t>(trace, opts);
+  }
+}
+
+template <typename SignedKey, typename UnsignedKey>
+void replayInteger(bool isSigned, const Trace &trace, const Options &opts) {
+  if (isSigned) {
+    replayWithIndex<SignedKey>(trace, opts);
+  } else {
+    replayWithIndex<UnsignedKey>(trace, opts);
+  }
+}
+
+int usage() {
+  std::cerr << "usage: replay <trace> [--index=u16|u32|u64] "
+               "[--load-factor=F] [--capacity=N] [--timing]"
+            << std::endl;
+  return 1;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 8, "--index=") == 0) {
+      opts.index = arg.substr(8);
+      if (opts.index != "u16" && opts.index != "u32" && opts.index != "u64") {
+        return usage();
+      }
+    } else if (arg.compare(0, 14, "--load-factor=") == 0) {
+      opts.loadFactor = std::strtof(arg.c_str() + 14, nullptr);
+    } else if (arg.compare(0, 11, "--capacity=") == 0) {
+      opts.capacity = std::strtoull(arg.c_str() + 11, nullptr, 10);
+    } else if (arg == "--timing") {
+      opts.timing = true;
+    } else if (arg.compare(0, 2, "--") == 0 || !opts.path.empty()) {
+      return usage();
+    } else {
+      opts.path = arg;
+    }
+  }
+  if (opts.path.empty()) {
+    return usage();
+  }
+
+  Trace trace;
+  WorkloadTraceHeader header;
+  try {
+    trace = readWorkloadTrace(opts.path, &header);
+  } catch (std::exception &e) {
+    std::cerr << "replay: can't read " << opts.path << ": " << e.what()
+              << std::endl;
+    return 1;
+  }
+
+  // replay with the recorded key type, so that hashes and chains match
+  bool isSigned = header.keyKind == WorkloadKeyKind::SIGNED_INTEGER;
+  bool isInteger =
+      isSigned || header.keyKind == WorkloadKeyKind::UNSIGNED_INTEGER;
+  if (isInteger && header.keySize == 1) {
+    replayInteger<int8_t, uint8_t>(isSigned, trace, opts);
+  } else if (isInteger && header.keySize == 2) {
+    replayInteger<int16_t, uint16_t>(isSigned, trace, opts);
+  } else if (isInteger && header.keySize == 4) {
+    replayInteger<int32_t, uint32_t>(isSigned, trace, opts);
+  } else if (isInteger && header.keySize == 8) {
+    replayInteger<int64_t, uint64_t>(isSigned, trace, opts);
+  } else {
+    if (header.keyKind != WorkloadKeyKind::BYTES) {
+      std::cerr << "replay: key type not recorded or not supported, "
+                   "replaying keys as strings"
+                << std::endl;
+    }
+    replayWithIndex<std::string>(trace, opts);
+  }
+  return 0;
+}
@@ -17,15 +17,15 @@
 #include <gtest/gtest.h>
 #include <unistd.h>
 
-#include <fstream>
-#include <ios>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "AtomicUnorderedMap.h"
+#include "SeededHash.h"
 
 template <class T>
 struct non_atomic {
@@ -144,6 +144,334 @@ TEST(AtomicUnorderedInsertMap, load_factor) {
   }
 }
 
+TEST(AtomicUnorderedInsertMap, small_map_alloc) {
+  // 129 slots of 16 bytes for the minimum capacity fit inline
+  typedef AtomicUnorderedInsertMap<uint32_t, uint32_t, std::hash<uint32_t>,
+                                   std::equal_to<uint32_t>, true, std::atomic,
+                                   uint32_t, folly::detail::SmallMapAlloc<4096>>
+      InlineMap;
+  InlineMap tiny(1);
+  EXPECT_LE(tiny.MemoryCost(), 4096);
+  tiny.emplace(7, 70);
+  auto p = reinterpret_cast<const char *>(&*tiny.find(7));
+  auto self = reinterpret_cast<const char *>(&tiny);
+  EXPECT_TRUE(p >= self && p < self + sizeof(tiny));
+  EXPECT_EQ(tiny.find(7)->second, 70);
+
+  // too big for inline storage, so from the heap or mmap
+  for (size_t n : {1000, 100000}) {
+    InlineMap m(n);
+    for (uint32_t i = 0; i < n; ++i) {
+      EXPECT_TRUE(m.emplace(i, i).second);
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+      EXPECT_EQ(m.find(i)->second, i);
+    }
+  }
+}
+
+TEST(AtomicUnorderedInsertMap, pooled_alloc_recycles_regions) {
+  using folly::detail::MMapRegionPool;
+  using folly::detail::PooledMMapAlloc;
+  auto &pool = MMapRegionPool::instance();
+  pool.release();
+
+  // one size below and one above the madvise threshold
+  for (size_t size : {size_t{50000}, size_t{3} << 20}) {
+    PooledMMapAlloc alloc;
+    auto cached = pool.cachedBytes();
+    auto *p = static_cast<char *>(alloc.allocate(size));
+    memset(p, 0xab, size);
+    alloc.deallocate(p, size);
+    EXPECT_EQ(pool.cachedBytes(), cached + MMapRegionPool::sizeClass(size));
+
+    // a slightly smaller request lands in the same size class
+    auto *q = static_cast<char *>(alloc.allocate(size - 100));
+    EXPECT_EQ(p, q);
+    EXPECT_EQ(pool.cachedBytes(), cached);
+    for (size_t i = 0; i < size - 100; i += 997) {
+      ASSERT_EQ(q[i], 0);
+    }
+    alloc.deallocate(q, size - 100);
+  }
+
+  pool.setMaxCachedBytes(0);
+  EXPECT_EQ(pool.cachedBytes(), 0);
+  PooledMMapAlloc alloc;
+  alloc.deallocate(alloc.allocate(10000), 10000);
+  EXPECT_EQ(pool.cachedBytes(), 0);
+  pool.setMaxCachedBytes(MMapRegionPool::kDefaultMaxCachedBytes);
+}
+
+TEST(AtomicUnorderedInsertMap, pooled_alloc_drops_cached_pages) {
+  using folly::detail::MMapRegionPool;
+  using folly::detail::PooledMMapAlloc;
+  auto &pool = MMapRegionPool::instance();
+  pool.release();
+
+  size_t size = size_t{64} << 20;
+  PooledMMapAlloc alloc;
+  auto *p = static_cast<char *>(alloc.allocate(size));
+  memset(p, 0xab, size);
+  EXPECT_EQ(folly::detail::residentBytes(p, size), size);
+  alloc.deallocate(p, size);
+  EXPECT_EQ(pool.cachedBytes(), MMapRegionPool::sizeClass(size));
+  // a cached large region is reserved but not resident
+  EXPECT_EQ(folly::detail::residentBytes(p, size), 0);
+
+  auto *q = static_cast<char *>(alloc.allocate(size));
+  EXPECT_EQ(p, q);
+  for (size_t i = 0; i < size; i += 4093) {
+    ASSERT_EQ(q[i], 0);
+  }
+  alloc.deallocate(q, size);
+  pool.release();
+}
+
+TEST(AtomicUnorderedInsertMap, pooled_alloc_map_reuse) {
+  typedef UIM<int, int, uint32_t, std::atomic, folly::detail::PooledMMapAlloc>
+      Map;
+  folly::detail::MMapRegionPool::instance().release();
+
+  for (int round = 0; round < 3; ++round) {
+    Map m(1000);
+    EXPECT_TRUE(m.cbegin() == m.cend());
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_TRUE(m.find(i) == m.cend());
+      m.emplace(i, i + round);
+    }
+    EXPECT_EQ(m.find(500)->second, 500 + round);
+    EXPECT_EQ(m.memoryStats().liveEntries, 1000);
+  }
+  EXPECT_GT(folly::detail::MMapRegionPool::instance().cachedBytes(), 0);
+}
+
+namespace {
+// remembers the longest chain walked by find
+struct MaxProbeTracer : NoopTracer {
+  mutable uint64_t maxProbes = 0;
+  void onLookup(uint64_t, uint64_t, uint64_t probes) const {
+    maxProbes = std::max(maxProbes, probes);
+  }
+};
+
+template <typename Hash>
+using ProbedMap =
+    AtomicUnorderedInsertMap<uint64_t, int, Hash, std::equal_to<uint64_t>,
+                             true, std::atomic, uint32_t,
+                             folly::detail::MMapAlloc, MaxProbeTracer>;
+
+// Keys that all share home slot 0 of a map with maxSize 10000: multiples
+// of the slot mask + 1, which is nextPowTwo(4 * (10000 / 0.8 + 128))
+template <typename Map>
+uint64_t fillWithCollisions(Map &m) {
+  for (uint64_t i = 0; i < 500; ++i) {
+    m.emplace(i << 16, 0);
+  }
+  m.tracer().maxProbes = 0;
+  for (uint64_t i = 0; i < 500; ++i) {
+    EXPECT_TRUE(m.find(i << 16) != m.cend());
+  }
+  return m.tracer().maxProbes;
+}
+}  // namespace
+
+TEST(AtomicUnorderedInsertMap, seeded_hash_bounds_chains) {
+  ProbedMap<std::hash<uint64_t>> plain(10000);
+  EXPECT_EQ(fillWithCollisions(plain), 500);
+
+  ProbedMap<SeededHash<uint64_t>> seeded(10000);
+  EXPECT_LT(fillWithCollisions(seeded), 8);
+}
+
+TEST(AtomicUnorderedInsertMap, seeded_hash_per_instance) {
+  typedef AtomicUnorderedInsertMap<std::string, int, SeededHash<std::string>>
+      Map;
+  Map a(100);
+  Map b(100);
+  EXPECT_NE(a.hash_function().seed(), b.hash_function().seed());
+  EXPECT_NE(a.hash_function()("abc"), b.hash_function()("abc"));
+
+  Map c(100, 0.8f, SeededHash<std::string>(42));
+  Map d(100, 0.8f, SeededHash<std::string>(42));
+  EXPECT_EQ(c.hash_function()("abc"), d.hash_function()("abc"));
+  EXPECT_NE(c.hash_function()("abc"), c.hash_function()("abd"));
+
+  c.emplace("abc", 1);
+  EXPECT_EQ(c.find("abc")->second, 1);
+  EXPECT_TRUE(c.find("abd") == c.cend());
+
+  // empty functors still take no space
+  EXPECT_LT(sizeof(AtomicUnorderedInsertMap<std::string, int>), sizeof(Map));
+}
+
+TEST(AtomicUnorderedInsertMap, compact_reclusters_chains) {
+  ProbedMap<std::hash<uint64_t>> m(10000);
+  fillWithCollisions(m);
+
+  // past the first few linear probes the chain is scattered randomly
+  auto maxSlot = [&] {
+    uint32_t rv = 0;
+    for (uint64_t i = 0; i < 500; ++i) {
+      rv = std::max(rv, m.find(i << 16).get_internal_slot());
+    }
+    return rv;
+  };
+  EXPECT_GT(maxSlot(), 500);
+
+  m.compact();
+  EXPECT_EQ(maxSlot(), 500);
+  size_t count = 0;
+  for (auto iter = m.cbegin(); iter != m.cend(); ++iter) {
+    EXPECT_EQ(iter->second, 0);
+    ++count;
+  }
+  EXPECT_EQ(count, 500);
+  EXPECT_FALSE(m.emplace(1 << 16, 1).second);
+  EXPECT_TRUE(m.emplace(1, 1).second);
+}
+
+TEST(AtomicUnorderedInsertMap, compact_moves_entries) {
+  AtomicUnorderedInsertMap<std::string, std::string> m(1000, 0.95f);
+  for (int i = 0; i < 1000; ++i) {
+    m.emplace(std::to_string(i), std::string(40, 'a' + i % 26));
+  }
+  m.compact();
+  for (int i = 0; i < 1000; ++i) {
+    auto iter = m.find(std::to_string(i));
+    ASSERT_TRUE(iter != m.cend());
+    EXPECT_EQ(iter->second, std::string(40, 'a' + i % 26));
+  }
+  EXPECT_TRUE(m.find("1000") == m.cend());
+}
+
+namespace {
+// its copy throws once copies reaches limit, and it has no move
+struct ThrowingCopy {
+  static int copies;
+  static int limit;
+
+  explicit ThrowingCopy(int v) : value(v) {}
+  ThrowingCopy(const ThrowingCopy &rhs) : value(rhs.value) {
+    if (++copies >= limit) {
+      throw std::runtime_error("copy failed");
+    }
+  }
+
+  int value;
+};
+
+int ThrowingCopy::copies = 0;
+int ThrowingCopy::limit = 1000;
+}  // namespace
+
+TEST(AtomicUnorderedInsertMap, compact_small_map_alloc) {
+  // the live slot array is inline, so the new one must come from the heap
+  typedef UIM<uint32_t, uint32_t, uint32_t, std::atomic,
+              folly::detail::SmallMapAlloc<8192>>
+      Map;
+  Map m(10);
+  ASSERT_LE(m.MemoryCost(), 8192);
+  for (uint32_t i = 0; i < 10; ++i) {
+    m.emplace(i, i * 10);
+  }
+  m.compact();
+  for (uint32_t i = 0; i < 10; ++i) {
+    auto iter = m.find(i);
+    ASSERT_TRUE(iter != m.cend());
+    EXPECT_EQ(iter->second, i * 10);
+  }
+  // and the inline bytes are free again for a second compact
+  m.compact();
+  EXPECT_EQ(m.find(9)->second, 90);
+}
+
+TEST(AtomicUnorderedInsertMap, compact_copy_throws) {
+  AtomicUnorderedInsertMap<std::string, ThrowingCopy> m(100);
+  for (int i = 0; i < 5; ++i) {
+    m.emplace(std::string(40, 'a' + i), ThrowingCopy(i));
+  }
+  ThrowingCopy::copies = 0;
+  ThrowingCopy::limit = 3;
+  EXPECT_THROW(m.compact(), std::runtime_error);
+
+  // the nothrow-movable keys must not have been moved out either
+  for (int i = 0; i < 5; ++i) {
+    auto iter = m.find(std::string(40, 'a' + i));
+    ASSERT_TRUE(iter != m.cend());
+    EXPECT_EQ(iter->second.value, i);
+  }
+
+  ThrowingCopy::copies = 0;
+  ThrowingCopy::limit = 1000;
+  m.compact();
+  for (int i = 0; i < 5; ++i) {
+    auto iter = m.find(std::string(40, 'a' + i));
+    ASSERT_TRUE(iter != m.cend());
+    EXPECT_EQ(iter->second.value, i);
+  }
+}
+
+TEST(AtomicUnorderedInsertMap, prepare_resolve) {
+  AtomicUnorderedInsertMap<std::string, int> m(1000);
+  for (int i = 0; i < 1000; i += 2) {
+    m.emplace(std::to_string(i), i);
+  }
+  std::vector<std::string> keys;
+  for (int i = 0; i < 1000; ++i) {
+    keys.push_back(std::to_string(i));
+  }
+  std::vector<decltype(m)::LookupToken> tokens;
+  for (auto &k : keys) {
+    tokens.push_back(m.prepare(k));
+  }
+  // keys inserted between prepare and resolve are found
+  m.emplace("1", 1);
+  for (int i = 0; i < 1000; ++i) {
+    auto iter = m.resolve(tokens[i]);
+    EXPECT_TRUE(iter == m.find(keys[i]));
+    if (i % 2 == 0 || i == 1) {
+      ASSERT_TRUE(iter != m.cend());
+      EXPECT_EQ(iter->second, i);
+    } else {
+      EXPECT_TRUE(iter == m.cend());
+    }
+  }
+}
+
+TEST(AtomicUnorderedInsertMap, wait_for_key) {
+  AtomicUnorderedInsertMap<int, int> m(100);
+  m.emplace(1, 10);
+
+  // present keys return immediately
+  EXPECT_EQ(m.waitFor(1, std::chrono::seconds(10))->second, 10);
+
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(m.waitFor(2, std::chrono::milliseconds(20)) == m.cend());
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(20));
+
+  std::vector<std::thread> consumers;
+  std::atomic<int> found{0};
+  for (int k = 2; k < 6; ++k) {
+    consumers.emplace_back([&, k] {
+      auto iter = m.waitFor(k, std::chrono::seconds(30));
+      EXPECT_TRUE(iter != m.cend());
+      EXPECT_EQ(iter->second, k * 10);
+      ++found;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(found.load(), 0);
+  for (int k = 2; k < 6; ++k) {
+    m.emplace(k, k * 10);
+  }
+  for (auto &thr : consumers) {
+    thr.join();
+  }
+  EXPECT_EQ(found.load(), 4);
+}
+
 TEST(AtomicUnorderedInsertMap, capacity_exceeded) {
   AtomicUnorderedInsertMap<int, bool> m(5000, 1.0f);
 
@@ -156,6 +484,24 @@ TEST(AtomicUnorderedInsertMap, capacity_exceeded) {
       std::bad_alloc);
 }
 
+TYPED_TEST(AtomicUnorderedInsertMapTest, memory_stats) {
+  UIM<int, int, TypeParam, std::atomic, folly::detail::MMapAlloc> m(1000);
+
+  for (int i = 0; i < 300; ++i) {
+    m.emplace(i, i);
+  }
+  m.emplace(7, 0);
+
+  auto stats = m.memoryStats();
+  EXPECT_EQ(stats.liveEntries, 300);
+  EXPECT_EQ(stats.reservedBytes, m.MemoryCost());
+  EXPECT_GT(stats.residentBytes, 0);
+  EXPECT_LE(stats.residentBytes, stats.reservedBytes);
+  EXPECT_DOUBLE_EQ(stats.reservedBytesPerEntry(),
+                   double(stats.reservedBytes) / 300);
+  EXPECT_EQ(stats.slotOverheadBytes, 2 * sizeof(TypeParam));
+}
+
 TYPED_TEST(AtomicUnorderedInsertMapTest, value_mutation) {
   UIM<int, MutableAtom<int>, TypeParam> m(100);
 
@@ -190,43 +536,6 @@ TEST(UnorderedInsertMap, struct_value) {
   }
 }
 
-void process_mem_usage(double &vm_usage, double &resident_set) {
-  using std::ifstream;
-  using std::ios_base;
-  using std::string;
-
-  vm_usage = 0.0;
-  resident_set = 0.0;
-
-  // 'file' stat seems to give the most reliable results
-  //
-  ifstream stat_stream("/proc/self/stat", ios_base::in);
-
-  // dummy vars for leading entries in stat that we don't care about
-  //
-  string pid, comm, state, ppid, pgrp, session, tty_nr;
-  string tpgid, flags, minflt, cminflt, majflt, cmajflt;
-  string utime, stime, cutime, cstime, priority, nice;
-  string O, itrealvalue, starttime;
-
-  // the two fields we want
-  //
-  unsigned long vsize;
-  long rss;
-
-  stat_stream >> pid >> comm >> state >> ppid >> pgrp >> session >> tty_nr >>
-      tpgid >> flags >> minflt >> cminflt >> majflt >> cmajflt >> utime >>
-      stime >> cutime >> cstime >> priority >> nice >> O >> itrealvalue >>
-      starttime >> vsize >> rss;  // don't care about the rest
-
-  stat_stream.close();
-
-  long page_size_kb = sysconf(_SC_PAGE_SIZE) /
-                      1024;  // in case x86-64 is configured to use 2MB pages
-  vm_usage = vsize / 1024.0;
-  resident_set = rss * page_size_kb;
-}
-
 struct Counter {
   Counter() = default;
   Counter(const Counter &other) {
@@ -276,10 +585,21 @@ TEST(UnorderedInsertMap, memory_occupy) {
   m.emplace(f1, c1);
   itr->second.data.a++;
   EXPECT_EQ(m.find(f1)->second.data.a, 2);
-  double vm, rss;
-  process_mem_usage(vm, rss);
 
-  std::cout << "VM: " << vm << "; RSS: " << rss << std::endl;
+  auto stats = m.memoryStats();
+  EXPECT_EQ(stats.reservedBytes, m.MemoryCost());
+  // MMapAlloc populates the whole mapping up front
+  EXPECT_EQ(stats.residentBytes, stats.reservedBytes);
+  EXPECT_LE(stats.hugePageBytes, stats.reservedBytes);
+  EXPECT_EQ(stats.liveEntries, 1);
+  EXPECT_EQ(stats.emptySlotBytes + stats.reservedBytes / m.SlotsNum(),
+            stats.reservedBytes);
+  EXPECT_LT(stats.slotOverheadBytes, 16);
+
+  std::cout << "Reserved: " << stats.reservedBytes / 1024
+            << " KB; Resident: " << stats.residentBytes / 1024
+            << " KB; HugePages: " << stats.hugePageBytes / 1024 << " KB"
+            << std::endl;
 }
 
 TEST(UnorderedInsertMap, value_mutation) {
@@ -0,0 +1,749 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+#include "AtomicUnorderedMapUtils.h"
+#include "HyperLogLog.h"
+
+namespace folly {
+
+/// Tracer policies for AtomicUnorderedInsertMap.  Plug one in as the
+/// Tracer template param; the default NoopTracer costs nothing.
+
+enum class TraceEventType : uint8_t {
+  LOOKUP = 1,           // home, arg = found slot (0 = miss), aux = probes
+  COLLISION = 2,        // home, arg = previous chain head
+  ALLOCATE = 3,         // home = start, arg = claimed slot, aux = tries
+  RANDOM_FALLBACK = 4,  // home = start, aux = tries
+  ALLOCATE_FAILED = 5,  // home = start
+  CAS_RETRY = 6,        // home, aux = retries so far
+  INSERT = 7,           // home, arg = slot, aux = 1 iff inserted
+  VALUE_RETRY = 8,      // home = value slot, aux = retries so far
+};
+
+/// One 16 byte trace record.  The low 48 bits of the first word are the
+/// detail::cycleCount() timestamp, followed by the event type and a
+/// small saturating counter whose meaning depends on the type.  Slot
+/// indexes are truncated to 32 bits.
+struct TraceEvent {
+  uint64_t stampTypeAux;
+  uint32_t home;
+  uint32_t arg;
+
+  static TraceEvent make(TraceEventType type, uint64_t home, uint64_t arg,
+                         uint64_t aux) {
+    TraceEvent ev;
+    ev.stampTypeAux = (detail::cycleCount() & kStampMask) |
+                      (uint64_t(type) << 48) |
+                      (uint64_t(std::min<uint64_t>(aux, 255)) << 56);
+    ev.home = uint32_t(home);
+    ev.arg = uint32_t(arg);
+    return ev;
+  }
+
+  uint64_t timestamp() const { return stampTypeAux & kStampMask; }
+  TraceEventType type() const {
+    return TraceEventType((stampTypeAux >> 48) & 0xff);
+  }
+  uint8_t aux() const { return uint8_t(stampTypeAux >> 56); }
+
+ private:
+  static constexpr uint64_t kStampMask = (uint64_t{1} << 48) - 1;
+};
+
+static_assert(sizeof(TraceEvent) == 16, "TraceEvent should stay compact");
+
+/// The events recorded by one thread, oldest first
+struct ThreadTrace {
+  uint32_t threadIndex;
+  std::vector<TraceEvent> events;
+};
+
+namespace detail {
+
+/// Single-writer ring of TraceEvent.  Only the owning thread pushes;
+/// snapshot() may be called from anywhere but can observe a torn event
+/// if the owner is concurrently overwriting it.
+class TraceRing {
+ public:
+  TraceRing(uint32_t threadIndex, size_t capacity)
+      : threadIndex_(threadIndex),
+        mask_(capacity - 1),
+        events_(new TraceEvent[capacity]) {
+    assert(capacity > 0 && (capacity & mask_) == 0);
+  }
+
+  void push(const TraceEvent &ev) {
+    auto h = head_.load(std::memory_order_relaxed);
+    events_[h & mask_] = ev;
+    head_.store(h + 1, std::memory_order_release);
+  }
+
+  ThreadTrace snapshot() const {
+    ThreadTrace rv;
+    rv.threadIndex = threadIndex_;
+    auto h = head_.load(std::memory_order_acquire);
+    auto n = std::min<uint64_t>(h, mask_ + 1);
+    rv.events.reserve(n);
+    for (auto i = h - n; i != h; ++i) {
+      rv.events.push_back(events_[i & mask_]);
+    }
+    return rv;
+  }
+
+  void clear() { head_.store(0, std::memory_order_release); }
+
+  /// Hands the ring to a new thread, dropping the previous owner's events
+  void reset(uint32_t threadIndex) {
+    threadIndex_ = threadIndex;
+    clear();
+  }
+
+ private:
+  uint32_t threadIndex_;
+  size_t mask_;
+  std::atomic<uint64_t> head_{0};
+  std::unique_ptr<TraceEvent[]> events_;
+};
+
+/// Owns every TraceRing, so that events outlive the threads that
+/// recorded them and can be dumped at the end of the run.  A ring is
+/// released when its thread exits.  The rings of the last kRetainedRings
+/// exited threads are kept; beyond that a thread that starts recording
+/// reuses the ring released longest ago, so there are at most
+/// kRetainedRings more rings than threads ever recorded at the same
+/// time.  Thread indexes are never reused.
+class TraceRingRegistry {
+ public:
+  enum : size_t { kRetainedRings = 8 };
+
+  /// Never destroyed, so threads can still release rings during exit
+  static TraceRingRegistry &instance() {
+    static auto *registry = new TraceRingRegistry();
+    return *registry;
+  }
+
+  TraceRing &acquire(size_t capacity) {
+    std::lock_guard<std::mutex> g(lock_);
+    auto threadIndex = nextThreadIndex_++;
+    Entry *oldest = nullptr;
+    size_t released = 0;
+    for (auto &entry : rings_) {
+      if (!entry.inUse) {
+        ++released;
+        if (oldest == nullptr || entry.releasedAt < oldest->releasedAt) {
+          oldest = &entry;
+        }
+      }
+    }
+    if (released >= kRetainedRings) {
+      oldest->inUse = true;
+      oldest->ring->reset(threadIndex);
+      return *oldest->ring;
+    }
+    rings_.push_back(Entry{
+        std::unique_ptr<TraceRing>(new TraceRing(threadIndex, capacity)),
+        true, 0});
+    return *rings_.back().ring;
+  }
+
+  /// Keeps ring's events for snapshot() until another thread acquires it
+  void release(TraceRing &ring) {
+    std::lock_guard<std::mutex> g(lock_);
+    for (auto &entry : rings_) {
+      if (entry.ring.get() == &ring) {
+        entry.inUse = false;
+        entry.releasedAt = ++releases_;
+      }
+    }
+  }
+
+  size_t numRings() {
+    std::lock_guard<std::mutex> g(lock_);
+    return rings_.size();
+  }
+
+  std::vector<ThreadTrace> snapshot() {
+    std::lock_guard<std::mutex> g(lock_);
+    std::vector<ThreadTrace> rv;
+    for (auto &entry : rings_) {
+      rv.push_back(entry.ring->snapshot());
+    }
+    return rv;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> g(lock_);
+    for (auto &entry : rings_) {
+      entry.ring->clear();
+    }
+  }
+
+ private:
+  struct Entry {
+    std::unique_ptr<TraceRing> ring;
+    bool inUse;
+    uint64_t releasedAt;  // orders the released rings
+  };
+
+  TraceRingRegistry() = default;
+
+  std::mutex lock_;
+  std::vector<Entry> rings_;
+  uint32_t nextThreadIndex_ = 0;
+  uint64_t releases_ = 0;
+};
+
+}  // namespace detail
+
+/// RingBufferTracer appends a TraceEvent for every hook to a per-thread
+/// ring buffer of kRingEvents entries (1 MiB), overwriting the oldest
+/// events once full.  Recording is a TSC read plus a 16 byte store to
+/// thread-local memory, with no sharing between threads.  Call dump()
+/// once the traced threads are quiescent to write every ring to a
+/// compact binary file for offline analysis, and load() to read it back.
+///
+/// A thread's ring outlives it, so the events of the last
+/// TraceRingRegistry::kRetainedRings exited threads are still dumped;
+/// older ones are reused by threads that start recording later.  Tracing
+/// costs 1 MiB times kRetainedRings plus the most threads that were ever
+/// recording at once, even in a server that spawns a thread per request.
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<K, V, Hash, Eq, Skip, std::atomic, uint32_t,
+///                           detail::MMapAlloc, RingBufferTracer> m(n);
+///  ... run the workload ...
+///  RingBufferTracer::dump("/tmp/map.trace");
+struct RingBufferTracer : NoopTracer {
+  enum : size_t { kRingEvents = size_t{1} << 16 };
+
+  void onLookup(uint64_t home, uint64_t found, uint64_t probes) const {
+    record(TraceEventType::LOOKUP, home, found, probes);
+  }
+  void onCollision(uint64_t home, uint64_t chainHead) const {
+    record(TraceEventType::COLLISION, home, chainHead, 0);
+  }
+  void onAllocate(uint64_t start, uint64_t slot, uint64_t tries) const {
+    record(TraceEventType::ALLOCATE, start, slot, tries);
+  }
+  void onRandomFallback(uint64_t start, uint64_t tries) const {
+    record(TraceEventType::RANDOM_FALLBACK, start, 0, tries);
+  }
+  void onAllocateFailed(uint64_t start) const {
+    record(TraceEventType::ALLOCATE_FAILED, start, 0, 0);
+  }
+  void onCasRetry(uint64_t home, uint64_t retries) const {
+    record(TraceEventType::CAS_RETRY, home, 0, retries);
+  }
+  void onInsert(uint64_t home, uint64_t slot, bool inserted) const {
+    record(TraceEventType::INSERT, home, slot, inserted ? 1 : 0);
+  }
+  void onValueRetry(uint64_t slot, uint64_t retries) const {
+    record(TraceEventType::VALUE_RETRY, slot, 0, retries);
+  }
+
+  /// Copies the events of every thread that has recorded anything
+  static std::vector<ThreadTrace> snapshot() {
+    return detail::TraceRingRegistry::instance().snapshot();
+  }
+
+  /// Forgets all recorded events
+  static void clear() { detail::TraceRingRegistry::instance().clear(); }
+
+  /// Writes every ring in the binary format read by load()
+  static void dump(std::ostream &out) {
+    auto traces = snapshot();
+    writeRaw(out, uint64_t(kMagic));
+    writeRaw(out, uint32_t(sizeof(TraceEvent)));
+    writeRaw(out, uint32_t(traces.size()));
+    for (auto &t : traces) {
+      writeRaw(out, t.threadIndex);
+      writeRaw(out, uint32_t(0));
+      writeRaw(out, uint64_t(t.events.size()));
+      out.write(reinterpret_cast<const char *>(t.events.data()),
+                t.events.size() * sizeof(TraceEvent));
+    }
+    if (!out) {
+      throw std::runtime_error("RingBufferTracer: failed to write trace");
+    }
+  }
+
+  static void dump(const std::string &path) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    dump(out);
+  }
+
+  static std::vector<ThreadTrace> load(std::istream &in) {
+    uint64_t magic = 0;
+    uint32_t eventSize = 0;
+    uint32_t numThreads = 0;
+    readRaw(in, magic);
+    readRaw(in, eventSize);
+    readRaw(in, numThreads);
+    if (magic != kMagic || eventSize != sizeof(TraceEvent)) {
+      throw std::runtime_error("RingBufferTracer: not a trace file");
+    }
+    std::vector<ThreadTrace> rv(numThreads);
+    for (auto &t : rv) {
+      uint32_t pad;
+      uint64_t count;
+      readRaw(in, t.threadIndex);
+      readRaw(in, pad);
+      readRaw(in, count);
+      t.events.resize(count);
+      in.read(reinterpret_cast<char *>(t.events.data()),
+              count * sizeof(TraceEvent));
+    }
+    if (!in) {
+      throw std::runtime_error("RingBufferTracer: truncated trace file");
+    }
+    return rv;
+  }
+
+  static std::vector<ThreadTrace> load(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return load(in);
+  }
+
+ private:
+  static constexpr uint64_t kMagic = 0x31304352544d5541ULL;  // "AUMTRC01"
+
+  static void record(TraceEventType type, uint64_t home, uint64_t arg,
+                     uint64_t aux) {
+    ring().push(TraceEvent::make(type, home, arg, aux));
+  }
+
+  // returns the thread's ring to the registry when the thread exits
+  struct RingHolder {
+    detail::TraceRing *ring;
+    ~RingHolder() { detail::TraceRingRegistry::instance().release(*ring); }
+  };
+
+  static detail::TraceRing &ring() {
+    static thread_local RingHolder holder{
+        &detail::TraceRingRegistry::instance().acquire(kRingEvents)};
+    return *holder.ring;
+  }
+
+  template <typename T>
+  static void writeRaw(std::ostream &out, const T &v) {
+    out.write(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+
+  template <typename T>
+  static void readRaw(std::istream &in, T &v) {
+    in.read(reinterpret_cast<char *>(&v), sizeof(v));
+  }
+};
+
+/// A log-linear histogram of durations.  Values below 16 ticks get a
+/// bucket each; above that every power of two is split into 8 buckets,
+/// so a bucket is at most 1/8 wider than its lower bound.  Durations are
+/// recorded in cycleCount() ticks and reported in nanoseconds.
+class LatencyHistogram {
+ public:
+  enum : size_t {
+    kSubBuckets = 8,
+    kMaxExponent = 47,  // longer durations land in the last bucket
+    kBuckets = (kMaxExponent - 1) * kSubBuckets,
+  };
+
+  static size_t bucketIndex(uint64_t ticks) {
+    if (ticks < kSubBuckets) {
+      return size_t(ticks);
+    }
+    size_t e = 63 - __builtin_clzll(ticks);
+    if (e > kMaxExponent) {
+      return kBuckets - 1;
+    }
+    return (e - 2) * kSubBuckets + ((ticks >> (e - 3)) & (kSubBuckets - 1));
+  }
+
+  /// The smallest tick count that lands in bucket i
+  static uint64_t bucketLowerBound(size_t i) {
+    if (i < kSubBuckets) {
+      return i;
+    }
+    size_t e = i / kSubBuckets + 2;
+    return (kSubBuckets + i % kSubBuckets) << (e - 3);
+  }
+
+  static uint64_t bucketWidth(size_t i) {
+    return i < kSubBuckets ? 1 : uint64_t(1) << (i / kSubBuckets - 1);
+  }
+
+  LatencyHistogram() : counts_(kBuckets, 0) {}
+
+  void add(size_t bucket, uint64_t count) { counts_[bucket] += count; }
+
+  void merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < kBuckets; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+  }
+
+  uint64_t count() const {
+    uint64_t rv = 0;
+    for (auto c : counts_) {
+      rv += c;
+    }
+    return rv;
+  }
+
+  uint64_t bucketCount(size_t i) const { return counts_[i]; }
+
+  /// The q-quantile (0 <= q <= 1) in nanoseconds, as the midpoint of the
+  /// bucket that holds it, or 0 if the histogram is empty
+  double percentileNs(double q) const {
+    auto total = count();
+    if (total == 0) {
+      return 0;
+    }
+    auto rank = std::max<uint64_t>(1, uint64_t(q * total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return midpointNs(i);
+      }
+    }
+    return midpointNs(kBuckets - 1);
+  }
+
+  double meanNs() const {
+    auto total = count();
+    double sum = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      sum += counts_[i] * midpointNs(i);
+    }
+    return total == 0 ? 0 : sum / total;
+  }
+
+ private:
+  static double midpointNs(size_t i) {
+    return (bucketLowerBound(i) + (bucketWidth(i) - 1) / 2.0) /
+           detail::cycleCountsPerNs();
+  }
+
+  std::vector<uint64_t> counts_;
+};
+
+/// Latencies of one map, merged over all threads
+struct LatencySnapshot {
+  LatencyHistogram find;
+  LatencyHistogram findOrConstruct;
+
+  const LatencyHistogram &operator[](TracedOp op) const {
+    return op == TracedOp::FIND ? find : findOrConstruct;
+  }
+};
+
+/// SampledLatencyTracer times one in SampleEvery calls of find and
+/// findOrConstruct (per thread) with cycleCount() and records them in
+/// log-linear histograms, so that long-lived maps can report latency
+/// percentiles in production and alert when they drift as the map fills.
+///
+/// Unsampled calls cost a thread-local decrement and two predictable
+/// branches; a sampled call adds two TSC reads and a relaxed increment.
+/// Histograms live in the tracer, so each map instance has its own.
+/// They are striped over kStripes slices picked by thread, which keeps
+/// threads from sharing counters until there are more than kStripes of
+/// them.  Each tracer allocates about 6 KB per stripe.
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<K, V, Hash, Eq, Skip, std::atomic, uint32_t,
+///                           detail::MMapAlloc, SampledLatencyTracer<>> m(n);
+///  ...
+///  auto p99 = m.tracer().latencySnapshot().find.percentileNs(0.99);
+template <uint32_t SampleEvery = 128>
+class SampledLatencyTracer : public NoopTracer {
+  static_assert(SampleEvery > 0, "SampleEvery must be positive");
+
+ public:
+  enum : size_t { kStripes = 8 };
+
+  SampledLatencyTracer() : stripes_(new Stripe[kStripes]) {
+    resetLatencies();
+  }
+
+  uint64_t onOpBegin(TracedOp) const {
+    auto &countdown = sampleCountdown();
+    if (LIKELY(--countdown != 0)) {
+      return 0;
+    }
+    countdown = SampleEvery;
+    return std::max<uint64_t>(detail::cycleCount(), 1);
+  }
+
+  void onOpEnd(TracedOp op, uint64_t begin) const {
+    if (LIKELY(begin == 0)) {
+      return;
+    }
+    auto bucket = LatencyHistogram::bucketIndex(detail::cycleCount() - begin);
+    stripes_[stripeIndex()].counts[int(op)][bucket].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  /// Merges the histograms of every stripe.  Safe to call while the map
+  /// is in use, in which case concurrent samples may or may not be seen.
+  LatencySnapshot latencySnapshot() const {
+    LatencySnapshot rv;
+    for (size_t s = 0; s < kStripes; ++s) {
+      for (size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+        rv.find.add(i, stripes_[s].counts[0][i].load(std::memory_order_relaxed));
+        rv.findOrConstruct.add(
+            i, stripes_[s].counts[1][i].load(std::memory_order_relaxed));
+      }
+    }
+    return rv;
+  }
+
+  void resetLatencies() {
+    for (size_t s = 0; s < kStripes; ++s) {
+      for (auto &op : stripes_[s].counts) {
+        for (auto &c : op) {
+          c.store(0, std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+ private:
+  struct Stripe {
+    std::atomic<uint64_t> counts[2][LatencyHistogram::kBuckets];
+  };
+
+  static uint32_t &sampleCountdown() {
+    static thread_local uint32_t countdown = SampleEvery;
+    return countdown;
+  }
+
+  static size_t stripeIndex() {
+    static std::atomic<size_t> nextThread{0};
+    static thread_local size_t index = nextThread++ % kStripes;
+    return index;
+  }
+
+  std::unique_ptr<Stripe[]> stripes_;
+};
+
+/// An item of a top-K summary.  The true count of item is between
+/// count - error and count.
+struct HeavyHitter {
+  uint64_t item;
+  uint64_t count;
+  uint64_t error;
+};
+
+namespace detail {
+
+/// The Space-Saving top-K summary of Metwally et al.: a fixed set of
+/// capacity counters, where an item without a counter takes over the
+/// smallest one and inherits its count as error.  Any item whose true
+/// count exceeds total() / capacity is guaranteed to be present.  Meant
+/// for sampled events, so adds take a mutex and scan the counters.
+class SpaceSavingSketch {
+ public:
+  explicit SpaceSavingSketch(size_t capacity) : capacity_(capacity) {
+    entries_.reserve(capacity);
+  }
+
+  void add(uint64_t item, uint64_t weight = 1) {
+    std::lock_guard<std::mutex> g(lock_);
+    total_ += weight;
+    HeavyHitter *smallest = nullptr;
+    for (auto &e : entries_) {
+      if (e.item == item) {
+        e.count += weight;
+        return;
+      }
+      if (smallest == nullptr || e.count < smallest->count) {
+        smallest = &e;
+      }
+    }
+    if (entries_.size() < capacity_) {
+      entries_.push_back(HeavyHitter{item, weight, 0});
+    } else if (smallest != nullptr) {
+      smallest->item = item;
+      smallest->error = smallest->count;
+      smallest->count += weight;
+    }
+  }
+
+  /// The tracked items, most frequent first
+  std::vector<HeavyHitter> top() const {
+    std::vector<HeavyHitter> rv;
+    {
+      std::lock_guard<std::mutex> g(lock_);
+      rv = entries_;
+    }
+    std::sort(rv.begin(), rv.end(),
+              [](const HeavyHitter &a, const HeavyHitter &b) {
+                return a.count > b.count;
+              });
+    return rv;
+  }
+
+  /// The sum of all weights added
+  uint64_t total() const {
+    std::lock_guard<std::mutex> g(lock_);
+    return total_;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> g(lock_);
+    entries_.clear();
+    total_ = 0;
+  }
+
+ private:
+  size_t capacity_;
+  mutable std::mutex lock_;
+  std::vector<HeavyHitter> entries_;
+  uint64_t total_ = 0;
+};
+
+}  // namespace detail
+
+/// ContentionTracer finds the chains and values that threads fight over.
+/// It feeds the home slot of every failed chain-head CAS in
+/// findOrConstruct, and the slot of every failed value CAS in
+/// updateValue, into two Space-Saving top-K summaries of TopK entries.
+/// Only one in SampleEvery retries per thread is recorded, with weight
+/// SampleEvery, so counts estimate the real number of retries.
+///
+/// Retries only happen under contention, so an uncontended map pays
+/// nothing beyond NoopTracer.  The summaries belong to the tracer, so
+/// each map instance has its own.
+///
+/// hotBuckets() lists home slots; compare them with
+/// prepare(key).homeSlot() to see which keys share a hot chain.
+/// hotKeys(map) resolves hot value slots to their keys, which are the
+/// candidates for sharded counters or a different key design.
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<K, MutableAtom<uint64_t>, Hash, Eq, Skip,
+///                           std::atomic, uint32_t, detail::MMapAlloc,
+///                           ContentionTracer<>> m(n);
+///  m.updateValue(m.find(k), [](uint64_t v) { return v + 1; });
+///  for (auto &hot : m.tracer().hotKeys(m)) { ... }
+template <size_t TopK = 32, uint32_t SampleEvery = 4>
+class ContentionTracer : public NoopTracer {
+  static_assert(TopK > 0 && SampleEvery > 0,
+                "TopK and SampleEvery must be positive");
+
+ public:
+  ContentionTracer() : buckets_(TopK), values_(TopK) {}
+
+  void onCasRetry(uint64_t home, uint64_t /* retries */) const {
+    if (sampled()) {
+      buckets_.add(home, SampleEvery);
+    }
+  }
+
+  void onValueRetry(uint64_t slot, uint64_t /* retries */) const {
+    if (sampled()) {
+      values_.add(slot, SampleEvery);
+    }
+  }
+
+  /// Home slots by estimated number of chain-head CAS retries
+  std::vector<HeavyHitter> hotBuckets() const { return buckets_.top(); }
+
+  /// Value slots by estimated number of updateValue CAS retries
+  std::vector<HeavyHitter> hotValues() const { return values_.top(); }
+
+  /// hotValues(), with each slot resolved to its key in map, which must
+  /// be the map this tracer belongs to
+  template <typename Map>
+  std::vector<std::pair<typename Map::key_type, HeavyHitter>> hotKeys(
+      const Map &map) const {
+    std::vector<std::pair<typename Map::key_type, HeavyHitter>> rv;
+    for (auto &hot : hotValues()) {
+      typename Map::const_iterator iter(map, hot.item);
+      rv.emplace_back(iter->first, hot);
+    }
+    return rv;
+  }
+
+  /// Estimated totals of each kind of retry
+  uint64_t bucketRetries() const { return buckets_.total(); }
+  uint64_t valueRetries() const { return values_.total(); }
+
+  void resetContention() {
+    buckets_.clear();
+    values_.clear();
+  }
+
+ private:
+  static bool sampled() {
+    static thread_local uint32_t countdown = SampleEvery;
+    if (--countdown != 0) {
+      return false;
+    }
+    countdown = SampleEvery;
+    return true;
+  }
+
+  mutable detail::SpaceSavingSketch buckets_;
+  mutable detail::SpaceSavingSketch values_;
+};
+
+/// CardinalityTracer feeds the hash of every key passed to
+/// findOrConstruct into a HyperLogLog, so a map can report how many
+/// distinct keys it was asked to hold, including those that didn't fit
+/// before it threw std::bad_alloc.  Use cardinality().sizing() to size
+/// the map that replaces it in the next window or rebuild.  Each insert
+/// attempt costs a mix of the hash and a load of one register.
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<K, V, Hash, Eq, Skip, std::atomic, uint32_t,
+///                           detail::MMapAlloc, CardinalityTracer<>> m(n);
+///  ...
+///  auto next = m.tracer().cardinality().sizing(1.1);
+template <unsigned Precision = 12>
+class CardinalityTracer : public NoopTracer {
+ public:
+  void onInsertHash(uint64_t hash) const { hll_.addHash(hash); }
+
+  const HyperLogLog<Precision> &cardinality() const { return hll_; }
+
+  void resetCardinality() { hll_.clear(); }
+
+ private:
+  mutable HyperLogLog<Precision> hll_;
+};
+
+}  // namespace folly
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "AtomicUnorderedMapTracers.h"
+
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace folly;
+
+namespace {
+
+struct CountingTracer : NoopTracer {
+  static std::atomic<uint64_t> lookups;
+  static std::atomic<uint64_t> misses;
+  static std::atomic<uint64_t> collisions;
+  static std::atomic<uint64_t> inserts;
+  static std::atomic<uint64_t> fallbacks;
+
+  void onLookup(uint64_t, uint64_t found, uint64_t) const {
+    ++lookups;
+    if (found == 0) {
+      ++misses;
+    }
+  }
+  void onCollision(uint64_t, uint64_t) const { ++collisions; }
+  void onRandomFallback(uint64_t, uint64_t) const { ++fallbacks; }
+  void onInsert(uint64_t, uint64_t, bool inserted) const {
+    if (inserted) {
+      ++inserts;
+    }
+  }
+};
+
+std::atomic<uint64_t> CountingTracer::lookups{0};
+std::atomic<uint64_t> CountingTracer::misses{0};
+std::atomic<uint64_t> CountingTracer::collisions{0};
+std::atomic<uint64_t> CountingTracer::inserts{0};
+std::atomic<uint64_t> CountingTracer::fallbacks{0};
+
+// every key lands in the same home slot
+struct ConstantHash {
+  size_t operator()(int) const { return 7; }
+};
+
+template <typename Tracer, typename Hash = std::hash<int>>
+using TracedMap =
+    AtomicUnorderedInsertMap<int, int, Hash, std::equal_to<int>, true,
+                             std::atomic, uint32_t, detail::MMapAlloc, Tracer>;
+
+// the data members of AtomicUnorderedInsertMap, without a tracer
+struct UntracedLayout {
+  size_t mmapRequested;
+  size_t numSlots;
+  size_t slotMask;
+  detail::MMapAlloc allocator;
+  void *slots;
+  std::atomic<uint32_t> waiters;
+};
+
+static_assert(sizeof(TracedMap<NoopTracer>) == sizeof(UntracedLayout),
+              "NoopTracer must not add to the size of a map");
+static_assert(sizeof(TracedMap<RingBufferTracer>) == sizeof(UntracedLayout),
+              "an empty tracer must not add to the size of a map");
+
+}  // namespace
+
+TEST(AtomicUnorderedMapTracers, noop_tracer_is_empty) {
+  EXPECT_TRUE(std::is_empty<NoopTracer>::value);
+  EXPECT_TRUE(std::is_empty<RingBufferTracer>::value);
+}
+
+TEST(AtomicUnorderedMapTracers, hooks_are_called) {
+  TracedMap<CountingTracer, ConstantHash> m(100);
+
+  // the counters are process-wide, so only look at this test's deltas
+  auto inserts0 = CountingTracer::inserts.load();
+  auto collisions0 = CountingTracer::collisions.load();
+  auto fallbacks0 = CountingTracer::fallbacks.load();
+  auto misses0 = CountingTracer::misses.load();
+  for (int i = 0; i < 20; ++i) {
+    m.emplace(i, i);
+  }
+  EXPECT_EQ(CountingTracer::inserts.load() - inserts0, 20);
+  // each insert after the first prepends to the single chain
+  EXPECT_EQ(CountingTracer::collisions.load() - collisions0, 19);
+  // 8 linear probes from slot 7, then random slots
+  EXPECT_GT(CountingTracer::fallbacks.load() - fallbacks0, 0);
+  EXPECT_GE(CountingTracer::misses.load() - misses0, 20);
+
+  auto lookups = CountingTracer::lookups.load();
+  auto misses = CountingTracer::misses.load();
+  EXPECT_TRUE(m.find(3) != m.cend());
+  EXPECT_TRUE(m.find(100) == m.cend());
+  EXPECT_EQ(CountingTracer::lookups.load(), lookups + 2);
+  EXPECT_EQ(CountingTracer::misses.load(), misses + 1);
+}
+
+TEST(AtomicUnorderedMapTracers, ring_buffer_dump_roundtrip) {
+  RingBufferTracer::clear();
+  TracedMap<RingBufferTracer, ConstantHash> m(100);
+
+  std::thread t([&] {
+    for (int i = 0; i < 10; ++i) {
+      m.emplace(i, i);
+    }
+  });
+  t.join();
+  m.find(5);
+
+  std::stringstream buf;
+  RingBufferTracer::dump(buf);
+  auto traces = RingBufferTracer::load(buf);
+
+  size_t inserts = 0;
+  size_t hits = 0;
+  size_t threadsWithEvents = 0;
+  for (auto &trace : traces) {
+    if (!trace.events.empty()) {
+      ++threadsWithEvents;
+    }
+    uint64_t lastStamp = 0;
+    for (auto &ev : trace.events) {
+      EXPECT_GE(ev.timestamp(), lastStamp);
+      lastStamp = ev.timestamp();
+      if (ev.type() == TraceEventType::INSERT) {
+        EXPECT_EQ(ev.home, 7);
+        EXPECT_EQ(ev.aux(), 1);
+        ++inserts;
+      } else if (ev.type() == TraceEventType::LOOKUP && ev.arg != 0) {
+        ++hits;
+      }
+    }
+  }
+  EXPECT_EQ(threadsWithEvents, 2);
+  EXPECT_EQ(inserts, 10);
+  EXPECT_EQ(hits, 1);
+}
+
+TEST(AtomicUnorderedMapTracers, ring_buffer_reuses_exited_rings) {
+  TracedMap<RingBufferTracer> m(100);
+  m.find(0);
+  auto &registry = detail::TraceRingRegistry::instance();
+  auto rings = registry.numRings();
+
+  // threads that record one after another reuse the rings of the
+  // threads that exited before the last kRetainedRings
+  for (int i = 0; i < 40; ++i) {
+    std::thread([&] { m.emplace(i, i); }).join();
+  }
+  EXPECT_LE(registry.numRings(),
+            rings + detail::TraceRingRegistry::kRetainedRings + 1);
+
+  // and the retained threads' events are still there to dump
+  size_t inserts = 0;
+  for (auto &trace : RingBufferTracer::snapshot()) {
+    for (auto &ev : trace.events) {
+      inserts += ev.type() == TraceEventType::INSERT;
+    }
+  }
+  EXPECT_GE(inserts, detail::TraceRingRegistry::kRetainedRings);
+}
+
+TEST(AtomicUnorderedMapTracers, ring_buffer_rejects_garbage) {
+  std::stringstream buf("not a trace file at all");
+  EXPECT_THROW(RingBufferTracer::load(buf), std::runtime_error);
+}
+
+TEST(AtomicUnorderedMapTracers, latency_histogram_buckets) {
+  // buckets are contiguous and each value falls into its own bucket
+  for (size_t i = 1; i < LatencyHistogram::kBuckets; ++i) {
+    EXPECT_EQ(LatencyHistogram::bucketLowerBound(i - 1) +
+                  LatencyHistogram::bucketWidth(i - 1),
+              LatencyHistogram::bucketLowerBound(i));
+    auto lo = LatencyHistogram::bucketLowerBound(i);
+    EXPECT_EQ(LatencyHistogram::bucketIndex(lo), i);
+  }
+  EXPECT_EQ(LatencyHistogram::bucketIndex(~uint64_t(0)),
+            LatencyHistogram::kBuckets - 1);
+}
+
+TEST(AtomicUnorderedMapTracers, sampled_latency_counts) {
+  TracedMap<SampledLatencyTracer<16>> m(10000);
+
+  // a fresh thread, so that the sample countdown starts from the top
+  std::thread t([&] {
+    for (int i = 0; i < 1600; ++i) {
+      m.emplace(i, i);
+    }
+    for (int i = 0; i < 3200; ++i) {
+      m.find(i);
+    }
+  });
+  t.join();
+
+  auto snap = m.tracer().latencySnapshot();
+  EXPECT_EQ(snap.findOrConstruct.count(), 100);
+  EXPECT_EQ(snap.find.count(), 200);
+  EXPECT_EQ(snap[TracedOp::FIND].count(), 200);
+
+  double prev = 0;
+  for (double q : {0.0, 0.1, 0.5, 0.9, 0.99, 0.999, 1.0}) {
+    auto p = snap.find.percentileNs(q);
+    EXPECT_GE(p, prev);
+    prev = p;
+  }
+  EXPECT_GT(snap.find.meanNs(), 0);
+  EXPECT_LE(snap.find.meanNs(), snap.find.percentileNs(1.0));
+
+  m.tracer().resetLatencies();
+  EXPECT_EQ(m.tracer().latencySnapshot().find.count(), 0);
+  EXPECT_EQ(m.tracer().latencySnapshot().find.percentileNs(0.5), 0);
+}
+
+TEST(AtomicUnorderedMapTracers, space_saving_keeps_heavy_hitters) {
+  detail::SpaceSavingSketch sketch(8);
+  // items 0, 1 and 2 appear 400, 300 and 300 times, interleaved with
+  // 1000 items that appear once each.  Anything above 2000 / 8 must stay.
+  uint64_t trueCounts[3] = {400, 300, 300};
+  for (uint64_t i = 0; i < 1000; ++i) {
+    sketch.add(1000 + i);
+    sketch.add(i % 10 < 4 ? 0 : i % 10 < 7 ? 1 : 2);
+  }
+  EXPECT_EQ(sketch.total(), 2000);
+  auto top = sketch.top();
+  ASSERT_EQ(top.size(), 8);
+  size_t found = 0;
+  for (auto &hh : top) {
+    if (hh.item < 3) {
+      ++found;
+      EXPECT_LE(hh.count - hh.error, trueCounts[hh.item]);
+      EXPECT_GE(hh.count, trueCounts[hh.item]);
+    }
+  }
+  EXPECT_EQ(found, 3);
+  for (size_t i = 1; i < top.size(); ++i) {
+    EXPECT_GE(top[i - 1].count, top[i].count);
+  }
+}
+
+TEST(AtomicUnorderedMapTracers, contention_tracer_ranks_hot_spots) {
+  typedef AtomicUnorderedInsertMap<int, MutableAtom<uint64_t>,
+                                   std::hash<int>, std::equal_to<int>, true,
+                                   std::atomic, uint32_t, detail::MMapAlloc,
+                                   ContentionTracer<4, 1>>
+      Map;
+  Map m(100);
+  for (int i = 0; i < 10; ++i) {
+    m.emplace(i, uint64_t(0));
+  }
+
+  // simulate a concurrent writer by changing the value from inside func,
+  // so that key 3's CAS fails 5 times and key 7's twice
+  auto contend = [&](int key, int conflicts) {
+    auto iter = m.find(key);
+    int calls = 0;
+    auto rv = m.updateValue(iter, [&](uint64_t v) {
+      if (calls++ < conflicts) {
+        iter->second.data.fetch_add(100);
+      }
+      return v + 1;
+    });
+    EXPECT_EQ(rv, uint64_t(100 * conflicts + 1));
+  };
+  contend(3, 5);
+  contend(7, 2);
+  contend(5, 0);
+  EXPECT_EQ(m.tracer().valueRetries(), 7);
+
+  auto hot = m.tracer().hotKeys(m);
+  ASSERT_EQ(hot.size(), 2);
+  EXPECT_EQ(hot[0].first, 3);
+  EXPECT_EQ(hot[0].second.count, 5);
+  EXPECT_EQ(hot[1].first, 7);
+
+  // chain-head retries are ranked by home slot
+  for (int i = 0; i < 3; ++i) {
+    m.tracer().onCasRetry(m.prepare(1).homeSlot(), 1);
+  }
+  m.tracer().onCasRetry(m.prepare(2).homeSlot(), 1);
+  auto buckets = m.tracer().hotBuckets();
+  ASSERT_EQ(buckets.size(), 2);
+  EXPECT_EQ(buckets[0].item, m.prepare(1).homeSlot());
+  EXPECT_EQ(buckets[0].count, 3);
+
+  m.tracer().resetContention();
+  EXPECT_TRUE(m.tracer().hotValues().empty());
+}
+
+TEST(AtomicUnorderedMapTracers, update_value_is_atomic) {
+  AtomicUnorderedInsertMap<int, MutableAtom<uint64_t>> m(10);
+  auto iter = m.emplace(1, uint64_t(0)).first;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 10000; ++i) {
+        m.updateValue(iter, [](uint64_t v) { return v + 1; });
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(iter->second.data.load(), 40000);
+}
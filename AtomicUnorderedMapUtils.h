@@ -16,19 +16,94 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
 #include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 //#include <folly/portability/SysMman.h>
 //#include <folly/portability/Unistd.h>
 #include <sys/mman.h>
 #include <sys/unistd.h>
+#include <time.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <thread>
 
 namespace folly {
 namespace detail {
 
+/// A cheap monotonic timestamp for tracing and sampling.  This is the TSC
+/// on x86, which counts reference cycles, and steady_clock nanoseconds
+/// elsewhere.  Only differences between two readings are meaningful.
+inline uint64_t cycleCount() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+/// The rate of cycleCount() in ticks per nanosecond, measured once
+/// against steady_clock over a few milliseconds (1 where cycleCount()
+/// already is nanoseconds)
+inline double cycleCountsPerNs() {
+  static const double rate = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    auto t0 = std::chrono::steady_clock::now();
+    auto c0 = cycleCount();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    auto c1 = cycleCount();
+    auto ns = std::chrono::duration<double, std::nano>(
+                  std::chrono::steady_clock::now() - t0)
+                  .count();
+    return ns > 0 ? double(c1 - c0) / ns : 1.0;
+#else
+    return 1.0;
+#endif
+  }();
+  return rate;
+}
+
+/// Spins politely: pause for the first few rounds, then yield so that a
+/// preempted thread that we are waiting for can make progress on the
+/// same core
+class SpinBackoff {
+ public:
+  void wait() {
+    if (spins_ < kPauseSpins) {
+      ++spins_;
+#if defined(__x86_64__) || defined(__i386__)
+      _mm_pause();
+#endif
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+ private:
+  enum : uint32_t { kPauseSpins = 64 };
+  uint32_t spins_ = 0;
+};
+
 class MMapAlloc {
  private:
   size_t computeSize(size_t size) {
@@ -68,11 +143,316 @@ class MMapAlloc {
   }
 };
 
+/// Returns the number of bytes of [p, p + len) that are backed by
+/// resident pages, as reported by mincore().  Partially covered pages at
+/// either end count in full.
+inline size_t residentBytes(const void *p, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = reinterpret_cast<uintptr_t>(p) & ~(pagesize - 1);
+  uintptr_t end = (reinterpret_cast<uintptr_t>(p) + len + pagesize - 1) &
+                  ~(pagesize - 1);
+  std::vector<unsigned char> vec((end - begin) / pagesize);
+  if (mincore(reinterpret_cast<void *>(begin), end - begin, vec.data()) != 0) {
+    throw std::system_error(errno, std::system_category());
+  }
+  size_t pages = 0;
+  for (auto v : vec) {
+    pages += v & 1;
+  }
+  return pages * pagesize;
+}
+
+/// Returns the number of bytes of [p, p + len) that are backed by
+/// transparent huge pages, from the AnonHugePages lines of
+/// /proc/self/smaps.  smaps only reports totals per mapping, so for a
+/// mapping that is larger than the range this is an upper bound clamped
+/// to the overlap.  Returns 0 if smaps is not available.
+inline size_t hugePageBytes(const void *p, size_t len) {
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == nullptr) {
+    return 0;
+  }
+  uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+  uintptr_t end = begin + len;
+  size_t overlap = 0;
+  size_t total = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), smaps) != nullptr) {
+    unsigned long vmaBegin;
+    unsigned long vmaEnd;
+    size_t kb;
+    if (sscanf(line, "%lx-%lx ", &vmaBegin, &vmaEnd) == 2) {
+      overlap = vmaBegin < end && begin < vmaEnd
+                    ? std::min<uintptr_t>(end, vmaEnd) -
+                          std::max<uintptr_t>(begin, vmaBegin)
+                    : 0;
+    } else if (overlap > 0 && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+      total += std::min(overlap, kb * 1024);
+    }
+  }
+  fclose(smaps);
+  return total;
+}
+
+/// A process-wide cache of anonymous mappings released by
+/// PooledMMapAlloc, keyed by their length.  Handing a cached region to
+/// the next map of a similar size avoids the mmap + MAP_POPULATE page
+/// faults on creation and the munmap (and the TLB shootdown IPIs it
+/// sends to every core that ran the process) on destruction.
+///
+/// Large regions are dropped with MADV_DONTNEED when they are released,
+/// so a cached large region costs no RSS and the kernel supplies zero
+/// pages on demand after reuse.  Small regions keep their pages resident
+/// and warm, and are memset when they are reused.
+class MMapRegionPool {
+ public:
+  enum : size_t {
+    kDefaultMaxCachedBytes = size_t{256} << 20,
+    kMadviseThreshold = size_t{1} << 20,
+  };
+
+  /// Never destroyed, so maps with static storage duration can still
+  /// release their regions during exit.
+  static MMapRegionPool &instance() {
+    static auto *pool = new MMapRegionPool();
+    return *pool;
+  }
+
+  /// Rounds a length up to its size class: whole pages, and at most 1/8
+  /// over the request so that similar sized maps share regions
+  static size_t sizeClass(size_t size) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + pagesize - 1) / pagesize;
+    if (pages > 8) {
+      size_t shift = 0;
+      while ((pages >> shift) > 8) {
+        ++shift;
+      }
+      size_t granule = size_t{1} << (shift - 1);
+      pages = (pages + granule - 1) & ~(granule - 1);
+    }
+    return std::max<size_t>(pages, 1) * pagesize;
+  }
+
+  /// Returns a zero-filled cached region of exactly len bytes, or nullptr
+  void *take(size_t len) {
+    void *p;
+    {
+      std::lock_guard<std::mutex> g(lock_);
+      auto iter = free_.find(len);
+      if (iter == free_.end() || iter->second.empty()) {
+        return nullptr;
+      }
+      p = iter->second.back();
+      iter->second.pop_back();
+      cachedBytes_ -= len;
+    }
+    if (len < kMadviseThreshold) {
+      memset(p, 0, len);
+    }
+    return p;
+  }
+
+  /// Caches a region of len bytes.  Returns false (and the caller should
+  /// unmap it) if that would exceed maxCachedBytes().
+  bool give(void *p, size_t len) {
+    // before the region is visible to take(), which relies on it
+    if (len >= kMadviseThreshold) {
+      madvise(p, len, MADV_DONTNEED);
+    }
+    std::lock_guard<std::mutex> g(lock_);
+    if (cachedBytes_ + len > maxCachedBytes_) {
+      return false;
+    }
+    free_[len].push_back(p);
+    cachedBytes_ += len;
+    return true;
+  }
+
+  size_t cachedBytes() const {
+    std::lock_guard<std::mutex> g(lock_);
+    return cachedBytes_;
+  }
+
+  size_t maxCachedBytes() const {
+    std::lock_guard<std::mutex> g(lock_);
+    return maxCachedBytes_;
+  }
+
+  /// Changes the cap and unmaps everything cached if it is lowered
+  void setMaxCachedBytes(size_t bytes) {
+    std::lock_guard<std::mutex> g(lock_);
+    maxCachedBytes_ = bytes;
+    if (cachedBytes_ > maxCachedBytes_) {
+      releaseLocked();
+    }
+  }
+
+  /// Unmaps every cached region
+  void release() {
+    std::lock_guard<std::mutex> g(lock_);
+    releaseLocked();
+  }
+
+ private:
+  MMapRegionPool() = default;
+
+  void releaseLocked() {
+    for (auto &entry : free_) {
+      for (auto p : entry.second) {
+        munmap(p, entry.first);
+      }
+    }
+    free_.clear();
+    cachedBytes_ = 0;
+  }
+
+  mutable std::mutex lock_;
+  std::unordered_map<size_t, std::vector<void *>> free_;
+  size_t cachedBytes_ = 0;
+  size_t maxCachedBytes_ = kDefaultMaxCachedBytes;
+};
+
+/// An MMapAlloc that recycles regions through MMapRegionPool.  Use it for
+/// maps that are created and destroyed often, such as per-request or
+/// per-window maps.  Memory comes back zero-filled either way.
+class PooledMMapAlloc {
+ public:
+  void *allocate(size_t size) {
+    auto len = MMapRegionPool::sizeClass(size);
+    void *p = MMapRegionPool::instance().take(len);
+    return p != nullptr ? p : MMapAlloc().allocate(len);
+  }
+
+  void deallocate(void *p, size_t size) {
+    auto len = MMapRegionPool::sizeClass(size);
+    if (!MMapRegionPool::instance().give(p, len)) {
+      MMapAlloc().deallocate(p, len);
+    }
+  }
+};
+
+/// An allocator for small maps that avoids the mmap syscall, and the
+/// page of memory it costs, for the thousands of tiny maps some callers
+/// create.  Slot arrays of up to InlineBytes live inside the allocator,
+/// and so inside the map object itself; arrays below HeapThreshold come
+/// from calloc; larger ones fall back to MMapAlloc.  Memory comes back
+/// zero-filled in all three cases.
+///
+/// The map keeps its allocator for its whole lifetime and never moves,
+/// which is what makes the inline case safe.  The inline bytes hold one
+/// allocation at a time; while they are taken, small requests come from
+/// calloc, so compact() can build its second slot array alongside the
+/// live one.  Copying a SmallMapAlloc doesn't copy the inline bytes,
+/// since they belong to the allocations of the original.
+template <size_t InlineBytes = 0, size_t HeapThreshold = 128 * 1024>
+class SmallMapAlloc {
+ public:
+  SmallMapAlloc() = default;
+  SmallMapAlloc(const SmallMapAlloc &) {}
+  SmallMapAlloc &operator=(const SmallMapAlloc &) { return *this; }
+
+  void *allocate(size_t size) {
+    if (size <= InlineBytes && !inlineInUse_) {
+      inlineInUse_ = true;
+      memset(inline_, 0, size);
+      return inline_;
+    }
+    if (size < std::max(HeapThreshold, InlineBytes + 1)) {
+      void *p = calloc(1, size);
+      if (p == nullptr) {
+        throw std::bad_alloc();
+      }
+      return p;
+    }
+    return MMapAlloc().allocate(size);
+  }
+
+  void deallocate(void *p, size_t size) {
+    if (p == inline_) {
+      assert(inlineInUse_);
+      inlineInUse_ = false;
+    } else if (size < std::max(HeapThreshold, InlineBytes + 1)) {
+      free(p);
+    } else {
+      MMapAlloc().deallocate(p, size);
+    }
+  }
+
+ private:
+  alignas(alignof(std::max_align_t)) char inline_[InlineBytes > 0 ? InlineBytes
+                                                                  : 1];
+  bool inlineInUse_ = false;
+};
+
+/// Blocks while *addr == expected, for at most timeoutNs, or until a
+/// futexWake on addr.  May return spuriously; callers re-check their
+/// condition.  Without futexes this degrades to a short sleep.
+inline void futexWait(std::atomic<uint32_t> *addr, uint32_t expected,
+                      int64_t timeoutNs) {
+#if defined(__linux__)
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "futex words must be plain 32 bit integers");
+  timespec ts;
+  ts.tv_sec = timeoutNs / 1000000000;
+  ts.tv_nsec = timeoutNs % 1000000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT_PRIVATE,
+          expected, &ts, nullptr, 0);
+#else
+  if (addr->load(std::memory_order_acquire) == expected) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(
+        std::min<int64_t>(timeoutNs, 1000000)));
+  }
+#endif
+}
+
+/// Wakes every thread blocked in futexWait on addr
+inline void futexWakeAll(std::atomic<uint32_t> *addr) {
+#if defined(__linux__)
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE_PRIVATE,
+          INT32_MAX, nullptr, nullptr, 0);
+#else
+  (void)addr;
+#endif
+}
+
+/// A process-wide table of futex words that threads park on while they
+/// wait for some (object, index) pair to change, in the spirit of
+/// folly::ParkingLot.  Unrelated waiters that hash to the same bucket
+/// just see spurious wakeups.
+class ParkingLot {
+ public:
+  enum : size_t { kNumBuckets = 256 };
+
+  static std::atomic<uint32_t> &bucket(const void *owner, uint64_t index) {
+    static Bucket buckets[kNumBuckets];
+    uint64_t h = reinterpret_cast<uintptr_t>(owner) ^
+                 (index * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 29;
+    return buckets[(h * 0xbf58476d1ce4e5b9ULL) >> 56].epoch;
+  }
+
+ private:
+  struct alignas(64) Bucket {
+    std::atomic<uint32_t> epoch{0};
+  };
+};
+
 template <typename Allocator>
 struct GivesZeroFilledMemory : public std::false_type {};
 
 template <>
 struct GivesZeroFilledMemory<MMapAlloc> : public std::true_type {};
 
+template <>
+struct GivesZeroFilledMemory<PooledMMapAlloc> : public std::true_type {};
+
+template <size_t InlineBytes, size_t HeapThreshold>
+struct GivesZeroFilledMemory<SmallMapAlloc<InlineBytes, HeapThreshold>>
+    : public std::true_type {};
+
 }  // namespace detail
 }  // namespace folly
@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * A deliberately small stand-in for folly/Benchmark.h, so that the
+ * benchmarks in this directory build without folly.
+ *
+ * doNotOptimizeAway(x)
+ *    keeps the compiler from discarding the computation of x
+ *
+ * bench::timeNs(fn)
+ *    wall-clock nanoseconds taken by one call of fn
+ *
+ * bench::Table
+ *    collects rows of a result table and prints them aligned
+ *
+ * bench::timeThreadsNs(numThreads, fn)
+ *    wall-clock nanoseconds for numThreads threads to each run
+ *    fn(threadIndex), started together and pinned per --pin
+ *
+ * bench::readCpuTopology() / bench::pinPlan(policy, n)
+ *    the usable CPUs from /sys/devices/system/cpu, and the CPUs that n
+ *    threads are pinned to under a compact, scatter or physical policy
+ *
+ * bench::PerfCounters / bench::measure(ops, fn)
+ *    hardware counters (LLC, dTLB and branch misses, instructions) per
+ *    operation, read with perf_event_open when --perf is passed
+ *
+ * bench::runSuites(argc, argv, suites)
+ *    runs the suites whose names contain any of the command line args
+ *    (all of them if there are none); also parses --perf and --pin=
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace folly {
+
+template <typename T>
+inline void doNotOptimizeAway(const T &datum) {
+  asm volatile("" : : "r,m"(datum) : "memory");
+}
+
+namespace bench {
+
+using Clock = std::chrono::steady_clock;
+
+template <typename Func>
+double timeNs(Func &&func) {
+  auto start = Clock::now();
+  func();
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+      .count();
+}
+
+/// One logical CPU.  sibling is its index among the SMT threads of its
+/// core, so sibling 0 is the first hardware thread of each core.
+struct CpuInfo {
+  int cpu;
+  int core;
+  int package;
+  int sibling;
+};
+
+/// The first line of a sysfs file, or "" if it can't be read
+inline std::string readSysFile(const std::string &path) {
+  std::ifstream in(path);
+  std::string rv;
+  std::getline(in, rv);
+  return rv;
+}
+
+/// Parses a kernel cpu list such as "0-3,8,10-11"
+inline std::vector<int> parseCpuList(const std::string &list) {
+  std::vector<int> rv;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    auto end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    auto range = list.substr(pos, end - pos);
+    auto dash = range.find('-');
+    if (!range.empty()) {
+      int lo = std::stoi(range.substr(0, dash));
+      int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+      for (int cpu = lo; cpu <= hi; ++cpu) {
+        rv.push_back(cpu);
+      }
+    }
+    pos = end + 1;
+  }
+  return rv;
+}
+
+/// The online CPUs that this process may run on, ordered by package,
+/// core and SMT sibling.  Falls back to one core per CPU on package 0 if
+/// sysfs isn't readable.
+inline std::vector<CpuInfo> readCpuTopology() {
+  const std::string base = "/sys/devices/system/cpu/";
+  auto online = parseCpuList(readSysFile(base + "online"));
+  if (online.empty()) {
+    for (int cpu = 0; cpu < int(std::thread::hardware_concurrency()); ++cpu) {
+      online.push_back(cpu);
+    }
+  }
+#if defined(__linux__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+#endif
+  std::vector<CpuInfo> rv;
+  for (int cpu : online) {
+#if defined(__linux__)
+    if (haveMask && !CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+#endif
+    auto dir = base + "cpu" + std::to_string(cpu) + "/topology/";
+    auto core = readSysFile(dir + "core_id");
+    auto package = readSysFile(dir + "physical_package_id");
+    rv.push_back(CpuInfo{cpu, core.empty() ? cpu : std::stoi(core),
+                         package.empty() ? 0 : std::stoi(package), 0});
+  }
+  std::sort(rv.begin(), rv.end(), [](const CpuInfo &a, const CpuInfo &b) {
+    return std::tie(a.package, a.core, a.cpu) <
+           std::tie(b.package, b.core, b.cpu);
+  });
+  for (size_t i = 1; i < rv.size(); ++i) {
+    if (rv[i].package == rv[i - 1].package && rv[i].core == rv[i - 1].core) {
+      rv[i].sibling = rv[i - 1].sibling + 1;
+    }
+  }
+  return rv;
+}
+
+/// How timeThreadsNs places its threads:
+///  NONE      leaves placement to the scheduler
+///  COMPACT   fills every SMT sibling of a core, then the next core, then
+///            the next package
+///  SCATTER   spreads over packages first, then cores, and only uses SMT
+///            siblings once every core has a thread
+///  PHYSICAL  one thread per core, as SCATTER but never an SMT sibling
+enum class PinPolicy { NONE, COMPACT, SCATTER, PHYSICAL };
+
+inline const char *pinPolicyName(PinPolicy policy) {
+  static const char *names[] = {"none", "compact", "scatter", "physical"};
+  return names[int(policy)];
+}
+
+/// Returns a mutable pin policy.  runSuites sets it from --pin=.
+inline PinPolicy &pinPolicy() {
+  static PinPolicy policy = PinPolicy::NONE;
+  return policy;
+}
+
+/// The CPU for each of numThreads threads under policy, reusing CPUs
+/// round-robin once there are more threads than the policy allows.
+/// Empty for NONE.
+inline std::vector<int> pinPlan(PinPolicy policy, size_t numThreads,
+                                std::vector<CpuInfo> topo = readCpuTopology()) {
+  if (policy == PinPolicy::NONE || topo.empty()) {
+    return {};
+  }
+  if (policy != PinPolicy::COMPACT) {
+    // rank of each core within its package, so that sorting by (sibling,
+    // rank, package) deals cores out across packages
+    std::vector<std::tuple<int, int, int>> keys;
+    for (size_t i = 0, rank = 0; i < topo.size(); ++i) {
+      if (i > 0 && topo[i].package != topo[i - 1].package) {
+        rank = 0;
+      } else if (i > 0 && topo[i].core != topo[i - 1].core) {
+        ++rank;
+      }
+      keys.emplace_back(topo[i].sibling, int(rank), topo[i].package);
+    }
+    std::vector<size_t> order;
+    for (size_t i = 0; i < topo.size(); ++i) {
+      if (policy == PinPolicy::SCATTER || topo[i].sibling == 0) {
+        order.push_back(i);
+      }
+    }
+    std::sort(order.begin(), order.end(),
+              [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+    std::vector<CpuInfo> placed;
+    for (auto i : order) {
+      placed.push_back(topo[i]);
+    }
+    topo.swap(placed);
+  }
+  std::vector<int> rv;
+  for (size_t t = 0; t < numThreads; ++t) {
+    rv.push_back(topo[t % topo.size()].cpu);
+  }
+  return rv;
+}
+
+/// Pins the calling thread to cpu.  Returns false if that isn't possible.
+inline bool pinCurrentThread(int cpu) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+/// Starts numThreads threads, releases them at once and returns the
+/// wall time until the last one finishes func(threadIndex).  Thread
+/// creation isn't included.  Threads are pinned per pinPolicy().
+template <typename Func>
+double timeThreadsNs(size_t numThreads, Func &&func) {
+  auto cpus = pinPlan(pinPolicy(), numThreads);
+  std::atomic<size_t> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < numThreads; ++t) {
+    threads.emplace_back([&, t] {
+      if (!cpus.empty()) {
+        pinCurrentThread(cpus[t]);
+      }
+      ++ready;
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      func(t);
+    });
+  }
+  while (ready.load() != numThreads) {
+    std::this_thread::yield();
+  }
+  auto start = Clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto &thr : threads) {
+    thr.join();
+  }
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+      .count();
+}
+
+/// Formats a double with a fixed number of decimals
+inline std::string fmt(double v, int precision = 2) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", precision, v);
+  return buf;
+}
+
+/// A list of types to instantiate a benchmark for, in the spirit of
+/// ::testing::Types.  forEachType calls func(T{}) for each T.
+template <typename... Ts>
+struct TypeList {};
+
+template <typename Func>
+void forEachType(TypeList<>, Func &&) {}
+
+template <typename T, typename... Ts, typename Func>
+void forEachType(TypeList<T, Ts...>, Func &&func) {
+  func(T{});
+  forEachType(TypeList<Ts...>{}, func);
+}
+
+/// Returns a mutable flag that enables hardware counters.  runSuites
+/// sets it when --perf is on the command line.
+inline bool &perfEnabled() {
+  static bool enabled = false;
+  return enabled;
+}
+
+/// A set of hardware counters for the calling thread and the threads it
+/// creates while counting.  Each event is opened separately, so one that
+/// the CPU or kernel doesn't support (perf_event_paranoid, containers,
+/// VMs without a PMU) is reported as unavailable instead of failing the
+/// whole set.  Counts are scaled if the kernel had to multiplex them.
+class PerfCounters {
+ public:
+  enum Event { LLC_MISSES, DTLB_MISSES, BRANCH_MISSES, INSTRUCTIONS, NUM };
+
+  static const char *name(int event) {
+    static const char *names[] = {"LLC-miss", "dTLB-miss", "br-miss",
+                                  "instr"};
+    return names[event];
+  }
+
+  PerfCounters() {
+    for (int i = 0; i < NUM; ++i) {
+      fds_[i] = open(Event(i));
+    }
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  ~PerfCounters() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+#endif
+  }
+
+  bool available(int event) const { return fds_[event] >= 0; }
+
+  bool anyAvailable() const {
+    for (int i = 0; i < NUM; ++i) {
+      if (available(i)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void start() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  void stop() {
+#if defined(__linux__)
+    for (int fd : fds_) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+#endif
+  }
+
+  /// The count of event since start(), or -1 if it is unavailable
+  double read(int event) const {
+#if defined(__linux__)
+    uint64_t buf[3];  // value, time enabled, time running
+    if (fds_[event] < 0 ||
+        ::read(fds_[event], buf, sizeof(buf)) != sizeof(buf)) {
+      return -1;
+    }
+    return buf[2] == 0 ? 0.0 : double(buf[0]) * buf[1] / buf[2];
+#else
+    (void)event;
+    return -1;
+#endif
+  }
+
+ private:
+  static int open(Event event) {
+#if defined(__linux__)
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (event) {
+      case LLC_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      case DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      case BRANCH_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+      default:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    }
+    return int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+    (void)event;
+    return -1;
+#endif
+  }
+
+  int fds_[NUM];
+};
+
+/// The result of measure(): wall time and, if --perf was given and the
+/// counter could be opened, hardware events, all divided by ops
+struct Measurement {
+  double ns;
+  double perOp[PerfCounters::NUM];  // -1 if unavailable or disabled
+
+  /// Column headers matching cells()
+  static std::vector<std::string> columns(const std::string &prefix) {
+    std::vector<std::string> rv{prefix + " ns"};
+    if (perfEnabled()) {
+      for (int i = 0; i < PerfCounters::NUM; ++i) {
+        rv.push_back(std::string(PerfCounters::name(i)) + "/op");
+      }
+    }
+    return rv;
+  }
+
+  std::vector<std::string> cells() const {
+    std::vector<std::string> rv{fmt(ns)};
+    if (perfEnabled()) {
+      for (int i = 0; i < PerfCounters::NUM; ++i) {
+        rv.push_back(perOp[i] < 0 ? "-" : fmt(perOp[i], 3));
+      }
+    }
+    return rv;
+  }
+};
+
+/// Runs func once and returns its wall time and hardware events per op
+template <typename Func>
+Measurement measure(size_t ops, Func &&func) {
+  Measurement rv;
+  std::fill(rv.perOp, rv.perOp + PerfCounters::NUM, -1.0);
+  if (!perfEnabled()) {
+    rv.ns = timeNs(func) / std::max<size_t>(ops, 1);
+    return rv;
+  }
+  PerfCounters counters;
+  counters.start();
+  rv.ns = timeNs(func) / std::max<size_t>(ops, 1);
+  counters.stop();
+  for (int i = 0; i < PerfCounters::NUM; ++i) {
+    auto v = counters.read(i);
+    rv.perOp[i] = v < 0 ? -1.0 : v / std::max<size_t>(ops, 1);
+  }
+  return rv;
+}
+
+/// Returns the cells of a followed by those of b
+inline std::vector<std::string> concat(std::vector<std::string> a,
+                                       const std::vector<std::string> &b) {
+  a.insert(a.end(), b.begin(), b.end());
+  return a;
+}
+
+class Table {
+ public:
+  Table(std::string title, std::vector<std::string> columns)
+      : title_(std::move(title)), columns_(std::move(columns)) {}
+
+  void addRow(std::vector<std::string> cells) {
+    cells.resize(columns_.size());
+    rows_.push_back(std::move(cells));
+  }
+
+  void print(std::ostream &out = std::cout) const {
+    std::vector<size_t> widths;
+    for (auto &c : columns_) {
+      widths.push_back(c.size());
+    }
+    for (auto &row : rows_) {
+      for (size_t i = 0; i < row.size(); ++i) {
+        widths[i] = std::max(widths[i], row[i].size());
+      }
+    }
+    size_t total = 0;
+    for (auto w : widths) {
+      total += w + 2;
+    }
+    std::string rule(std::max(total, title_.size()), '=');
+    out << rule << '\n' << title_ << '\n' << rule << '\n';
+    printRow(out, columns_, widths);
+    out << std::string(rule.size(), '-') << '\n';
+    for (auto &row : rows_) {
+      printRow(out, row, widths);
+    }
+    out << rule << '\n' << std::endl;
+  }
+
+ private:
+  static void printRow(std::ostream &out, const std::vector<std::string> &row,
+                       const std::vector<size_t> &widths) {
+    for (size_t i = 0; i < row.size(); ++i) {
+      // first column left aligned, numbers right aligned
+      auto pad = std::string(widths[i] - row[i].size(), ' ');
+      out << (i == 0 ? row[i] + pad : pad + row[i]) << "  ";
+    }
+    out << '\n';
+  }
+
+  std::string title_;
+  std::vector<std::string> columns_;
+  std::vector<std::vector<std::string>> rows_;
+};
+
+struct Suite {
+  const char *name;
+  void (*run)();
+};
+
+inline int runSuites(int argc, char **argv, const std::vector<Suite> &suites) {
+  std::vector<const char *> filters;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--perf") == 0) {
+      perfEnabled() = true;
+    } else if (strncmp(argv[i], "--pin=", 6) == 0) {
+      bool known = false;
+      for (auto policy : {PinPolicy::NONE, PinPolicy::COMPACT,
+                          PinPolicy::SCATTER, PinPolicy::PHYSICAL}) {
+        if (strcmp(argv[i] + 6, pinPolicyName(policy)) == 0) {
+          pinPolicy() = policy;
+          known = true;
+        }
+      }
+      if (!known) {
+        std::cerr << "unknown pin policy " << argv[i] + 6
+                  << ", expected none, compact, scatter or physical"
+                  << std::endl;
+        return 1;
+      }
+    } else {
+      filters.push_back(argv[i]);
+    }
+  }
+  if (perfEnabled()) {
+    PerfCounters probe;
+    if (!probe.anyAvailable()) {
+      std::cerr << "perf counters unavailable (" << strerror(errno)
+                << "), reporting wall time only" << std::endl;
+      perfEnabled() = false;
+    }
+  }
+  for (auto &suite : suites) {
+    bool selected = filters.empty();
+    for (auto filter : filters) {
+      selected = selected || strstr(suite.name, filter) != nullptr;
+    }
+    if (selected) {
+      suite.run();
+    }
+  }
+  return 0;
+}
+
+}  // namespace bench
+}  // namespace folly
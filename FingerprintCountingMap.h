@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#include "AtomicUnorderedMap.h"
+#include "SeededHash.h"
+
+namespace folly {
+
+/// FingerprintCountingMap counts occurrences of keys while storing only a
+/// fingerprint of each key, for heavy-hitter and flow counting where the
+/// keys themselves are too big to keep.  It is an AtomicUnorderedInsertMap
+/// from Fingerprint to MutableAtom<Count>, so a slot is the chain head and
+/// next index plus the fingerprint and counter (16 bytes for the default
+/// 32-bit fingerprint and counter), whatever the size of Key.
+///
+/// The fingerprint is the top bits of a 64-bit hash of the key (a
+/// SeededHash by default, so it differs per instance), and the home slot
+/// is taken from the fingerprint.  Keys with equal fingerprints share a
+/// counter, which makes the map lossy in two ways, for n distinct keys
+/// tracked with b-bit fingerprints:
+///
+/// * count() of a key that was never added is nonzero with probability
+///   about n / 2^b, see falsePositiveRate()
+/// * some pair of tracked keys shares a counter with probability about
+///   n^2 / 2^(b+1), see mergeProbability(), in which case both report
+///   their sum
+///
+/// With 32-bit fingerprints and a million keys that is a 0.02% false
+/// positive rate, but merges are likely somewhere in the map; 64-bit
+/// fingerprints make both negligible at 24 bytes per slot.  Counts are
+/// never lost or undercounted.
+///
+/// Usage:
+///
+///  FingerprintCountingMap<std::string> flows(1000000);
+///  flows.add(flowKey, bytes);
+///  if (flows.count(flowKey) > threshold) { ... }
+template <typename Key, typename Fingerprint = uint32_t,
+          typename Count = uint32_t, typename Hash = SeededHash<Key>,
+          template <typename> class Atom = std::atomic,
+          typename Allocator = folly::detail::MMapAlloc>
+class FingerprintCountingMap {
+  static_assert(std::is_unsigned<Fingerprint>::value &&
+                    sizeof(Fingerprint) <= sizeof(uint64_t),
+                "Fingerprint must be an unsigned integer of up to 64 bits");
+
+  /// Fingerprints are already well mixed hash bits
+  struct FingerprintHash {
+    size_t operator()(Fingerprint fp) const { return size_t(fp); }
+  };
+
+  typedef AtomicUnorderedInsertMap<Fingerprint, MutableAtom<Count, Atom>,
+                                   FingerprintHash, std::equal_to<Fingerprint>,
+                                   true, Atom, uint32_t, Allocator>
+      Map;
+
+ public:
+  typedef Key key_type;
+  typedef Fingerprint fingerprint_type;
+  typedef Count count_type;
+
+  enum : size_t { kFingerprintBits = 8 * sizeof(Fingerprint) };
+
+  explicit FingerprintCountingMap(size_t maxKeys, float maxLoadFactor = 0.8f,
+                                  const Hash &hasher = Hash())
+      : hasher_(hasher), map_(maxKeys, maxLoadFactor) {}
+
+  /// Adds delta to the counter of key's fingerprint and returns the new
+  /// count.  Throws std::bad_alloc if a new fingerprint doesn't fit.
+  Count add(const Key &key, Count delta = 1) {
+    auto &counter = map_.emplace(fingerprint(key), Count(0)).first->second;
+    return counter.data.fetch_add(delta, std::memory_order_relaxed) + delta;
+  }
+
+  /// The count of key's fingerprint, 0 if it was never added (but see the
+  /// false positive rate above)
+  Count count(const Key &key) const {
+    auto iter = map_.find(fingerprint(key));
+    return iter == map_.cend()
+               ? Count(0)
+               : iter->second.data.load(std::memory_order_relaxed);
+  }
+
+  Fingerprint fingerprint(const Key &key) const {
+    auto h = uint64_t(hasher_(key));
+    return kFingerprintBits == 64 ? Fingerprint(h)
+                                  : Fingerprint(h >> (64 - kFingerprintBits));
+  }
+
+  /// Calls func(Fingerprint, Count) for every tracked fingerprint
+  template <typename Func>
+  void forEach(Func &&func) const {
+    for (auto iter = map_.cbegin(); iter != map_.cend(); ++iter) {
+      func(iter->first, iter->second.data.load(std::memory_order_relaxed));
+    }
+  }
+
+  /// Expected fraction of never-added keys whose count() is nonzero once
+  /// distinctKeys keys have been added
+  static double falsePositiveRate(size_t distinctKeys) {
+    return -std::expm1(-double(distinctKeys) /
+                       std::ldexp(1.0, int(kFingerprintBits)));
+  }
+
+  /// Probability that at least two of distinctKeys keys share a counter
+  static double mergeProbability(size_t distinctKeys) {
+    double n = double(distinctKeys);
+    return -std::expm1(-n * (n - 1) /
+                       std::ldexp(2.0, int(kFingerprintBits)));
+  }
+
+  /// Memory used by the slot array, see AtomicUnorderedInsertMap
+  typename Map::MemoryStats memoryStats() const { return map_.memoryStats(); }
+
+ private:
+  Hash hasher_;
+  Map map_;
+};
+
+}  // namespace folly
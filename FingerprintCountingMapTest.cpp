@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "FingerprintCountingMap.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace folly;
+
+namespace {
+
+// The fraction of never-added keys that count() reports as present
+template <typename Map>
+double measuredFalsePositiveRate(Map &m, size_t added, size_t probes) {
+  for (uint64_t k = 0; k < added; ++k) {
+    m.add(k);
+  }
+  size_t falsePositives = 0;
+  for (uint64_t k = added; k < added + probes; ++k) {
+    falsePositives += m.count(k) != 0;
+  }
+  return double(falsePositives) / probes;
+}
+
+}  // namespace
+
+TEST(FingerprintCountingMap, counts) {
+  FingerprintCountingMap<std::string, uint64_t> m(1000);
+  EXPECT_EQ(m.count("a"), 0);
+  EXPECT_EQ(m.add("a"), 1);
+  EXPECT_EQ(m.add("a", 5), 6);
+  EXPECT_EQ(m.add("b"), 1);
+  EXPECT_EQ(m.count("a"), 6);
+  EXPECT_EQ(m.count("b"), 1);
+
+  size_t fingerprints = 0;
+  m.forEach([&](uint64_t fp, uint32_t count) {
+    EXPECT_EQ(count, fp == m.fingerprint("a") ? 6 : 1);
+    ++fingerprints;
+  });
+  EXPECT_EQ(fingerprints, 2);
+}
+
+TEST(FingerprintCountingMap, concurrent_add) {
+  FingerprintCountingMap<uint64_t, uint64_t> m(1000);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (uint64_t i = 0; i < 10000; ++i) {
+        m.add(i % 100);
+      }
+    });
+  }
+  for (auto &thr : threads) {
+    thr.join();
+  }
+  for (uint64_t k = 0; k < 100; ++k) {
+    EXPECT_EQ(m.count(k), 400);
+  }
+}
+
+// 16-bit fingerprints make the false positive rate large enough to
+// measure precisely: 2000 keys should give about 3%
+TEST(FingerprintCountingMap, false_positive_rate_16) {
+  typedef FingerprintCountingMap<uint64_t, uint16_t> Map;
+  Map m(2000);
+  auto expected = Map::falsePositiveRate(2000);
+  EXPECT_NEAR(expected, 0.0301, 0.001);
+  auto measured = measuredFalsePositiveRate(m, 2000, 200000);
+  EXPECT_GT(measured, expected * 0.8);
+  EXPECT_LT(measured, expected * 1.2);
+}
+
+// With 32-bit fingerprints 100k keys give an expected 2.3e-5, so about
+// 23 of a million probes
+TEST(FingerprintCountingMap, false_positive_rate_32) {
+  typedef FingerprintCountingMap<uint64_t> Map;
+  Map m(100000);
+  auto expected = Map::falsePositiveRate(100000);
+  EXPECT_NEAR(expected, 2.33e-5, 1e-7);
+  auto measured = measuredFalsePositiveRate(m, 100000, 1000000);
+  EXPECT_LT(measured, expected * 3);
+}
+
+TEST(FingerprintCountingMap, merges_never_undercount) {
+  // with 8-bit fingerprints 1000 keys must share counters
+  FingerprintCountingMap<uint64_t, uint8_t> m(1000);
+  EXPECT_NEAR(decltype(m)::mergeProbability(1000), 1.0, 1e-9);
+  for (uint64_t k = 0; k < 1000; ++k) {
+    m.add(k, 2);
+  }
+  size_t fingerprints = 0;
+  uint64_t total = 0;
+  m.forEach([&](uint8_t, uint32_t count) {
+    ++fingerprints;
+    total += count;
+  });
+  EXPECT_LE(fingerprints, 256);
+  EXPECT_EQ(total, 2000);
+  for (uint64_t k = 0; k < 1000; ++k) {
+    EXPECT_GE(m.count(k), 2);
+  }
+}
+
+TEST(FingerprintCountingMap, memory_per_key) {
+  typedef AtomicUnorderedInsertMap<std::string, MutableAtom<uint32_t>> FullMap;
+  FullMap full(10000);
+  FingerprintCountingMap<std::string> lossy(10000);
+  // 16 bytes per slot, against 48 for a std::string key on LP64
+  EXPECT_GE(full.memoryStats().reservedBytes,
+            lossy.memoryStats().reservedBytes * 3);
+}
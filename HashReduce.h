@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FOLLY_HASH_REDUCE_X86 1
+#else
+#define FOLLY_HASH_REDUCE_X86 0
+#endif
+
+#include "SeededHash.h"
+
+namespace folly {
+namespace detail {
+
+/// Batch versions of AtomicUnorderedInsertMap::keyToSlotIdx for 64-bit
+/// integer keys: hash each key, mask it with slotMask and subtract
+/// numSlots until it is in range.  The hash is either the identity (what
+/// std::hash does for integers) or twang_mix64(key ^ seed) (what
+/// SeededHash does), both of which are just shifts, adds and xors, so
+/// the AVX2 kernel does 4 keys per instruction and the AVX-512 kernel 8.
+/// The scalar kernel is the fallback everywhere else and the reference
+/// the others are tested against.
+
+enum class HashReduceIsa : uint8_t {
+  SCALAR = 0,
+  AVX2 = 1,
+  AVX512 = 2,
+};
+
+inline const char *hashReduceIsaName(HashReduceIsa isa) {
+  switch (isa) {
+    case HashReduceIsa::AVX2:
+      return "avx2";
+    case HashReduceIsa::AVX512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+/// What a hash reduction computes, besides the map's geometry
+struct HashReduceParams {
+  bool mix;       // twang_mix64(key ^ seed) if true, else key
+  uint64_t seed;  // only used if mix
+  uint64_t slotMask;
+  uint64_t numSlots;
+};
+
+inline void hashReduceScalar(const HashReduceParams &p, const uint64_t *keys,
+                             size_t n, uint64_t *out) {
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t h = p.mix ? twang_mix64(keys[i] ^ p.seed) : keys[i];
+    h &= p.slotMask;
+    while (h >= p.numSlots) {
+      h -= p.numSlots;
+    }
+    out[i] = h;
+  }
+}
+
+#if FOLLY_HASH_REDUCE_X86
+
+__attribute__((target("avx2"))) inline __m256i twangMixAvx2(__m256i k) {
+  // ~k + (k << 21) == (k << 21) - k - 1
+  k = _mm256_sub_epi64(_mm256_slli_epi64(k, 21),
+                       _mm256_add_epi64(k, _mm256_set1_epi64x(1)));
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 24));
+  k = _mm256_add_epi64(
+      _mm256_add_epi64(k, _mm256_slli_epi64(k, 3)), _mm256_slli_epi64(k, 8));
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 14));
+  k = _mm256_add_epi64(
+      _mm256_add_epi64(k, _mm256_slli_epi64(k, 2)), _mm256_slli_epi64(k, 4));
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 28));
+  return _mm256_add_epi64(k, _mm256_slli_epi64(k, 31));
+}
+
+__attribute__((target("avx2"))) inline void hashReduceAvx2(
+    const HashReduceParams &p, const uint64_t *keys, size_t n,
+    uint64_t *out) {
+  // AVX2 only has a signed 64-bit compare, which is fine as long as
+  // masked hashes stay below 2^63
+  if (p.slotMask >= (uint64_t(1) << 63)) {
+    hashReduceScalar(p, keys, n, out);
+    return;
+  }
+  auto const seed = _mm256_set1_epi64x(int64_t(p.seed));
+  auto const mask = _mm256_set1_epi64x(int64_t(p.slotMask));
+  auto const slots = _mm256_set1_epi64x(int64_t(p.numSlots));
+  auto const lastSlot = _mm256_set1_epi64x(int64_t(p.numSlots - 1));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    auto h = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+    if (p.mix) {
+      h = twangMixAvx2(_mm256_xor_si256(h, seed));
+    }
+    h = _mm256_and_si256(h, mask);
+    while (true) {
+      auto over = _mm256_cmpgt_epi64(h, lastSlot);
+      if (_mm256_testz_si256(over, over)) {
+        break;
+      }
+      h = _mm256_sub_epi64(h, _mm256_and_si256(over, slots));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), h);
+  }
+  hashReduceScalar(p, keys + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f"))) inline __m512i twangMixAvx512(__m512i k) {
+  k = _mm512_sub_epi64(_mm512_slli_epi64(k, 21),
+                       _mm512_add_epi64(k, _mm512_set1_epi64(1)));
+  k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 24));
+  k = _mm512_add_epi64(
+      _mm512_add_epi64(k, _mm512_slli_epi64(k, 3)), _mm512_slli_epi64(k, 8));
+  k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 14));
+  k = _mm512_add_epi64(
+      _mm512_add_epi64(k, _mm512_slli_epi64(k, 2)), _mm512_slli_epi64(k, 4));
+  k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 28));
+  return _mm512_add_epi64(k, _mm512_slli_epi64(k, 31));
+}
+
+__attribute__((target("avx512f"))) inline void hashReduceAvx512(
+    const HashReduceParams &p, const uint64_t *keys, size_t n,
+    uint64_t *out) {
+  auto const seed = _mm512_set1_epi64(int64_t(p.seed));
+  auto const mask = _mm512_set1_epi64(int64_t(p.slotMask));
+  auto const slots = _mm512_set1_epi64(int64_t(p.numSlots));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    auto h = _mm512_loadu_si512(keys + i);
+    if (p.mix) {
+      h = twangMixAvx512(_mm512_xor_si512(h, seed));
+    }
+    h = _mm512_and_si512(h, mask);
+    __mmask8 over;
+    while ((over = _mm512_cmpge_epu64_mask(h, slots)) != 0) {
+      h = _mm512_mask_sub_epi64(h, over, h, slots);
+    }
+    _mm512_storeu_si512(out + i, h);
+  }
+  hashReduceScalar(p, keys + i, n - i, out + i);
+}
+
+#endif  // FOLLY_HASH_REDUCE_X86
+
+/// The widest kernel this CPU runs, checked once
+inline HashReduceIsa bestHashReduceIsa() {
+#if FOLLY_HASH_REDUCE_X86
+  static const HashReduceIsa isa = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return HashReduceIsa::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return HashReduceIsa::AVX2;
+    }
+    return HashReduceIsa::SCALAR;
+  }();
+  return isa;
+#else
+  return HashReduceIsa::SCALAR;
+#endif
+}
+
+/// Writes the home slot of keys[i] to out[i] with the given kernel,
+/// which the CPU must support (see bestHashReduceIsa)
+inline void hashReduce(HashReduceIsa isa, const HashReduceParams &p,
+                       const uint64_t *keys, size_t n, uint64_t *out) {
+#if FOLLY_HASH_REDUCE_X86
+  if (isa == HashReduceIsa::AVX512) {
+    hashReduceAvx512(p, keys, n, out);
+    return;
+  }
+  if (isa == HashReduceIsa::AVX2) {
+    hashReduceAvx2(p, keys, n, out);
+    return;
+  }
+#endif
+  (void)isa;
+  hashReduceScalar(p, keys, n, out);
+}
+
+inline void hashReduce(const HashReduceParams &p, const uint64_t *keys,
+                       size_t n, uint64_t *out) {
+  hashReduce(bestHashReduceIsa(), p, keys, n, out);
+}
+
+/// BatchHash<Hash, Key> says whether hashReduce can compute Hash for Key.
+/// It can for integer keys of up to 64 bits with std::hash (which is the
+/// identity in libstdc++ and libc++) or with SeededHash.  key() widens a
+/// key the way both hashes do before hashing it.
+template <typename Hash, typename Key, typename Enable = void>
+struct BatchHash : std::false_type {};
+
+template <typename Key>
+using IsBatchKey =
+    std::integral_constant<bool, std::is_integral<Key>::value &&
+                                     sizeof(Key) <= sizeof(uint64_t) &&
+                                     sizeof(size_t) == sizeof(uint64_t)>;
+
+#if defined(__GLIBCXX__) || defined(_LIBCPP_VERSION)
+template <typename Key>
+struct BatchHash<std::hash<Key>, Key,
+                 typename std::enable_if<IsBatchKey<Key>::value>::type>
+    : std::true_type {
+  static uint64_t key(Key k) { return uint64_t(k); }
+  static HashReduceParams params(const std::hash<Key> &, uint64_t slotMask,
+                                 uint64_t numSlots) {
+    return HashReduceParams{false, 0, slotMask, numSlots};
+  }
+};
+#endif
+
+template <typename Key, typename Inner>
+struct BatchHash<SeededHash<Key, Inner>, Key,
+                 typename std::enable_if<IsBatchKey<Key>::value>::type>
+    : std::true_type {
+  static uint64_t key(Key k) { return uint64_t(k); }
+  static HashReduceParams params(const SeededHash<Key, Inner> &hash,
+                                 uint64_t slotMask, uint64_t numSlots) {
+    return HashReduceParams{true, hash.seed(), slotMask, numSlots};
+  }
+};
+
+}  // namespace detail
+}  // namespace folly
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "HashReduce.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+
+using namespace folly;
+using namespace folly::detail;
+
+namespace {
+
+std::vector<HashReduceIsa> supportedIsas() {
+  std::vector<HashReduceIsa> rv{HashReduceIsa::SCALAR};
+  if (bestHashReduceIsa() >= HashReduceIsa::AVX2) {
+    rv.push_back(HashReduceIsa::AVX2);
+  }
+  if (bestHashReduceIsa() >= HashReduceIsa::AVX512) {
+    rv.push_back(HashReduceIsa::AVX512);
+  }
+  return rv;
+}
+
+// the map's geometry for capacity, as in AtomicUnorderedInsertMap
+HashReduceParams paramsFor(size_t capacity, bool mix, uint64_t seed) {
+  return HashReduceParams{mix, seed, nextPowTwo(capacity * 4) - 1, capacity};
+}
+
+// calls find() and findBatch() for every key and checks that they agree
+template <typename Map, typename Key>
+void expectBatchMatchesFind(const Map &m, const std::vector<Key> &keys) {
+  size_t calls = 0;
+  m.findBatch(keys.data(), keys.size(), [&](size_t i, decltype(m.cend()) it) {
+    EXPECT_EQ(i, calls++);
+    EXPECT_EQ(it.get_internal_slot(), m.find(keys[i]).get_internal_slot());
+  });
+  EXPECT_EQ(calls, keys.size());
+}
+
+}  // namespace
+
+TEST(HashReduce, kernels_match_scalar) {
+  std::mt19937_64 rng(7);
+  std::vector<uint64_t> keys(1003);
+  for (auto &k : keys) {
+    k = rng();
+  }
+  // small sequential keys as well, which stress the identity hash
+  for (size_t i = 0; i < 100; ++i) {
+    keys[i] = i;
+  }
+  for (size_t capacity : {1, 7, 100, 1000, 12345, 1 << 20}) {
+    for (bool mix : {false, true}) {
+      auto p = paramsFor(capacity, mix, rng());
+      std::vector<uint64_t> expected(keys.size());
+      hashReduceScalar(p, keys.data(), keys.size(), expected.data());
+      for (auto h : expected) {
+        ASSERT_LT(h, capacity);
+      }
+      for (auto isa : supportedIsas()) {
+        std::vector<uint64_t> out(keys.size());
+        hashReduce(isa, p, keys.data(), keys.size(), out.data());
+        EXPECT_EQ(out, expected) << hashReduceIsaName(isa) << " " << capacity;
+      }
+    }
+  }
+}
+
+TEST(HashReduce, batch_hash_matches_hasher) {
+  SeededHash<int64_t> seeded;
+  std::hash<uint64_t> plain;
+  typedef BatchHash<SeededHash<int64_t>, int64_t> SeededBatch;
+  typedef BatchHash<std::hash<uint64_t>, uint64_t> PlainBatch;
+  EXPECT_TRUE(SeededBatch::value);
+  EXPECT_TRUE(PlainBatch::value);
+  EXPECT_FALSE((BatchHash<std::hash<std::string>, std::string>::value));
+
+  // a mask below numSlots makes the reduction just the mask
+  uint64_t mask = (uint64_t(1) << 62) - 1;
+  auto sp = SeededBatch::params(seeded, mask, mask + 1);
+  auto pp = PlainBatch::params(plain, mask, mask + 1);
+  for (int64_t k : {int64_t(0), int64_t(1), int64_t(-1), int64_t(1) << 40}) {
+    uint64_t wide = SeededBatch::key(k);
+    uint64_t h;
+    hashReduceScalar(sp, &wide, 1, &h);
+    EXPECT_EQ(h, uint64_t(seeded(k)) & mask);
+    wide = PlainBatch::key(uint64_t(k));
+    hashReduceScalar(pp, &wide, 1, &h);
+    EXPECT_EQ(h, uint64_t(plain(uint64_t(k))) & mask);
+  }
+}
+
+TEST(HashReduce, find_batch) {
+  AtomicUnorderedInsertMap<uint64_t, uint64_t> plain(1000);
+  AtomicUnorderedInsertMap<int32_t, int32_t, SeededHash<int32_t>> seeded(1000);
+  AtomicUnorderedInsertMap<std::string, int> strings(1000);
+  std::vector<uint64_t> plainKeys;
+  std::vector<int32_t> seededKeys;
+  std::vector<std::string> stringKeys;
+  for (int i = -500; i < 500; ++i) {
+    if (i % 3 != 0) {
+      plain.emplace(uint64_t(i), uint64_t(i));
+      seeded.emplace(i, i);
+      strings.emplace(std::to_string(i), i);
+    }
+    plainKeys.push_back(uint64_t(i));
+    seededKeys.push_back(i);
+    stringKeys.push_back(std::to_string(i));
+  }
+  expectBatchMatchesFind(plain, plainKeys);
+  expectBatchMatchesFind(seeded, seededKeys);
+  expectBatchMatchesFind(strings, stringKeys);
+
+  size_t hits = 0;
+  plain.findBatch(plainKeys.data(), plainKeys.size(),
+                  [&](size_t i, decltype(plain.cend()) it) {
+                    if (it != plain.cend()) {
+                      EXPECT_EQ(it->second, plainKeys[i]);
+                      ++hits;
+                    }
+                  });
+  EXPECT_EQ(hits, 667);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace folly {
+
+namespace detail {
+
+/// The 64-bit finalizer of MurmurHash3.  HyperLogLog needs uniformly
+/// distributed bits, which a map's Hash (std::hash of an integer is the
+/// identity) doesn't promise.
+inline uint64_t hllMix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+}  // namespace detail
+
+/// Constructor arguments for an AtomicUnorderedInsertMap
+struct MapSizing {
+  size_t maxSize;
+  float maxLoadFactor;
+};
+
+/// The sizing for a map that will hold `expected` distinct keys, where
+/// `expected` is an estimate with relative standard error `stdError`.
+/// maxSize leaves room for `sigmas` standard errors of underestimate
+/// and for `growth` (1.1 for 10% more keys than last time).
+inline MapSizing sizeForCardinality(double expected, double stdError,
+                                    double growth = 1.0, double sigmas = 3.0,
+                                    float maxLoadFactor = 0.8f) {
+  auto keys = std::ceil(expected * growth * (1 + sigmas * stdError));
+  return MapSizing{size_t(std::max(1.0, keys)), maxLoadFactor};
+}
+
+/// HyperLogLog (Flajolet et al.) estimates the number of distinct keys
+/// seen, in 2^Precision one-byte registers (4 KB by default) with a
+/// relative standard error of about 1.04 / sqrt(2^Precision), 1.6% by
+/// default.  Small counts use linear counting, which is nearly exact.
+///
+/// add() is thread-safe and usually just a load: a register is only
+/// written, with a CAS, when the key raises its maximum, which gets rare
+/// quickly.  Use it to size the next instance of a map whose key count
+/// isn't known up front, either by feeding it keys directly or through
+/// CardinalityTracer (AtomicUnorderedMapTracers.h), which counts the
+/// distinct keys passed to findOrConstruct.
+///
+/// Usage:
+///
+///  HyperLogLog<> hll;
+///  for (auto &k : window) { hll.add(k); }
+///  auto s = hll.sizing(1.1);
+///  AtomicUnorderedInsertMap<K, V> next(s.maxSize, s.maxLoadFactor);
+template <unsigned Precision = 12, template <typename> class Atom = std::atomic>
+class HyperLogLog {
+  static_assert(Precision >= 4 && Precision <= 18,
+                "HyperLogLog precision must be between 4 and 18");
+
+ public:
+  enum : size_t { kRegisters = size_t(1) << Precision };
+
+  HyperLogLog() { clear(); }
+
+  HyperLogLog(const HyperLogLog &) = delete;
+  HyperLogLog &operator=(const HyperLogLog &) = delete;
+
+  /// Adds a key hashed with the map's Hash, or any other 64-bit hash.
+  /// The hash is mixed again, so weak hashes are fine.
+  void addHash(uint64_t hash) {
+    auto h = detail::hllMix(hash);
+    auto &reg = registers_[h >> (64 - Precision)];
+    // the sentinel bit caps the rank when the remaining bits are zero
+    auto rest = (h << Precision) | (uint64_t(1) << (Precision - 1));
+    auto rank = uint8_t(__builtin_clzll(rest) + 1);
+    auto cur = reg.load(std::memory_order_relaxed);
+    while (rank > cur &&
+           !reg.compare_exchange_weak(cur, rank, std::memory_order_relaxed)) {
+    }
+  }
+
+  template <typename Key, typename Hash = std::hash<Key>>
+  void add(const Key &key, const Hash &hash = Hash()) {
+    addHash(uint64_t(hash(key)));
+  }
+
+  /// The estimated number of distinct hashes added so far
+  double estimate() const {
+    double sum = 0;
+    size_t zeros = 0;
+    for (size_t i = 0; i < kRegisters; ++i) {
+      auto r = registers_[i].load(std::memory_order_relaxed);
+      sum += std::ldexp(1.0, -int(r));
+      zeros += r == 0;
+    }
+    double m = double(kRegisters);
+    double raw = alpha() * m * m / sum;
+    if (raw <= 2.5 * m && zeros > 0) {
+      return m * std::log(m / double(zeros));
+    }
+    return raw;
+  }
+
+  /// The relative standard error of estimate()
+  static double stdError() { return 1.04 / std::sqrt(double(kRegisters)); }
+
+  /// sizeForCardinality of the current estimate
+  MapSizing sizing(double growth = 1.0, double sigmas = 3.0,
+                   float maxLoadFactor = 0.8f) const {
+    return sizeForCardinality(estimate(), stdError(), growth, sigmas,
+                              maxLoadFactor);
+  }
+
+  /// Adds every key seen by other, as if they had been added here
+  void merge(const HyperLogLog &other) {
+    for (size_t i = 0; i < kRegisters; ++i) {
+      auto rank = other.registers_[i].load(std::memory_order_relaxed);
+      auto cur = registers_[i].load(std::memory_order_relaxed);
+      while (rank > cur && !registers_[i].compare_exchange_weak(
+                               cur, rank, std::memory_order_relaxed)) {
+      }
+    }
+  }
+
+  /// Forgets every key.  Not atomic with respect to concurrent add().
+  void clear() {
+    for (auto &r : registers_) {
+      r.store(0, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  static double alpha() {
+    switch (Precision) {
+      case 4:
+        return 0.673;
+      case 5:
+        return 0.697;
+      case 6:
+        return 0.709;
+      default:
+        return 0.7213 / (1 + 1.079 / double(kRegisters));
+    }
+  }
+
+  Atom<uint8_t> registers_[kRegisters];
+};
+
+}  // namespace folly
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "HyperLogLog.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AtomicUnorderedMapTracers.h"
+
+using namespace folly;
+
+namespace {
+
+double relativeError(double estimate, double actual) {
+  return std::abs(estimate - actual) / actual;
+}
+
+}  // namespace
+
+TEST(HyperLogLog, empty) {
+  HyperLogLog<> hll;
+  EXPECT_EQ(hll.estimate(), 0);
+}
+
+TEST(HyperLogLog, accuracy) {
+  // sequential integers with std::hash, whose identity hash is the worst
+  // case for a sketch that didn't mix
+  for (uint64_t n : {10, 100, 1000, 10000, 50000, 200000, 1000000}) {
+    HyperLogLog<> hll;
+    for (uint64_t i = 0; i < n; ++i) {
+      hll.add(i);
+    }
+    EXPECT_LT(relativeError(hll.estimate(), n), 4 * hll.stdError()) << n;
+  }
+
+  HyperLogLog<14> strings;
+  for (int i = 0; i < 100000; ++i) {
+    strings.add("key-" + std::to_string(i));
+  }
+  EXPECT_LT(relativeError(strings.estimate(), 100000), 4 * strings.stdError());
+}
+
+TEST(HyperLogLog, duplicates_dont_count) {
+  HyperLogLog<> hll;
+  for (int round = 0; round < 20; ++round) {
+    for (uint64_t i = 0; i < 5000; ++i) {
+      hll.add(i);
+    }
+  }
+  EXPECT_LT(relativeError(hll.estimate(), 5000), 4 * hll.stdError());
+}
+
+TEST(HyperLogLog, merge) {
+  HyperLogLog<> a;
+  HyperLogLog<> b;
+  for (uint64_t i = 0; i < 60000; ++i) {
+    a.add(i);
+    b.add(i + 30000);
+  }
+  a.merge(b);
+  EXPECT_LT(relativeError(a.estimate(), 90000), 4 * a.stdError());
+  a.clear();
+  EXPECT_EQ(a.estimate(), 0);
+}
+
+TEST(HyperLogLog, concurrent_adds) {
+  HyperLogLog<> hll;
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      // overlapping ranges, 250000 distinct keys in all
+      for (uint64_t i = t * 50000; i < t * 50000 + 100000; ++i) {
+        hll.add(i);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_LT(relativeError(hll.estimate(), 250000), 4 * hll.stdError());
+}
+
+TEST(HyperLogLog, sizing) {
+  auto s = sizeForCardinality(1000, 0.01, 1.5, 2.0, 0.5f);
+  EXPECT_EQ(s.maxSize, 1530);
+  EXPECT_EQ(s.maxLoadFactor, 0.5f);
+  EXPECT_EQ(sizeForCardinality(0, 0.01).maxSize, 1);
+}
+
+TEST(HyperLogLog, cardinality_tracer) {
+  AtomicUnorderedInsertMap<uint64_t, uint64_t, std::hash<uint64_t>,
+                           std::equal_to<uint64_t>, true, std::atomic,
+                           uint32_t, detail::MMapAlloc, CardinalityTracer<>>
+      m(20000);
+  for (uint64_t i = 0; i < 20000; ++i) {
+    m.emplace(i % 15000, i);
+  }
+  // finds don't count, repeated inserts count once
+  for (uint64_t i = 0; i < 30000; ++i) {
+    m.find(i);
+  }
+  auto &hll = m.tracer().cardinality();
+  EXPECT_LT(relativeError(hll.estimate(), 15000), 4 * hll.stdError());
+
+  // the suggested map holds every key seen
+  auto s = hll.sizing(1.0);
+  EXPECT_GE(s.maxSize, 15000);
+  AtomicUnorderedInsertMap<uint64_t, uint64_t> next(s.maxSize,
+                                                    s.maxLoadFactor);
+  for (uint64_t i = 0; i < 15000; ++i) {
+    next.emplace(i, i);
+  }
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#include "AtomicUnorderedMap.h"
+
+namespace folly {
+
+/// KeyDictionary interns keys into stable 32-bit IDs, so that several
+/// short-lived maps over the same large keys (one per time window, say)
+/// can each be keyed by the ID instead.  The key is then stored and
+/// hashed once, in the dictionary, and the per-window maps cost the same
+/// per entry whatever the key size.
+///
+/// The ID of a key is the index of the slot that holds it in an
+/// AtomicUnorderedInsertMap.  Slots never move and are never freed, so
+/// an ID stays valid and keeps naming the same key for the lifetime of
+/// the dictionary.  ID 0 is never issued (slot 0 is the map's nil slot),
+/// so it can be used as "no key".
+///
+/// intern() and lookup() are as concurrent as the underlying map: lookups
+/// are wait-free and interning is lock-free.
+///
+/// Usage:
+///
+///  KeyDictionary<Frame, FrameHash> dict(1000000);
+///  KeyIdMap<uint64_t> window(10000);
+///  window.emplace(dict.intern(frame), count);
+///  ...
+///  for (auto& kv : window) { dict.key(kv.first) ... }
+template <typename Key, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>,
+          template <typename> class Atom = std::atomic,
+          typename Allocator = folly::detail::MMapAlloc>
+class KeyDictionary {
+  // the bool is a placeholder, the map is only used as a set
+  typedef AtomicUnorderedInsertMap<Key, bool, Hash, KeyEqual,
+                                   std::is_trivially_destructible<Key>::value,
+                                   Atom, uint32_t, Allocator>
+      Map;
+
+ public:
+  typedef uint32_t id_type;
+
+  enum : id_type { kInvalidId = 0 };
+
+  explicit KeyDictionary(size_t maxKeys, float maxLoadFactor = 0.8f,
+                         const Hash &hasher = Hash(),
+                         const KeyEqual &keyEqual = KeyEqual())
+      : map_(maxKeys, maxLoadFactor, hasher, keyEqual) {}
+
+  /// The ID of key, which is added if it isn't present yet.  Like the
+  /// map's emplace, throws std::bad_alloc if there is no room left,
+  /// which can't happen before maxKeys keys have been added.
+  id_type intern(const Key &key) {
+    return map_.emplace(key, true).first.get_internal_slot();
+  }
+
+  /// The ID of key, or kInvalidId if it has never been interned
+  id_type lookup(const Key &key) const {
+    auto iter = map_.find(key);
+    return iter == map_.cend() ? id_type(kInvalidId)
+                               : iter.get_internal_slot();
+  }
+
+  /// The key named by id, which must have been returned by intern() or
+  /// lookup() of this dictionary
+  const Key &key(id_type id) const {
+    assert(id != kInvalidId);
+    return typename Map::const_iterator(map_, id)->first;
+  }
+
+  /// Memory used by the dictionary, see AtomicUnorderedInsertMap
+  typename Map::MemoryStats memoryStats() const {
+    return map_.memoryStats();
+  }
+
+ private:
+  Map map_;
+};
+
+/// Hashes an ID to itself.  Interned IDs are slot indexes of a hashed
+/// map, and so are already spread evenly over their range.
+struct IdentityHash {
+  size_t operator()(uint32_t id) const { return id; }
+};
+
+/// A map keyed by KeyDictionary IDs
+template <typename Value, bool SkipKeyValueDeletion =
+                              std::is_trivially_destructible<Value>::value,
+          template <typename> class Atom = std::atomic,
+          typename Allocator = folly::detail::MMapAlloc>
+using KeyIdMap =
+    AtomicUnorderedInsertMap<uint32_t, Value, IdentityHash,
+                             std::equal_to<uint32_t>, SkipKeyValueDeletion,
+                             Atom, uint32_t, Allocator>;
+
+}  // namespace folly
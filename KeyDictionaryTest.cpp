@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "KeyDictionary.h"
+
+#include <gtest/gtest.h>
+
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace folly;
+
+TEST(KeyDictionary, stable_ids) {
+  KeyDictionary<std::string> dict(1000);
+  EXPECT_EQ(dict.lookup("a"), dict.kInvalidId);
+
+  std::set<uint32_t> ids;
+  for (int i = 0; i < 1000; ++i) {
+    auto id = dict.intern(std::to_string(i));
+    EXPECT_NE(id, dict.kInvalidId);
+    ids.insert(id);
+  }
+  EXPECT_EQ(ids.size(), 1000);
+  for (int i = 0; i < 1000; ++i) {
+    auto id = dict.lookup(std::to_string(i));
+    EXPECT_EQ(dict.intern(std::to_string(i)), id);
+    EXPECT_EQ(dict.key(id), std::to_string(i));
+  }
+}
+
+TEST(KeyDictionary, concurrent_intern) {
+  KeyDictionary<std::string> dict(1000);
+  std::vector<std::vector<uint32_t>> seen(4);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 1000; ++i) {
+        seen[t].push_back(dict.intern(std::to_string((i * 7 + t) % 1000)));
+      }
+    });
+  }
+  for (auto &thr : threads) {
+    thr.join();
+  }
+  for (int t = 0; t < 4; ++t) {
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_EQ(seen[t][i], dict.lookup(std::to_string((i * 7 + t) % 1000)));
+    }
+  }
+}
+
+TEST(KeyDictionary, window_maps) {
+  KeyDictionary<std::string> dict(1000);
+  std::vector<std::unique_ptr<KeyIdMap<int>>> windows;
+  for (int w = 0; w < 3; ++w) {
+    windows.emplace_back(new KeyIdMap<int>(100));
+    for (int i = 0; i < 100; ++i) {
+      windows.back()->emplace(dict.intern("key" + std::to_string(i + w * 50)),
+                              w);
+    }
+  }
+  // key50 .. key99 are in windows 0 and 1, under the same ID
+  auto id = dict.lookup("key75");
+  EXPECT_EQ(windows[0]->find(id)->second, 0);
+  EXPECT_EQ(windows[1]->find(id)->second, 1);
+  EXPECT_TRUE(windows[2]->find(id) == windows[2]->cend());
+
+  size_t count = 0;
+  for (auto iter = windows[2]->cbegin(); iter != windows[2]->cend(); ++iter) {
+    auto &key = dict.key(iter->first);
+    EXPECT_GE(std::stoi(key.substr(3)), 100);
+    ++count;
+  }
+  EXPECT_EQ(count, 100);
+}
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "Rcu.h"
+
+namespace folly {
+
+/// Multi-version values for point-in-time reads across many map entries.
+///
+/// Every MvccValue update prepends a new version to that value's chain
+/// and stamps it from a process-wide clock.  An MvccSnapshot records the
+/// clock when it is taken, and readAt(snapshot) returns the newest
+/// version stamped at or before it, so a report that reads hundreds of
+/// values through one snapshot sees each of them as of the same instant
+/// even while writers keep going.  Versions that no live snapshot can
+/// read any more are cut off by later updates and freed through
+/// RcuDomain.
+///
+/// A version is linked before it is stamped, so there is a window in
+/// which it is visible but pending.  Anybody who finds a pending version
+/// (a reader or the next writer) stamps it from the clock on the
+/// writer's behalf; the first stamp wins.  A stamp taken that way is
+/// later than any snapshot that already exists, so those snapshots keep
+/// ignoring the version, and chain order always matches stamp order.
+
+/// The global clock and the registry of live snapshots.  Snapshots take
+/// one of kMaxSnapshots registry slots, which bounds how many may be
+/// live at once.
+class MvccDomain {
+ public:
+  enum : size_t { kMaxSnapshots = 64 };
+
+  static MvccDomain &instance() {
+    static MvccDomain *domain = new MvccDomain();
+    return *domain;
+  }
+
+  MvccDomain(const MvccDomain &) = delete;
+  MvccDomain &operator=(const MvccDomain &) = delete;
+
+  /// The latest stamp handed out
+  uint64_t now() const { return clock_.load(std::memory_order_seq_cst); }
+
+  /// A new stamp, later than every snapshot taken so far
+  uint64_t tick() { return clock_.fetch_add(1, std::memory_order_seq_cst) + 1; }
+
+  /// Registers a snapshot and returns its slot, storing its epoch in
+  /// epoch.  Throws std::runtime_error if kMaxSnapshots are live.
+  size_t acquire(uint64_t &epoch) {
+    active_.fetch_add(1, std::memory_order_seq_cst);
+    auto e = now();
+    for (size_t i = 0; i < kMaxSnapshots; ++i) {
+      uint64_t expected = 0;
+      if (slots_[i].compare_exchange_strong(expected, e,
+                                            std::memory_order_seq_cst)) {
+        // A trimmer that scanned before our slot store read the clock
+        // before our second load, so reading at this epoch is safe; the
+        // slot holds the older e, which only makes trimming keep more.
+        epoch = now();
+        return i;
+      }
+    }
+    active_.fetch_sub(1, std::memory_order_seq_cst);
+    throw std::runtime_error("MvccDomain: too many live snapshots");
+  }
+
+  void release(size_t slot) {
+    slots_[slot].store(0, std::memory_order_seq_cst);
+    active_.fetch_sub(1, std::memory_order_seq_cst);
+  }
+
+  /// No live or future snapshot reads at an epoch older than this, so a
+  /// chain only needs its newest version stamped at or before it and
+  /// the ones above
+  uint64_t horizon() const {
+    auto h = now();
+    if (active_.load(std::memory_order_seq_cst) == 0) {
+      return h;
+    }
+    for (auto &slot : slots_) {
+      auto e = slot.load(std::memory_order_seq_cst);
+      if (e != 0 && e < h) {
+        h = e;
+      }
+    }
+    return h;
+  }
+
+ private:
+  MvccDomain() {
+    for (auto &slot : slots_) {
+      slot.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // starts at 1 so that a stamp or slot of 0 can mean none
+  std::atomic<uint64_t> clock_{1};
+  std::atomic<size_t> active_{0};
+  std::atomic<uint64_t> slots_[kMaxSnapshots];
+};
+
+/// A point in time to read MvccValues at.  Values read through a
+/// snapshot stay valid until it is destroyed.
+class MvccSnapshot {
+ public:
+  MvccSnapshot() : slot_(MvccDomain::instance().acquire(epoch_)) {}
+  ~MvccSnapshot() { MvccDomain::instance().release(slot_); }
+
+  MvccSnapshot(const MvccSnapshot &) = delete;
+  MvccSnapshot &operator=(const MvccSnapshot &) = delete;
+
+  uint64_t epoch() const { return epoch_; }
+
+ private:
+  uint64_t epoch_;
+  size_t slot_;
+};
+
+/// MvccValue is a value wrapper for AtomicUnorderedInsertMap<K,
+/// MvccValue<V>> that keeps the versions live snapshots may still read.
+/// Readers never block: read() follows the head of the chain and
+/// readAt() walks down to the version for its snapshot.  Writers publish
+/// with a CAS on the head and pay one allocation per update.  Every
+/// kTrimBatch superseded versions, a writer cuts off the ones older than
+/// MvccDomain::horizon() and retires them to RcuDomain.
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<int, MvccValue<Counter>> m(n);
+///  m.emplace(id, Counter{});
+///  m.find(id)->second.update([](Counter& c) { c.hits++; });
+///  ...
+///  MvccSnapshot snap;
+///  for (auto id : ids) { total += m.find(id)->second.readAt(snap)->hits; }
+template <typename T>
+class MvccValue {
+  struct Version {
+    T value;
+    std::atomic<uint64_t> stamp;  // 0 while pending
+    std::atomic<Version *> next;
+
+    Version(const T &v, uint64_t s, Version *n)
+        : value(v), stamp(s), next(n) {}
+    Version(T &&v, uint64_t s, Version *n)
+        : value(std::move(v)), stamp(s), next(n) {}
+  };
+
+ public:
+  enum : size_t { kTrimBatch = 8 };
+
+  explicit MvccValue(const T &init)
+      : head_(new Version(init, MvccDomain::instance().tick(), nullptr)) {}
+  explicit MvccValue(T &&init)
+      : head_(new Version(std::move(init), MvccDomain::instance().tick(),
+                          nullptr)) {}
+
+  MvccValue(const MvccValue &) = delete;
+  MvccValue &operator=(const MvccValue &) = delete;
+
+  /// The map only destroys values once nobody can access them, so the
+  /// whole chain is freed immediately
+  ~MvccValue() { deleteChain(head_.load(std::memory_order_relaxed)); }
+
+  /// A copy of the latest version
+  T read() const {
+    RcuReadGuard g;
+    return head_.load(std::memory_order_acquire)->value;
+  }
+
+  /// The version visible at snapshot, or nullptr if this value was
+  /// created after it.  The pointer stays valid while snapshot lives.
+  const T *readAt(const MvccSnapshot &snapshot) const {
+    RcuReadGuard g;
+    for (auto v = head_.load(std::memory_order_acquire); v != nullptr;
+         v = v->next.load(std::memory_order_acquire)) {
+      if (stampOf(v) <= snapshot.epoch()) {
+        return &v->value;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Publishes func(T&) applied to a copy of the latest version.  If
+  /// another writer gets there first, func is applied to a fresh copy of
+  /// that version instead, so it may run more than once.
+  template <typename Func>
+  void update(Func &&func) const {
+    RcuReadGuard g;
+    auto head = head_.load(std::memory_order_acquire);
+    stampOf(head);
+    std::unique_ptr<Version> next(new Version(head->value, 0, head));
+    func(next->value);
+    while (!head_.compare_exchange_strong(head, next.get(),
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+      stampOf(head);
+      next->value = head->value;
+      next->next.store(head, std::memory_order_relaxed);
+      func(next->value);
+    }
+    auto v = next.release();
+    stampOf(v);
+    trim(v);
+  }
+
+  /// Publishes value as the latest version
+  void store(T value) const {
+    update([&](T &v) { v = value; });
+  }
+
+  /// The number of versions currently linked, for tests and monitoring
+  size_t versions() const {
+    RcuReadGuard g;
+    size_t rv = 0;
+    for (auto v = head_.load(std::memory_order_acquire); v != nullptr;
+         v = v->next.load(std::memory_order_acquire)) {
+      ++rv;
+    }
+    return rv;
+  }
+
+ private:
+  /// v's stamp, stamping it on the writer's behalf if it is pending
+  static uint64_t stampOf(Version *v) {
+    auto s = v->stamp.load(std::memory_order_acquire);
+    if (s == 0) {
+      auto fresh = MvccDomain::instance().tick();
+      if (v->stamp.compare_exchange_strong(s, fresh,
+                                           std::memory_order_acq_rel)) {
+        s = fresh;
+      }
+    }
+    return s;
+  }
+
+  /// Cuts off the versions below the newest one that every snapshot can
+  /// see, once there are at least kTrimBatch of them.  Must be called in
+  /// a read section, since another writer may be cutting the same chain.
+  static void trim(Version *head) {
+    auto horizon = MvccDomain::instance().horizon();
+    auto keep = head;
+    while (keep != nullptr && stampOf(keep) > horizon) {
+      keep = keep->next.load(std::memory_order_acquire);
+    }
+    if (keep == nullptr) {
+      return;
+    }
+    size_t below = 0;
+    for (auto v = keep->next.load(std::memory_order_acquire);
+         v != nullptr && below < kTrimBatch;
+         v = v->next.load(std::memory_order_acquire)) {
+      ++below;
+    }
+    if (below < kTrimBatch) {
+      return;
+    }
+    // the exchange hands the tail to exactly one trimmer
+    auto tail = keep->next.exchange(nullptr, std::memory_order_acq_rel);
+    if (tail != nullptr) {
+      RcuDomain::instance().retire(tail, &deleteChain);
+    }
+  }
+
+  static void deleteChain(void *p) {
+    auto v = static_cast<Version *>(p);
+    while (v != nullptr) {
+      auto next = v->next.load(std::memory_order_relaxed);
+      delete v;
+      v = next;
+    }
+  }
+
+  mutable std::atomic<Version *> head_;
+};
+
+}  // namespace folly
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Mvcc.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+
+using namespace folly;
+
+TEST(Mvcc, read_at_snapshot) {
+  MvccValue<std::string> v("a");
+  MvccSnapshot first;
+  v.store("b");
+  v.update([](std::string &s) { s += "c"; });
+  MvccSnapshot second;
+  v.store("d");
+
+  EXPECT_EQ(v.read(), "d");
+  EXPECT_EQ(*v.readAt(first), "a");
+  EXPECT_EQ(*v.readAt(second), "bc");
+  EXPECT_GT(second.epoch(), first.epoch());
+
+  // values created after a snapshot are invisible to it
+  MvccValue<std::string> later("x");
+  EXPECT_TRUE(later.readAt(second) == nullptr);
+}
+
+TEST(Mvcc, old_versions_are_trimmed) {
+  MvccValue<int> v(0);
+  for (int i = 1; i <= 1000; ++i) {
+    v.store(i);
+  }
+  EXPECT_LE(v.versions(), MvccValue<int>::kTrimBatch + 1);
+
+  std::unique_ptr<MvccSnapshot> snap(new MvccSnapshot());
+  for (int i = 1001; i <= 2000; ++i) {
+    v.store(i);
+  }
+  // everything since the snapshot is kept for it
+  EXPECT_GE(v.versions(), 1000);
+  EXPECT_EQ(*v.readAt(*snap), 1000);
+  EXPECT_EQ(v.read(), 2000);
+
+  snap.reset();
+  for (size_t i = 0; i < MvccValue<int>::kTrimBatch; ++i) {
+    v.store(int(i));
+  }
+  EXPECT_LE(v.versions(), MvccValue<int>::kTrimBatch + 1);
+  RcuDomain::instance().synchronize();
+}
+
+TEST(Mvcc, snapshot_limit) {
+  std::vector<std::unique_ptr<MvccSnapshot>> snaps;
+  for (size_t i = 0; i < MvccDomain::kMaxSnapshots; ++i) {
+    snaps.emplace_back(new MvccSnapshot());
+  }
+  EXPECT_THROW(MvccSnapshot(), std::runtime_error);
+  snaps.pop_back();
+  MvccSnapshot one_more;
+}
+
+// Writers bump every key of their range in order, a round at a time.
+// Read through one snapshot, each range must look like a prefix already
+// at round r + 1 followed by keys still at round r; reading each key at
+// its latest version can show anything.
+TEST(Mvcc, snapshots_are_consistent_across_keys) {
+  const int kWriters = 2;
+  const int kKeysPerWriter = 100;
+  AtomicUnorderedInsertMap<int, MvccValue<int64_t>> m(kWriters *
+                                                       kKeysPerWriter);
+  for (int k = 0; k < kWriters * kKeysPerWriter; ++k) {
+    m.emplace(k, int64_t(0));
+  }
+
+  std::atomic<bool> done{false};
+  std::vector<std::thread> writers;
+  for (int w = 0; w < kWriters; ++w) {
+    writers.emplace_back([&, w] {
+      for (int round = 0; round < 200; ++round) {
+        for (int k = w * kKeysPerWriter; k < (w + 1) * kKeysPerWriter; ++k) {
+          m.find(k)->second.update([](int64_t &v) { ++v; });
+        }
+      }
+    });
+  }
+  std::thread reader([&] {
+    while (!done.load()) {
+      MvccSnapshot snap;
+      for (int w = 0; w < kWriters; ++w) {
+        auto first = *m.find(w * kKeysPerWriter)->second.readAt(snap);
+        bool dropped = false;
+        for (int k = w * kKeysPerWriter; k < (w + 1) * kKeysPerWriter; ++k) {
+          auto v = *m.find(k)->second.readAt(snap);
+          if (v != first) {
+            ASSERT_EQ(v, first - 1) << "key " << k;
+            dropped = true;
+          } else {
+            ASSERT_FALSE(dropped) << "key " << k;
+          }
+        }
+      }
+      std::this_thread::yield();
+    }
+  });
+  for (auto &t : writers) {
+    t.join();
+  }
+  done = true;
+  reader.join();
+
+  // with the reader gone, the next update trims what it kept alive
+  for (int k = 0; k < kWriters * kKeysPerWriter; ++k) {
+    EXPECT_EQ(m.find(k)->second.read(), 200);
+    m.find(k)->second.update([](int64_t &v) { ++v; });
+    EXPECT_LE(m.find(k)->second.versions(),
+              MvccValue<int64_t>::kTrimBatch + 1);
+  }
+  RcuDomain::instance().synchronize();
+}
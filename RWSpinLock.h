@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+
+#include "AtomicUnorderedMapUtils.h"
+
+namespace folly {
+
+/// A 4 byte reader-writer spinlock, small enough to embed in every value
+/// of an AtomicUnorderedInsertMap, where a std::shared_timed_mutex would
+/// cost 56 bytes per entry.
+///
+/// The word holds a writer bit, a pending-writer bit and the reader
+/// count in the remaining 30 bits.  Readers acquire with one fetch_add
+/// and back out if a writer holds or is waiting for the lock, so writers
+/// can't be starved by a stream of readers.  Waiters spin, then yield;
+/// this is meant for short critical sections, not for blocking.
+///
+/// Satisfies Lockable and SharedLockable, so std::lock_guard and
+/// std::shared_lock work with it.
+class RWSpinLock {
+ public:
+  RWSpinLock() = default;
+  RWSpinLock(const RWSpinLock &) = delete;
+  RWSpinLock &operator=(const RWSpinLock &) = delete;
+
+  void lock() {
+    detail::SpinBackoff backoff;
+    while (!try_lock()) {
+      if ((bits_.load(std::memory_order_relaxed) & PENDING) == 0) {
+        bits_.fetch_or(PENDING, std::memory_order_relaxed);
+      }
+      backoff.wait();
+    }
+  }
+
+  /// Succeeds iff there are no readers and no writer.  Clears the
+  /// pending bit, which any other waiting writer sets again.
+  bool try_lock() {
+    auto v = bits_.load(std::memory_order_relaxed);
+    return (v & ~PENDING) == 0 &&
+           bits_.compare_exchange_strong(v, WRITER, std::memory_order_acquire,
+                                         std::memory_order_relaxed);
+  }
+
+  void unlock() { bits_.fetch_and(~WRITER, std::memory_order_release); }
+
+  void lock_shared() {
+    detail::SpinBackoff backoff;
+    while (!try_lock_shared()) {
+      backoff.wait();
+    }
+  }
+
+  bool try_lock_shared() {
+    if ((bits_.fetch_add(READER, std::memory_order_acquire) &
+         (WRITER | PENDING)) == 0) {
+      return true;
+    }
+    bits_.fetch_sub(READER, std::memory_order_release);
+    return false;
+  }
+
+  void unlock_shared() { bits_.fetch_sub(READER, std::memory_order_release); }
+
+  /// The raw lock word, for tests and debugging
+  uint32_t bits() const { return bits_.load(std::memory_order_relaxed); }
+
+ private:
+  enum : uint32_t { WRITER = 1, PENDING = 2, READER = 4 };
+
+  std::atomic<uint32_t> bits_{0};
+};
+
+static_assert(sizeof(RWSpinLock) == 4, "RWSpinLock should stay 4 bytes");
+
+/// LockedValue is a value wrapper for AtomicUnorderedInsertMap<K,
+/// LockedValue<V>> that guards each value with its own RWSpinLock.  It
+/// suits values that are too large for a seqlock or not trivially
+/// copyable, and adds only 4 bytes (plus alignment) per entry.
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<int, LockedValue<std::string>> m(100);
+///  m.emplace(1, std::string("abc"));
+///  auto len = m.find(1)->second.read(
+///      [](const std::string& s) { return s.size(); });
+///  m.find(1)->second.write([](std::string& s) { s += "def"; });
+template <typename T>
+struct LockedValue {
+  explicit LockedValue(const T &init) : data_(init) {}
+  explicit LockedValue(T &&init) : data_(std::move(init)) {}
+
+  /// Calls func(const T&) while holding the lock shared
+  template <typename Func>
+  auto read(Func &&func) const -> decltype(func(std::declval<const T &>())) {
+    std::shared_lock<RWSpinLock> g(lock_);
+    return func(static_cast<const T &>(data_));
+  }
+
+  /// Calls func(T&) while holding the lock exclusively
+  template <typename Func>
+  auto write(Func &&func) const -> decltype(func(std::declval<T &>())) {
+    std::lock_guard<RWSpinLock> g(lock_);
+    return func(data_);
+  }
+
+  /// A copy of the value
+  T snapshot() const {
+    return read([](const T &v) { return v; });
+  }
+
+ private:
+  mutable RWSpinLock lock_;
+  mutable T data_;
+};
+
+}  // namespace folly
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "RWSpinLock.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+
+using namespace folly;
+
+TEST(RWSpinLock, exclusion) {
+  RWSpinLock lock;
+  lock.lock_shared();
+  EXPECT_TRUE(lock.try_lock_shared());
+  EXPECT_FALSE(lock.try_lock());
+  lock.unlock_shared();
+  lock.unlock_shared();
+  EXPECT_EQ(lock.bits(), 0);
+
+  lock.lock();
+  EXPECT_FALSE(lock.try_lock_shared());
+  EXPECT_FALSE(lock.try_lock());
+  lock.unlock();
+  EXPECT_EQ(lock.bits(), 0);
+}
+
+TEST(RWSpinLock, waiting_writer_blocks_new_readers) {
+  RWSpinLock lock;
+  lock.lock_shared();
+  std::atomic<bool> locked{false};
+  std::thread writer([&] {
+    lock.lock();
+    locked = true;
+    lock.unlock();
+  });
+  while ((lock.bits() & 2) == 0) {
+    std::this_thread::yield();
+  }
+  EXPECT_FALSE(lock.try_lock_shared());
+  EXPECT_FALSE(locked.load());
+  lock.unlock_shared();
+  writer.join();
+  EXPECT_TRUE(locked.load());
+}
+
+TEST(RWSpinLock, locked_value_in_map) {
+  typedef LockedValue<std::pair<std::string, std::string>> Value;
+  EXPECT_LE(sizeof(Value), sizeof(std::pair<std::string, std::string>) + 8);
+
+  AtomicUnorderedInsertMap<int, Value> m(100);
+  for (int k = 0; k < 4; ++k) {
+    m.emplace(k, std::make_pair(std::string(), std::string()));
+  }
+  std::atomic<bool> done{false};
+  std::atomic<int> torn{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; ++t) {
+    readers.emplace_back([&, t] {
+      for (int i = 0; !done.load(); ++i) {
+        m.find((i + t) % 4)->second.read(
+            [&](const std::pair<std::string, std::string> &p) {
+              torn += p.first == p.second ? 0 : 1;
+              return 0;
+            });
+      }
+    });
+  }
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 2; ++t) {
+    writers.emplace_back([&] {
+      for (int i = 0; i < 1000; ++i) {
+        m.find(i % 4)->second.write(
+            [](std::pair<std::string, std::string> &p) {
+              p.first += 'x';
+              p.second += 'x';
+            });
+      }
+    });
+  }
+  for (auto &thr : writers) {
+    thr.join();
+  }
+  done = true;
+  for (auto &thr : readers) {
+    thr.join();
+  }
+  EXPECT_EQ(torn.load(), 0);
+  size_t total = 0;
+  for (int k = 0; k < 4; ++k) {
+    total += m.find(k)->second.snapshot().first.size();
+  }
+  EXPECT_EQ(total, 2000);
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace folly {
+
+/// Epoch-based deferred reclamation, in the spirit of folly/synchronization
+/// /Rcu.h but small enough to live next to AtomicUnorderedInsertMap.
+///
+/// Readers bracket their accesses with an RcuReadGuard, which publishes
+/// the current epoch in a per-thread record (one store to a cache line
+/// owned by that thread) and clears it on exit.  Writers unlink an object
+/// and then retire() it.  Retiring advances the global epoch, and an
+/// object retired at epoch e is destroyed once every reader that is
+/// inside a read section announced an epoch later than e.  Such readers
+/// started after the unlink, so they can't hold a reference to it.
+///
+/// Readers never wait and never take a lock.  Retired objects are freed
+/// in batches by whichever writer pushes the retire list over
+/// kReclaimBatch, or by an explicit tryReclaim() or synchronize().
+class RcuDomain {
+ public:
+  enum : size_t { kReclaimBatch = 64 };
+
+  /// The process-wide domain.  It is never destroyed, so read sections
+  /// and retire() are safe during static destruction.
+  static RcuDomain &instance() {
+    static RcuDomain *domain = new RcuDomain();
+    return *domain;
+  }
+
+  RcuDomain(const RcuDomain &) = delete;
+  RcuDomain &operator=(const RcuDomain &) = delete;
+
+  /// Starts a read section on the calling thread.  Sections nest.
+  void lock() {
+    auto &rec = threadRecord();
+    if (rec.nesting++ == 0) {
+      rec.epoch.store(epoch_.load(std::memory_order_seq_cst),
+                      std::memory_order_seq_cst);
+      // Pairs with the fence in tryReclaim.  Without it the reader's
+      // later (acquire) load of a shared pointer may be ordered before
+      // this store, while the reclaimer's scan misses the store and
+      // frees the version the reader loaded (store buffering).
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  void unlock() {
+    auto &rec = threadRecord();
+    assert(rec.nesting > 0);
+    if (--rec.nesting == 0) {
+      rec.epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  /// True iff the calling thread is inside a read section
+  bool inReadSection() { return threadRecord().nesting > 0; }
+
+  /// Hands p to the domain, which destroys it with delete once no reader
+  /// can still see it.  p must already be unreachable for new readers.
+  template <typename T>
+  void retire(T *p) {
+    retire(p, [](void *obj) { delete static_cast<T *>(obj); });
+  }
+
+  void retire(void *p, void (*deleter)(void *)) {
+    auto e = epoch_.fetch_add(1, std::memory_order_seq_cst);
+    size_t pending;
+    {
+      std::lock_guard<std::mutex> g(lock_);
+      retired_.push_back(Retired{p, deleter, e});
+      pending = retired_.size();
+    }
+    if (pending >= kReclaimBatch) {
+      tryReclaim();
+    }
+  }
+
+  /// Destroys the retired objects that no reader can see any more, and
+  /// returns how many there were.  Never blocks on readers.
+  size_t tryReclaim() {
+    std::vector<Retired> ready;
+    {
+      std::lock_guard<std::mutex> g(lock_);
+      // Pairs with the fence in lock(): either a reader sees the
+      // unlink that preceded retire(), or this scan sees its epoch.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto minActive = minActiveEpoch();
+      auto keep = retired_.begin();
+      for (auto &r : retired_) {
+        if (r.epoch < minActive) {
+          ready.push_back(r);
+        } else {
+          *keep++ = r;
+        }
+      }
+      retired_.erase(keep, retired_.end());
+    }
+    // deleters run outside the lock, so they may retire() themselves
+    for (auto &r : ready) {
+      r.deleter(r.ptr);
+    }
+    return ready.size();
+  }
+
+  /// Waits until everything retired before the call has been destroyed.
+  /// Must not be called from inside a read section, which would wait
+  /// for itself.
+  void synchronize() {
+    assert(!inReadSection());
+    auto target = epoch_.load(std::memory_order_seq_cst);
+    while (true) {
+      tryReclaim();
+      {
+        std::lock_guard<std::mutex> g(lock_);
+        bool done = true;
+        for (auto &r : retired_) {
+          done = done && r.epoch >= target;
+        }
+        if (done) {
+          return;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  /// The number of objects retired but not yet destroyed
+  size_t pending() {
+    std::lock_guard<std::mutex> g(lock_);
+    return retired_.size();
+  }
+
+ private:
+  struct Retired {
+    void *ptr;
+    void (*deleter)(void *);
+    uint64_t epoch;
+  };
+
+  // epoch is 0 while the owning thread is outside any read section.
+  // Records are reused after their thread exits, never freed.  The
+  // alignment keeps each thread's epoch on its own cache line; C++14 new
+  // ignores it, so acquireRecord allocates with posix_memalign.
+  struct alignas(64) ThreadRecord {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> inUse{true};
+    uint32_t nesting = 0;
+    ThreadRecord *next = nullptr;
+  };
+
+  struct RecordHolder {
+    ThreadRecord *rec;
+    ~RecordHolder() { rec->inUse.store(false, std::memory_order_release); }
+  };
+
+  RcuDomain() = default;
+
+  ThreadRecord &threadRecord() {
+    static thread_local RecordHolder holder{acquireRecord()};
+    return *holder.rec;
+  }
+
+  ThreadRecord *acquireRecord() {
+    for (auto rec = records_.load(std::memory_order_acquire); rec != nullptr;
+         rec = rec->next) {
+      bool expected = false;
+      if (!rec->inUse.load(std::memory_order_relaxed) &&
+          rec->inUse.compare_exchange_strong(expected, true)) {
+        return rec;
+      }
+    }
+    void *raw;
+    if (posix_memalign(&raw, alignof(ThreadRecord), sizeof(ThreadRecord)) !=
+        0) {
+      throw std::bad_alloc();
+    }
+    auto rec = new (raw) ThreadRecord();
+    rec->next = records_.load(std::memory_order_relaxed);
+    while (!records_.compare_exchange_weak(rec->next, rec)) {
+    }
+    return rec;
+  }
+
+  uint64_t minActiveEpoch() const {
+    auto rv = std::numeric_limits<uint64_t>::max();
+    for (auto rec = records_.load(std::memory_order_acquire); rec != nullptr;
+         rec = rec->next) {
+      auto e = rec->epoch.load(std::memory_order_seq_cst);
+      if (e != 0 && e < rv) {
+        rv = e;
+      }
+    }
+    return rv;
+  }
+
+  // starts at 1 so that a record's 0 can mean quiescent
+  std::atomic<uint64_t> epoch_{1};
+  std::atomic<ThreadRecord *> records_{nullptr};
+  std::mutex lock_;
+  std::vector<Retired> retired_;
+};
+
+/// RAII read section of RcuDomain::instance()
+class RcuReadGuard {
+ public:
+  RcuReadGuard() { RcuDomain::instance().lock(); }
+  ~RcuReadGuard() { RcuDomain::instance().unlock(); }
+
+  RcuReadGuard(const RcuReadGuard &) = delete;
+  RcuReadGuard &operator=(const RcuReadGuard &) = delete;
+};
+
+/// RcuValue is a value wrapper for AtomicUnorderedInsertMap<K,
+/// RcuValue<V>> whose contents can be replaced wholesale.  It holds a
+/// pointer to an immutable V.  Readers see a consistent version with a
+/// single acquire load, and writers publish a modified copy with CAS,
+/// retiring the previous version to RcuDomain.  This suits large values
+/// that are read far more often than they change, such as config blobs,
+/// where MutableAtom can't hold the type and MutableData can't make the
+/// update safe.
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<std::string, RcuValue<Config>> m(100);
+///  m.emplace("svc", Config{...});
+///  auto port = m.find("svc")->second.read(
+///      [](const Config& c) { return c.port; });
+///  m.find("svc")->second.update([](Config& c) { c.port = 8080; });
+template <typename T>
+class RcuValue {
+ public:
+  explicit RcuValue(const T &init) : ptr_(new T(init)) {}
+  explicit RcuValue(T &&init) : ptr_(new T(std::move(init))) {}
+
+  RcuValue(const RcuValue &) = delete;
+  RcuValue &operator=(const RcuValue &) = delete;
+
+  /// The map only destroys values once nobody can access them, so the
+  /// current version is freed immediately
+  ~RcuValue() { delete ptr_.load(std::memory_order_relaxed); }
+
+  /// Calls func(const T&) on the current version and returns its result.
+  /// The version stays alive until func returns, even if it is replaced
+  /// concurrently.  Wait-free unless func isn't.
+  template <typename Func>
+  auto read(Func &&func) const -> decltype(func(std::declval<const T &>())) {
+    RcuReadGuard g;
+    return func(*ptr_.load(std::memory_order_acquire));
+  }
+
+  /// A copy of the current version
+  T snapshot() const {
+    return read([](const T &v) { return v; });
+  }
+
+  /// Copies the current version, applies func(T&) to the copy and
+  /// publishes it.  If another writer got there first func is applied to
+  /// a copy of that version instead, so it may run more than once.
+  template <typename Func>
+  void update(Func &&func) const {
+    T *prev;
+    {
+      RcuReadGuard g;
+      prev = ptr_.load(std::memory_order_acquire);
+      while (true) {
+        std::unique_ptr<T> next(new T(*prev));
+        func(*next);
+        if (ptr_.compare_exchange_strong(prev, next.get(),
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+          next.release();
+          break;
+        }
+      }
+    }
+    RcuDomain::instance().retire(prev);
+  }
+
+  /// Replaces the current version with value
+  void store(T value) const {
+    auto prev = ptr_.exchange(new T(std::move(value)),
+                              std::memory_order_acq_rel);
+    RcuDomain::instance().retire(prev);
+  }
+
+ private:
+  mutable std::atomic<T *> ptr_;
+};
+
+}  // namespace folly
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "Rcu.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+
+using namespace folly;
+
+namespace {
+
+// every element is the same, so a torn read would show up as a mismatch
+struct Blob {
+  static std::atomic<int> live;
+
+  std::vector<int> data;
+
+  explicit Blob(int v) : data(64, v) { ++live; }
+  Blob(const Blob &other) : data(other.data) { ++live; }
+  ~Blob() { --live; }
+
+  bool consistent() const {
+    for (auto x : data) {
+      if (x != data[0]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+std::atomic<int> Blob::live{0};
+
+}  // namespace
+
+TEST(Rcu, read_update_store) {
+  RcuValue<std::string> v("abc");
+  EXPECT_EQ(v.snapshot(), "abc");
+  v.update([](std::string &s) { s += "def"; });
+  EXPECT_EQ(v.read([](const std::string &s) { return s.size(); }), 6);
+  v.store("xyz");
+  EXPECT_EQ(v.snapshot(), "xyz");
+  RcuDomain::instance().synchronize();
+  EXPECT_EQ(RcuDomain::instance().pending(), 0);
+}
+
+TEST(Rcu, reader_delays_reclamation) {
+  RcuDomain::instance().synchronize();
+  int base = Blob::live.load();
+  {
+    RcuValue<Blob> v(Blob(1));
+    std::atomic<int> stage{0};
+    std::thread reader([&] {
+      v.read([&](const Blob &b) {
+        stage = 1;
+        while (stage.load() != 2) {
+          std::this_thread::yield();
+        }
+        EXPECT_EQ(b.data[0], 1);
+        return 0;
+      });
+    });
+    while (stage.load() != 1) {
+      std::this_thread::yield();
+    }
+    v.update([](Blob &b) { b.data.assign(64, 2); });
+    RcuDomain::instance().tryReclaim();
+    // the reader still holds version 1
+    EXPECT_EQ(Blob::live.load(), base + 2);
+    stage = 2;
+    reader.join();
+    RcuDomain::instance().synchronize();
+    EXPECT_EQ(Blob::live.load(), base + 1);
+    EXPECT_EQ(v.snapshot().data[0], 2);
+  }
+  EXPECT_EQ(Blob::live.load(), base);
+}
+
+TEST(Rcu, concurrent_map_values) {
+  RcuDomain::instance().synchronize();
+  int base = Blob::live.load();
+  {
+    AtomicUnorderedInsertMap<int, RcuValue<Blob>> m(100);
+    for (int k = 0; k < 10; ++k) {
+      m.emplace(k, Blob(0));
+    }
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&, t] {
+        for (int i = 0; !done.load(); ++i) {
+          m.find((i + t) % 10)->second.read([&](const Blob &b) {
+            torn += b.consistent() ? 0 : 1;
+            return 0;
+          });
+        }
+      });
+    }
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 2; ++t) {
+      writers.emplace_back([&] {
+        for (int i = 0; i < 2000; ++i) {
+          m.find(i % 10)->second.update([](Blob &b) {
+            for (auto &x : b.data) {
+              ++x;
+            }
+          });
+        }
+      });
+    }
+    for (auto &thr : writers) {
+      thr.join();
+    }
+    done = true;
+    for (auto &thr : threads) {
+      thr.join();
+    }
+    EXPECT_EQ(torn.load(), 0);
+
+    // no update was lost
+    int total = 0;
+    for (int k = 0; k < 10; ++k) {
+      total += m.find(k)->second.snapshot().data[0];
+    }
+    EXPECT_EQ(total, 4000);
+
+    RcuDomain::instance().synchronize();
+    EXPECT_EQ(Blob::live.load(), base + 10);
+  }
+  EXPECT_EQ(Blob::live.load(), base);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <type_traits>
+
+namespace folly {
+
+/// Thomas Wang's 64 bit mix function, as in folly/hash/Hash.h.  It is a
+/// bijection, so it never introduces collisions.
+inline uint64_t twang_mix64(uint64_t key) {
+  key = (~key) + (key << 21);
+  key = key ^ (key >> 24);
+  key = key + (key << 3) + (key << 8);
+  key = key ^ (key >> 14);
+  key = key + (key << 2) + (key << 4);
+  key = key ^ (key >> 28);
+  key = key + (key << 31);
+  return key;
+}
+
+namespace detail {
+
+inline uint64_t rotl64(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+
+inline void sipRound(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3) {
+  v0 += v1;
+  v1 = rotl64(v1, 13);
+  v1 ^= v0;
+  v0 = rotl64(v0, 32);
+  v2 += v3;
+  v3 = rotl64(v3, 16);
+  v3 ^= v2;
+  v0 += v3;
+  v3 = rotl64(v3, 21);
+  v3 ^= v0;
+  v2 += v1;
+  v1 = rotl64(v1, 17);
+  v1 ^= v2;
+  v2 = rotl64(v2, 32);
+}
+
+}  // namespace detail
+
+/// SipHash-1-3 of len bytes under the 128 bit key (k0, k1).  This is the
+/// keyed hash that Rust and Python use for their hash tables: without
+/// the key an attacker can't construct inputs that collide.
+inline uint64_t sipHash13(const void *data, size_t len, uint64_t k0,
+                          uint64_t k1) {
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  auto p = static_cast<const unsigned char *>(data);
+  auto end = p + (len & ~size_t{7});
+  for (; p != end; p += 8) {
+    uint64_t m;
+    memcpy(&m, p, 8);
+    v3 ^= m;
+    detail::sipRound(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  uint64_t b = uint64_t(len) << 56;
+  for (size_t i = 0; i < (len & 7); ++i) {
+    b |= uint64_t(p[i]) << (8 * i);
+  }
+  v3 ^= b;
+  detail::sipRound(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  detail::sipRound(v0, v1, v2, v3);
+  detail::sipRound(v0, v1, v2, v3);
+  detail::sipRound(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/// SeededHash is a stateful hasher for AtomicUnorderedInsertMap keys
+/// that come from untrusted input.  A default-constructed SeededHash
+/// draws a fresh random seed, and the map default-constructs its hasher,
+/// so every map instance hashes differently and keys crafted to collide
+/// in one map (or in std::hash) spread out in all others.
+///
+///  - strings are hashed with SipHash-1-3 keyed by the seed
+///  - integers are xor-ed with the seed and mixed with twang_mix64
+///  - anything else mixes Hash's result with the seed, which spreads
+///    keys across slots but can't separate keys that collide in Hash
+///    itself, so give such keys a collision resistant Hash
+///
+/// Usage:
+///
+///  AtomicUnorderedInsertMap<std::string, V, SeededHash<std::string>> m(n);
+template <typename Key, typename Hash = std::hash<Key>>
+class SeededHash : private Hash {
+ public:
+  SeededHash() : SeededHash(randomSeed()) {}
+  explicit SeededHash(uint64_t seed, const Hash &hash = Hash())
+      : Hash(hash),
+        seed0_(twang_mix64(seed)),
+        seed1_(twang_mix64(seed ^ 0x9e3779b97f4a7c15ULL)) {}
+
+  size_t operator()(const Key &key) const {
+    return hashImpl(key, Tag<Key>());
+  }
+
+  uint64_t seed() const { return seed0_; }
+
+  /// A per-thread random stream, seeded once from std::random_device
+  static uint64_t randomSeed() {
+    static thread_local std::mt19937_64 generator{std::random_device{}()};
+    return generator();
+  }
+
+ private:
+  struct StringTag {};
+  struct IntegralTag {};
+  struct OtherTag {};
+
+  template <typename K>
+  using Tag = typename std::conditional<
+      std::is_same<K, std::string>::value, StringTag,
+      typename std::conditional<std::is_integral<K>::value, IntegralTag,
+                                OtherTag>::type>::type;
+
+  size_t hashImpl(const Key &key, StringTag) const {
+    return sipHash13(key.data(), key.size(), seed0_, seed1_);
+  }
+
+  size_t hashImpl(const Key &key, IntegralTag) const {
+    return twang_mix64(uint64_t(key) ^ seed0_);
+  }
+
+  size_t hashImpl(const Key &key, OtherTag) const {
+    return twang_mix64(uint64_t(Hash::operator()(key)) ^ seed0_);
+  }
+
+  uint64_t seed0_;
+  uint64_t seed1_;
+};
+
+}  // namespace folly
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+
+namespace folly {
+
+/// A cold table is a read-only snapshot of key/value pairs on disk,
+/// sorted by key, which ColdTable maps into memory.  The file is a
+/// ColdTableHeader, count ColdTableRecords and a fence index holding the
+/// first key of every block of fenceEvery records.  A lookup binary
+/// searches the fences, which are small enough to stay in the page
+/// cache, and then a single block, so it touches one or two data pages.
+///
+/// Keys and values are stored as their object representation, so both
+/// must be trivially copyable, and a table is only readable on the
+/// architecture that wrote it.
+
+struct ColdTableHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint64_t count;
+  uint64_t fenceEvery;
+  uint32_t keySize;
+  uint32_t valueSize;
+  uint64_t reserved[3];
+};
+
+static_assert(sizeof(ColdTableHeader) == 64, "unexpected header size");
+
+template <typename Key, typename Value>
+struct ColdTableRecord {
+  Key key;
+  Value value;
+};
+
+namespace detail {
+
+enum : uint64_t {
+  kColdTableMagic = 0x31304c4244434d55ULL,  // "UMCDBL01"
+  kColdTableVersion = 1,
+  kColdTableFenceEvery = 64,
+};
+
+inline void writeOrThrow(FILE *file, const void *p, size_t len) {
+  if (len > 0 && fwrite(p, len, 1, file) != 1) {
+    throw std::system_error(errno, std::system_category());
+  }
+}
+
+}  // namespace detail
+
+/// Writes the pairs in [first, last) to a cold table at path.  Anything
+/// that dereferences to a pair works, including an AtomicUnorderedInsertMap
+/// snapshot via cbegin() and cend().  Throws std::invalid_argument if a
+/// key appears twice and std::system_error on I/O errors.
+template <typename Key, typename Value, typename Compare = std::less<Key>,
+          typename Iter>
+void writeColdTable(const std::string &path, Iter first, Iter last,
+                    const Compare &less = Compare()) {
+  static_assert(std::is_trivially_copyable<Key>::value &&
+                    std::is_trivially_copyable<Value>::value,
+                "cold tables store keys and values as raw bytes");
+  typedef ColdTableRecord<Key, Value> Record;
+  std::vector<Record> records;
+  for (; first != last; ++first) {
+    records.push_back(Record{first->first, first->second});
+  }
+  std::sort(records.begin(), records.end(),
+            [&](const Record &a, const Record &b) {
+              return less(a.key, b.key);
+            });
+  for (size_t i = 1; i < records.size(); ++i) {
+    if (!less(records[i - 1].key, records[i].key)) {
+      throw std::invalid_argument("writeColdTable: duplicate key");
+    }
+  }
+
+  std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(path.c_str(), "wb"),
+                                              fclose);
+  if (!file) {
+    throw std::system_error(errno, std::system_category());
+  }
+  ColdTableHeader header = {};
+  header.magic = detail::kColdTableMagic;
+  header.version = detail::kColdTableVersion;
+  header.recordSize = sizeof(Record);
+  header.count = records.size();
+  header.fenceEvery = detail::kColdTableFenceEvery;
+  header.keySize = sizeof(Key);
+  header.valueSize = sizeof(Value);
+  detail::writeOrThrow(file.get(), &header, sizeof(header));
+  detail::writeOrThrow(file.get(), records.data(),
+                       records.size() * sizeof(Record));
+  for (size_t i = 0; i < records.size(); i += header.fenceEvery) {
+    detail::writeOrThrow(file.get(), &records[i].key, sizeof(Key));
+  }
+  if (fclose(file.release()) != 0) {
+    throw std::system_error(errno, std::system_category());
+  }
+}
+
+/// A cold table mapped read-only.  find() is wait-free and returns a
+/// pointer into the mapping, which stays valid for the ColdTable's
+/// lifetime.  Throws std::system_error if the file can't be opened or
+/// mapped and std::runtime_error if it isn't a cold table of Key and
+/// Value.
+template <typename Key, typename Value, typename Compare = std::less<Key>>
+class ColdTable {
+  static_assert(std::is_trivially_copyable<Key>::value &&
+                    std::is_trivially_copyable<Value>::value,
+                "cold tables store keys and values as raw bytes");
+
+  typedef ColdTableRecord<Key, Value> Record;
+
+ public:
+  typedef Key key_type;
+  typedef Value mapped_type;
+
+  explicit ColdTable(const std::string &path, const Compare &less = Compare())
+      : less_(less) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::system_error(errno, std::system_category());
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      auto err = errno;
+      close(fd);
+      throw std::system_error(err, std::system_category());
+    }
+    bytes_ = size_t(st.st_size);
+    if (bytes_ < sizeof(ColdTableHeader)) {
+      close(fd);
+      throw std::runtime_error("ColdTable: not a cold table");
+    }
+    auto p = mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+    auto err = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+      throw std::system_error(err, std::system_category());
+    }
+    base_ = static_cast<const char *>(p);
+    auto const &header = *reinterpret_cast<const ColdTableHeader *>(base_);
+    count_ = header.count;
+    numFences_ = header.fenceEvery == 0
+                     ? 0
+                     : (count_ + header.fenceEvery - 1) / header.fenceEvery;
+    if (header.magic != detail::kColdTableMagic ||
+        header.version != detail::kColdTableVersion ||
+        header.recordSize != sizeof(Record) ||
+        header.keySize != sizeof(Key) || header.valueSize != sizeof(Value) ||
+        header.fenceEvery != detail::kColdTableFenceEvery ||
+        bytes_ != sizeof(ColdTableHeader) + count_ * sizeof(Record) +
+                      numFences_ * sizeof(Key)) {
+      munmap(const_cast<char *>(base_), bytes_);
+      throw std::runtime_error("ColdTable: not a cold table of this type");
+    }
+    records_ = reinterpret_cast<const Record *>(base_ + sizeof(header));
+    fences_ = reinterpret_cast<const Key *>(records_ + count_);
+    // lookups are random, so readahead would only evict useful pages
+    madvise(const_cast<char *>(base_), bytes_, MADV_RANDOM);
+  }
+
+  ColdTable(const ColdTable &) = delete;
+  ColdTable &operator=(const ColdTable &) = delete;
+
+  ~ColdTable() { munmap(const_cast<char *>(base_), bytes_); }
+
+  /// The value of key, or nullptr if the table doesn't have it
+  const Value *find(const Key &key) const {
+    auto fence = std::upper_bound(fences_, fences_ + numFences_, key, less_);
+    if (fence == fences_) {
+      return nullptr;
+    }
+    size_t begin = size_t(fence - fences_ - 1) * detail::kColdTableFenceEvery;
+    size_t end = std::min<size_t>(count_, begin + detail::kColdTableFenceEvery);
+    auto rec = std::lower_bound(
+        records_ + begin, records_ + end, key,
+        [&](const Record &r, const Key &k) { return less_(r.key, k); });
+    return rec != records_ + end && !less_(key, rec->key) ? &rec->value
+                                                          : nullptr;
+  }
+
+  size_t size() const { return count_; }
+
+  /// Size of the file, all of which is mapped
+  size_t fileBytes() const { return bytes_; }
+
+ private:
+  Compare less_;
+  const char *base_;
+  size_t bytes_;
+  size_t count_;
+  size_t numFences_;
+  const Record *records_;
+  const Key *fences_;
+};
+
+/// TieredMap serves a key space larger than memory from a small
+/// AtomicUnorderedInsertMap of hot entries backed by a ColdTable on disk.
+/// find() checks the hot map first and the cold table on a miss.  A cold
+/// hit is promoted into the hot map on one in promoteEvery cold hits per
+/// thread (never if 0), so keys that are looked up repeatedly soon stop
+/// touching the disk while one-off lookups rarely take a hot slot.
+/// Promotion stops once maxHotKeys entries are hot; there is no
+/// eviction, so rebuild the tiers from a fresh snapshot to follow a
+/// shifting working set.
+///
+/// emplace() inserts into the hot map, where the entry shadows any cold
+/// value for the same key.  The cold table must outlive the map.
+///
+/// Usage:
+///
+///  writeColdTable<uint64_t, Row>(path, snap.cbegin(), snap.cend());
+///  ColdTable<uint64_t, Row> cold(path);
+///  TieredMap<uint64_t, Row> rows(cold, 1000000);
+///  if (auto row = rows.find(id)) { ... }
+template <typename Key, typename Value, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key>,
+          typename Compare = std::less<Key>,
+          template <typename> class Atom = std::atomic,
+          typename Allocator = folly::detail::MMapAlloc>
+class TieredMap {
+  typedef AtomicUnorderedInsertMap<Key, Value, Hash, KeyEqual, true, Atom,
+                                   uint32_t, Allocator>
+      HotMap;
+
+ public:
+  typedef Key key_type;
+  typedef Value mapped_type;
+  typedef ColdTable<Key, Value, Compare> ColdTier;
+
+  TieredMap(const ColdTier &cold, size_t maxHotKeys,
+            uint32_t promoteEvery = 1, float maxLoadFactor = 0.8f)
+      : cold_(cold),
+        hot_(maxHotKeys, maxLoadFactor),
+        maxHotKeys_(maxHotKeys),
+        promoteEvery_(promoteEvery) {}
+
+  /// The value of key in the hot map, else in the cold table, else
+  /// nullptr.  May promote a cold hit, see above.
+  const Value *find(const Key &key) const {
+    auto iter = hot_.find(key);
+    if (iter != hot_.cend()) {
+      return &iter->second;
+    }
+    auto value = cold_.find(key);
+    if (value != nullptr && shouldPromote()) {
+      return &promote(key, *value);
+    }
+    return value;
+  }
+
+  /// Inserts key into the hot map unless it is already hot.  Throws
+  /// std::bad_alloc once maxHotKeys entries are hot.
+  template <class V>
+  std::pair<const Value *, bool> emplace(const Key &key, V &&value) {
+    if (hotCount_.load(std::memory_order_relaxed) >= maxHotKeys_) {
+      auto iter = hot_.find(key);
+      if (iter == hot_.cend()) {
+        throw std::bad_alloc();
+      }
+      return std::make_pair(&iter->second, false);
+    }
+    auto rv = hot_.emplace(key, std::forward<V>(value));
+    if (rv.second) {
+      hotCount_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return std::make_pair(&rv.first->second, rv.second);
+  }
+
+  /// Entries in the hot map
+  size_t hotSize() const { return hotCount_.load(std::memory_order_relaxed); }
+
+  const HotMap &hot() const { return hot_; }
+  const ColdTier &cold() const { return cold_; }
+
+ private:
+  bool shouldPromote() const {
+    if (promoteEvery_ == 0 ||
+        hotCount_.load(std::memory_order_relaxed) >= maxHotKeys_) {
+      return false;
+    }
+    static thread_local uint32_t countdown = 0;
+    if (countdown > 0) {
+      --countdown;
+      return false;
+    }
+    countdown = promoteEvery_ - 1;
+    return true;
+  }
+
+  // racing promotions of one key are resolved by findOrConstruct.  Two
+  // threads can both pass the maxHotKeys check, but the map was sized
+  // with maxLoadFactor slack, which absorbs that overshoot.
+  const Value &promote(const Key &key, const Value &value) const {
+    auto rv = hot_.emplace(key, value);
+    if (rv.second) {
+      hotCount_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return rv.first->second;
+  }
+
+  const ColdTier &cold_;
+  // promotion doesn't change what find() returns, so it is allowed
+  // through the const interface
+  mutable HotMap hot_;
+  mutable std::atomic<size_t> hotCount_{0};
+  size_t maxHotKeys_;
+  uint32_t promoteEvery_;
+};
+
+}  // namespace folly
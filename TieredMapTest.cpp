@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "TieredMap.h"
+
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace folly;
+
+namespace {
+
+std::string tempPath(const char *name) {
+  return std::string("/tmp/") + name + "." + std::to_string(getpid());
+}
+
+// even keys 0 .. 2 * (n - 1), each mapped to key * 10
+std::string writeEvenKeys(const char *name, uint64_t n) {
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  for (uint64_t i = n; i-- > 0;) {
+    entries.emplace_back(2 * i, 20 * i);
+  }
+  auto path = tempPath(name);
+  writeColdTable<uint64_t, uint64_t>(path, entries.begin(), entries.end());
+  return path;
+}
+
+}  // namespace
+
+TEST(TieredMap, cold_table_find) {
+  for (uint64_t n : {0, 1, 63, 64, 65, 10000}) {
+    auto path = writeEvenKeys("tiered_map_cold_table_find", n);
+    ColdTable<uint64_t, uint64_t> cold(path);
+    unlink(path.c_str());
+    EXPECT_EQ(cold.size(), n);
+    for (uint64_t k = 0; k < 2 * n + 2; ++k) {
+      auto v = cold.find(k);
+      if (k % 2 == 0 && k / 2 < n) {
+        ASSERT_TRUE(v != nullptr) << k;
+        EXPECT_EQ(*v, k * 10);
+      } else {
+        EXPECT_TRUE(v == nullptr) << k;
+      }
+    }
+  }
+}
+
+TEST(TieredMap, cold_table_from_map_snapshot) {
+  AtomicUnorderedInsertMap<int32_t, double> m(100);
+  for (int i = -50; i < 50; ++i) {
+    m.emplace(i, i * 0.5);
+  }
+  auto path = tempPath("tiered_map_snapshot");
+  writeColdTable<int32_t, double>(path, m.cbegin(), m.cend());
+  ColdTable<int32_t, double> cold(path);
+  unlink(path.c_str());
+  EXPECT_EQ(cold.size(), 100);
+  for (int i = -50; i < 50; ++i) {
+    ASSERT_TRUE(cold.find(i) != nullptr);
+    EXPECT_EQ(*cold.find(i), i * 0.5);
+  }
+  EXPECT_TRUE(cold.find(50) == nullptr);
+}
+
+TEST(TieredMap, cold_table_errors) {
+  std::vector<std::pair<uint64_t, uint64_t>> dup = {{1, 1}, {2, 2}, {1, 3}};
+  auto path = tempPath("tiered_map_errors");
+  EXPECT_THROW((writeColdTable<uint64_t, uint64_t>(path, dup.begin(),
+                                                   dup.end())),
+               std::invalid_argument);
+
+  EXPECT_THROW((ColdTable<uint64_t, uint64_t>("/nonexistent/cold")),
+               std::system_error);
+
+  FILE *f = fopen(path.c_str(), "wb");
+  ASSERT_TRUE(f != nullptr);
+  fputs("definitely not a cold table, but longer than the header is", f);
+  fputs("definitely not a cold table, but longer than the header is", f);
+  fclose(f);
+  EXPECT_THROW((ColdTable<uint64_t, uint64_t>(path)), std::runtime_error);
+  unlink(path.c_str());
+
+  // the right format with the wrong record type
+  path = writeEvenKeys("tiered_map_errors", 10);
+  EXPECT_THROW((ColdTable<uint64_t, uint32_t>(path)), std::runtime_error);
+  unlink(path.c_str());
+}
+
+TEST(TieredMap, promotion) {
+  auto path = writeEvenKeys("tiered_map_promotion", 1000);
+  ColdTable<uint64_t, uint64_t> cold(path);
+  unlink(path.c_str());
+
+  TieredMap<uint64_t, uint64_t> never(cold, 100, 0);
+  EXPECT_EQ(*never.find(4), 40);
+  EXPECT_TRUE(never.find(5) == nullptr);
+  EXPECT_EQ(never.hotSize(), 0);
+
+  TieredMap<uint64_t, uint64_t> always(cold, 100, 1);
+  EXPECT_EQ(*always.find(4), 40);
+  EXPECT_EQ(always.hotSize(), 1);
+  EXPECT_TRUE(always.hot().find(4) != always.hot().cend());
+  // promotion stops at maxHotKeys, after which lookups still work
+  for (uint64_t k = 0; k < 2000; k += 2) {
+    EXPECT_EQ(*always.find(k), k * 10);
+  }
+  EXPECT_EQ(always.hotSize(), 100);
+
+  TieredMap<uint64_t, uint64_t> sampled(cold, 1000, 10);
+  for (uint64_t k = 0; k < 2000; k += 2) {
+    sampled.find(k);
+  }
+  EXPECT_EQ(sampled.hotSize(), 100);
+}
+
+TEST(TieredMap, hot_entries_shadow_cold) {
+  auto path = writeEvenKeys("tiered_map_shadow", 100);
+  ColdTable<uint64_t, uint64_t> cold(path);
+  unlink(path.c_str());
+
+  TieredMap<uint64_t, uint64_t> m(cold, 2, 0);
+  EXPECT_TRUE(m.emplace(4, uint64_t(7)).second);
+  EXPECT_FALSE(m.emplace(4, uint64_t(8)).second);
+  EXPECT_EQ(*m.find(4), 7);
+  EXPECT_TRUE(m.emplace(5, uint64_t(9)).second);
+  EXPECT_EQ(*m.find(5), 9);
+  EXPECT_THROW(m.emplace(6, uint64_t(1)), std::bad_alloc);
+  EXPECT_FALSE(m.emplace(5, uint64_t(1)).second);
+  EXPECT_EQ(*m.find(6), 60);
+}
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace folly {
+
+/// Workload traces record the operations issued against a map, so that a
+/// production mix of hot keys, misses and bursts can be replayed offline
+/// by AtomicUnorderedMapReplay against any map configuration.
+///
+/// The file is a WorkloadTraceHeader followed by records, each of which
+/// is a WorkloadRecord followed by keyLen bytes of key.  The header says
+/// what kind of key was recorded, so that a replay can use the same key
+/// type and therefore the same hash and chain layout.  Records from one
+/// thread appear in the order that thread issued them; records of
+/// different threads are interleaved in chunks.
+
+enum class WorkloadOp : uint8_t {
+  FIND = 1,
+  FIND_OR_CONSTRUCT = 2,
+};
+
+/// How recorded keys are to be decoded, from KeyBytes<K>::kind()
+enum class WorkloadKeyKind : uint32_t {
+  UNKNOWN = 0,  // the writer was never told, see setKeyKind
+  SIGNED_INTEGER = 1,  // keySize bytes
+  UNSIGNED_INTEGER = 2,  // keySize bytes
+  BYTES = 3,  // anything else, replayed as std::string
+};
+
+struct WorkloadTraceHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  WorkloadKeyKind keyKind;
+  uint32_t keySize;  // for integers, else 0
+};
+
+static_assert(sizeof(WorkloadTraceHeader) == 24,
+              "unexpected WorkloadTraceHeader size");
+
+struct WorkloadRecord {
+  WorkloadOp op;
+  uint8_t hit;  // 1 iff the key was already present
+  uint16_t keyLen;
+  uint32_t threadId;  // dense, in order of each thread's first record
+  uint64_t hash;
+  uint64_t timestampNs;  // since the writer was created
+};
+
+static_assert(sizeof(WorkloadRecord) == 24, "unexpected WorkloadRecord size");
+
+/// A decoded record together with its key bytes
+struct WorkloadEvent {
+  WorkloadRecord record;
+  std::string key;
+};
+
+/// KeyBytes<K> describes how a key is serialized into a trace and read
+/// back for replay, and kind() and keySize() what the header records
+/// about K.  Trivially copyable keys are recorded as their object
+/// representation; specialize this for other key types.
+template <typename K, typename Enable = void>
+struct KeyBytes;
+
+template <typename K>
+struct KeyBytes<K, typename std::enable_if<
+                       std::is_trivially_copyable<K>::value>::type> {
+  static WorkloadKeyKind kind() {
+    if (!std::is_integral<K>::value) {
+      return WorkloadKeyKind::BYTES;
+    }
+    return std::is_signed<K>::value ? WorkloadKeyKind::SIGNED_INTEGER
+                                    : WorkloadKeyKind::UNSIGNED_INTEGER;
+  }
+  static uint32_t keySize() {
+    return std::is_integral<K>::value ? sizeof(K) : 0;
+  }
+  static const void *data(const K &key) { return &key; }
+  static size_t size(const K &) { return sizeof(K); }
+  static K decode(const std::string &bytes) {
+    K key;
+    memcpy(&key, bytes.data(), std::min(sizeof(K), bytes.size()));
+    return key;
+  }
+};
+
+template <>
+struct KeyBytes<std::string> {
+  static WorkloadKeyKind kind() { return WorkloadKeyKind::BYTES; }
+  static uint32_t keySize() { return 0; }
+  static const void *data(const std::string &key) { return key.data(); }
+  static size_t size(const std::string &key) { return key.size(); }
+  static std::string decode(const std::string &bytes) { return bytes; }
+};
+
+/// Appends WorkloadRecords to a file.  Each recording thread buffers its
+/// records locally and only takes the file lock to write a full buffer,
+/// so recording costs a clock read and a memcpy per operation.  close()
+/// (or the destructor) flushes every buffer and must only be called once
+/// the recording threads are done with this writer.
+class WorkloadTraceWriter {
+ public:
+  static constexpr uint64_t kMagic = 0x31304b524f574d55ULL;  // "UMWORK01"
+  static constexpr uint32_t kVersion = 2;
+  static constexpr size_t kMaxKeyLen = UINT16_MAX;
+
+  explicit WorkloadTraceWriter(const std::string &path)
+      : id_(nextId()), start_(std::chrono::steady_clock::now()) {
+    file_ = fopen(path.c_str(), "wb");
+    if (file_ == nullptr) {
+      throw std::system_error(errno, std::system_category());
+    }
+    writeHeader();
+  }
+
+  WorkloadTraceWriter(const WorkloadTraceWriter &) = delete;
+  WorkloadTraceWriter &operator=(const WorkloadTraceWriter &) = delete;
+
+  ~WorkloadTraceWriter() {
+    try {
+      close();
+    } catch (...) {
+    }
+  }
+
+  /// Records in the header what kind of key this trace holds.
+  /// RecordingMap calls it with KeyBytes<Key>; throws
+  /// std::invalid_argument if it was already set to something else.
+  void setKeyKind(WorkloadKeyKind kind, uint32_t keySize) {
+    std::lock_guard<std::mutex> g(lock_);
+    if (keyKind_ == kind && keySize_ == keySize) {
+      return;
+    }
+    if (keyKind_ != WorkloadKeyKind::UNKNOWN) {
+      throw std::invalid_argument(
+          "WorkloadTraceWriter: a trace can only hold one kind of key");
+    }
+    keyKind_ = kind;
+    keySize_ = keySize;
+    if (file_ != nullptr) {
+      // rewrite the header in place, so a trace cut short still has it
+      if (fseek(file_, 0, SEEK_SET) != 0) {
+        throw std::system_error(errno, std::system_category());
+      }
+      writeHeader();
+      if (fseek(file_, 0, SEEK_END) != 0) {
+        throw std::system_error(errno, std::system_category());
+      }
+    }
+  }
+
+  /// Throws std::length_error if a key of keyLen bytes can't be recorded
+  static void checkKeyLen(size_t keyLen) {
+    if (keyLen > kMaxKeyLen) {
+      throw std::length_error(
+          "WorkloadTraceWriter: keys are limited to 65535 bytes");
+    }
+  }
+
+  /// Appends a record.  Throws std::length_error, without recording
+  /// anything, if keyLen is more than kMaxKeyLen.
+  void record(WorkloadOp op, bool hit, uint64_t hash, const void *key,
+              size_t keyLen) {
+    checkKeyLen(keyLen);
+    auto &buf = threadBuffer();
+    WorkloadRecord rec;
+    rec.op = op;
+    rec.hit = hit ? 1 : 0;
+    rec.keyLen = uint16_t(keyLen);
+    rec.threadId = buf.threadId;
+    rec.hash = hash;
+    rec.timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count();
+    auto pos = buf.bytes.size();
+    buf.bytes.resize(pos + sizeof(rec) + rec.keyLen);
+    memcpy(&buf.bytes[pos], &rec, sizeof(rec));
+    memcpy(&buf.bytes[pos + sizeof(rec)], key, rec.keyLen);
+    if (buf.bytes.size() >= kFlushBytes) {
+      std::lock_guard<std::mutex> g(lock_);
+      flush(buf);
+    }
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> g(lock_);
+    if (file_ == nullptr) {
+      return;
+    }
+    for (auto &buf : buffers_) {
+      flush(*buf);
+    }
+    auto rv = fclose(file_);
+    file_ = nullptr;
+    if (rv != 0) {
+      throw std::system_error(errno, std::system_category());
+    }
+  }
+
+ private:
+  enum : size_t { kFlushBytes = 64 * 1024 };
+
+  struct ThreadBuffer {
+    uint64_t owner;  // threadToken() of the recording thread
+    uint32_t threadId;
+    std::vector<char> bytes;
+  };
+
+  struct ThreadCache {
+    uint64_t writerId;
+    ThreadBuffer *buffer;
+  };
+
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> id{0};
+    return ++id;
+  }
+
+  // unlike std::thread::id, never reused after a thread exits
+  static uint64_t threadToken() {
+    static std::atomic<uint64_t> next{0};
+    static thread_local uint64_t token = ++next;
+    return token;
+  }
+
+  // Each thread caches only the writer it recorded into last, so its
+  // cache stays one entry however many writers come and go.  Writer ids
+  // are never reused, so a stale entry for a destroyed writer can't be
+  // mistaken for a live one.  A thread that alternates between writers
+  // looks its buffer up in buffers_ on each switch.
+  ThreadBuffer &threadBuffer() {
+    static thread_local ThreadCache cache{0, nullptr};
+    if (cache.writerId == id_) {
+      return *cache.buffer;
+    }
+    auto self = threadToken();
+    std::lock_guard<std::mutex> g(lock_);
+    ThreadBuffer *buf = nullptr;
+    for (auto &b : buffers_) {
+      if (b->owner == self) {
+        buf = b.get();
+        break;
+      }
+    }
+    if (buf == nullptr) {
+      buffers_.emplace_back(new ThreadBuffer());
+      buf = buffers_.back().get();
+      buf->owner = self;
+      buf->threadId = uint32_t(buffers_.size() - 1);
+      buf->bytes.reserve(kFlushBytes + 1024);
+    }
+    cache = ThreadCache{id_, buf};
+    return *buf;
+  }
+
+  // requires lock_, or a writer no other thread can see yet
+  void writeHeader() {
+    WorkloadTraceHeader header = {kMagic, kVersion, sizeof(WorkloadRecord),
+                                  keyKind_, keySize_};
+    write(&header, sizeof(header));
+  }
+
+  // requires lock_
+  void flush(ThreadBuffer &buf) {
+    if (file_ != nullptr) {
+      write(buf.bytes.data(), buf.bytes.size());
+    }
+    buf.bytes.clear();
+  }
+
+  void write(const void *p, size_t len) {
+    if (len > 0 && fwrite(p, len, 1, file_) != 1) {
+      throw std::system_error(errno, std::system_category());
+    }
+  }
+
+  uint64_t id_;
+  std::chrono::steady_clock::time_point start_;
+  std::mutex lock_;
+  FILE *file_;
+  WorkloadKeyKind keyKind_ = WorkloadKeyKind::UNKNOWN;
+  uint32_t keySize_ = 0;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+/// Reads a whole trace, returning the events of each recorded thread in
+/// issue order, indexed by threadId, and storing the header in *header
+/// if it isn't null.  Throws std::system_error if the file can't be
+/// opened and std::runtime_error if it isn't a trace of this version.
+inline std::vector<std::vector<WorkloadEvent>> readWorkloadTrace(
+    const std::string &path, WorkloadTraceHeader *header = nullptr) {
+  std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(path.c_str(), "rb"),
+                                              fclose);
+  if (!file) {
+    throw std::system_error(errno, std::system_category());
+  }
+  WorkloadTraceHeader h;
+  if (fread(&h, sizeof(h), 1, file.get()) != 1 ||
+      h.magic != WorkloadTraceWriter::kMagic ||
+      h.version != WorkloadTraceWriter::kVersion ||
+      h.recordSize != sizeof(WorkloadRecord)) {
+    throw std::runtime_error("readWorkloadTrace: not a workload trace");
+  }
+  if (header != nullptr) {
+    *header = h;
+  }
+  std::vector<std::vector<WorkloadEvent>> threads;
+  WorkloadEvent ev;
+  while (fread(&ev.record, sizeof(ev.record), 1, file.get()) == 1) {
+    ev.key.resize(ev.record.keyLen);
+    if (ev.record.keyLen > 0 &&
+        fread(&ev.key[0], ev.record.keyLen, 1, file.get()) != 1) {
+      throw std::runtime_error("readWorkloadTrace: truncated record");
+    }
+    if (ev.record.threadId >= threads.size()) {
+      threads.resize(ev.record.threadId + 1);
+    }
+    threads[ev.record.threadId].push_back(ev);
+  }
+  return threads;
+}
+
+/// RecordingMap forwards find, findOrConstruct and emplace to a map and
+/// logs each call to a WorkloadTraceWriter.  It records hashes with the
+/// map's hash_function() and keys via KeyBytes<Key>, and tells the
+/// writer the kind of Key.  A key too long to record throws
+/// std::length_error before the map sees the call.
+///
+/// Usage:
+///
+///  WorkloadTraceWriter writer("/tmp/workload.trace");
+///  RecordingMap<decltype(map)> recorded(map, writer);
+///  recorded.emplace(k, v);  // instead of map.emplace(k, v)
+template <typename Map>
+class RecordingMap {
+ public:
+  typedef typename Map::key_type key_type;
+  typedef typename Map::const_iterator const_iterator;
+
+  RecordingMap(Map &map, WorkloadTraceWriter &writer)
+      : map_(map), writer_(writer) {
+    writer_.setKeyKind(KeyBytes<key_type>::kind(),
+                       KeyBytes<key_type>::keySize());
+  }
+
+  const_iterator find(const key_type &key) const {
+    checkKey(key);
+    auto rv = map_.find(key);
+    record(WorkloadOp::FIND, rv != map_.cend(), key);
+    return rv;
+  }
+
+  template <typename Func>
+  std::pair<const_iterator, bool> findOrConstruct(const key_type &key,
+                                                  Func &&func) {
+    checkKey(key);
+    auto rv = map_.findOrConstruct(key, std::forward<Func>(func));
+    record(WorkloadOp::FIND_OR_CONSTRUCT, !rv.second, key);
+    return rv;
+  }
+
+  template <class K, class V>
+  std::pair<const_iterator, bool> emplace(const K &key, V &&value) {
+    checkKey(key);
+    auto rv = map_.emplace(key, std::forward<V>(value));
+    record(WorkloadOp::FIND_OR_CONSTRUCT, !rv.second, key);
+    return rv;
+  }
+
+  const_iterator cend() const { return map_.cend(); }
+
+  Map &map() const { return map_; }
+
+ private:
+  static void checkKey(const key_type &key) {
+    WorkloadTraceWriter::checkKeyLen(KeyBytes<key_type>::size(key));
+  }
+
+  void record(WorkloadOp op, bool hit, const key_type &key) const {
+    writer_.record(op, hit, map_.hash_function()(key),
+                   KeyBytes<key_type>::data(key),
+                   KeyBytes<key_type>::size(key));
+  }
+
+  Map &map_;
+  WorkloadTraceWriter &writer_;
+};
+
+}  // namespace folly
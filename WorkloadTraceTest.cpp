@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "WorkloadTrace.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AtomicUnorderedMap.h"
+
+using namespace folly;
+
+namespace {
+
+std::string tempPath(const char *name) {
+  return std::string("/tmp/") + name + "." + std::to_string(getpid());
+}
+
+}  // namespace
+
+TEST(WorkloadTrace, record_and_read) {
+  auto path = tempPath("workload_trace_record_and_read");
+  AtomicUnorderedInsertMap<uint64_t, uint64_t> m(1000);
+  {
+    WorkloadTraceWriter writer(path);
+    RecordingMap<decltype(m)> recorded(m, writer);
+
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < 3; ++t) {
+      threads.emplace_back([&, t] {
+        for (uint64_t i = 0; i < 100; ++i) {
+          recorded.emplace(t * 1000 + i, i);
+          EXPECT_TRUE(recorded.find(t * 1000 + i) != recorded.cend());
+        }
+        EXPECT_TRUE(recorded.find(uint64_t(-1)) == recorded.cend());
+      });
+    }
+    for (auto &thr : threads) {
+      thr.join();
+    }
+  }
+
+  WorkloadTraceHeader header;
+  auto trace = readWorkloadTrace(path, &header);
+  unlink(path.c_str());
+  EXPECT_EQ(header.keyKind, WorkloadKeyKind::UNSIGNED_INTEGER);
+  EXPECT_EQ(header.keySize, 8);
+  ASSERT_EQ(trace.size(), 3);
+  for (auto &events : trace) {
+    ASSERT_EQ(events.size(), 201);
+    uint64_t first = KeyBytes<uint64_t>::decode(events[0].key);
+    uint64_t lastStamp = 0;
+    for (size_t i = 0; i < 200; ++i) {
+      auto &ev = events[i];
+      EXPECT_EQ(ev.record.op, i % 2 == 0 ? WorkloadOp::FIND_OR_CONSTRUCT
+                                         : WorkloadOp::FIND);
+      EXPECT_EQ(ev.record.hit, i % 2 == 0 ? 0 : 1);
+      EXPECT_EQ(ev.record.keyLen, sizeof(uint64_t));
+      EXPECT_EQ(KeyBytes<uint64_t>::decode(ev.key), first + i / 2);
+      EXPECT_EQ(ev.record.hash, std::hash<uint64_t>()(first + i / 2));
+      EXPECT_GE(ev.record.timestampNs, lastStamp);
+      lastStamp = ev.record.timestampNs;
+    }
+    EXPECT_EQ(events[200].record.op, WorkloadOp::FIND);
+    EXPECT_EQ(events[200].record.hit, 0);
+  }
+}
+
+TEST(WorkloadTrace, string_keys) {
+  auto path = tempPath("workload_trace_string_keys");
+  AtomicUnorderedInsertMap<std::string, int> m(100);
+  {
+    WorkloadTraceWriter writer(path);
+    RecordingMap<decltype(m)> recorded(m, writer);
+    recorded.findOrConstruct("abc", [](void *raw) { new (raw) int(1); });
+    recorded.emplace(std::string("abc"), 2);
+    recorded.find("");
+  }
+
+  auto trace = readWorkloadTrace(path);
+  unlink(path.c_str());
+  ASSERT_EQ(trace.size(), 1);
+  ASSERT_EQ(trace[0].size(), 3);
+  EXPECT_EQ(trace[0][0].key, "abc");
+  EXPECT_EQ(trace[0][0].record.hit, 0);
+  EXPECT_EQ(trace[0][1].record.hit, 1);
+  EXPECT_EQ(trace[0][2].key, "");
+  EXPECT_EQ(trace[0][2].record.op, WorkloadOp::FIND);
+}
+
+TEST(WorkloadTrace, key_kinds) {
+  struct Point {
+    int16_t x;
+    int16_t y;
+  };
+  EXPECT_EQ(KeyBytes<int32_t>::kind(), WorkloadKeyKind::SIGNED_INTEGER);
+  EXPECT_EQ(KeyBytes<int32_t>::keySize(), 4);
+  EXPECT_EQ(KeyBytes<uint16_t>::kind(), WorkloadKeyKind::UNSIGNED_INTEGER);
+  // a 4-byte struct isn't replayed as an integer
+  EXPECT_EQ(KeyBytes<Point>::kind(), WorkloadKeyKind::BYTES);
+  EXPECT_EQ(KeyBytes<std::string>::kind(), WorkloadKeyKind::BYTES);
+
+  auto path = tempPath("workload_trace_key_kinds");
+  AtomicUnorderedInsertMap<std::string, int> strings(10);
+  AtomicUnorderedInsertMap<int32_t, int> ints(10);
+  {
+    WorkloadTraceWriter writer(path);
+    RecordingMap<decltype(strings)> recorded(strings, writer);
+    recorded.emplace(std::string("abcd"), 1);
+    EXPECT_THROW(RecordingMap<decltype(ints)>(ints, writer),
+                 std::invalid_argument);
+  }
+  WorkloadTraceHeader header;
+  auto trace = readWorkloadTrace(path, &header);
+  unlink(path.c_str());
+  EXPECT_EQ(header.keyKind, WorkloadKeyKind::BYTES);
+  ASSERT_EQ(trace.size(), 1);
+  EXPECT_EQ(trace[0][0].key, "abcd");
+}
+
+TEST(WorkloadTrace, many_writers_per_thread) {
+  auto pathA = tempPath("workload_trace_writer_a");
+  auto pathB = tempPath("workload_trace_writer_b");
+  AtomicUnorderedInsertMap<uint64_t, uint64_t> m(100);
+  // short-lived writers, as with one per capture window
+  for (int i = 0; i < 100; ++i) {
+    WorkloadTraceWriter writer(pathA);
+    RecordingMap<decltype(m)> recorded(m, writer);
+    recorded.emplace(i, i);
+  }
+  {
+    // alternating between live writers keeps one buffer per writer
+    WorkloadTraceWriter a(pathA);
+    WorkloadTraceWriter b(pathB);
+    RecordingMap<decltype(m)> ra(m, a);
+    RecordingMap<decltype(m)> rb(m, b);
+    for (uint64_t i = 0; i < 3; ++i) {
+      ra.find(i);
+      rb.find(i + 10);
+    }
+  }
+  auto traceA = readWorkloadTrace(pathA);
+  auto traceB = readWorkloadTrace(pathB);
+  unlink(pathA.c_str());
+  unlink(pathB.c_str());
+  ASSERT_EQ(traceA.size(), 1);
+  ASSERT_EQ(traceB.size(), 1);
+  ASSERT_EQ(traceA[0].size(), 3);
+  ASSERT_EQ(traceB[0].size(), 3);
+  EXPECT_EQ(KeyBytes<uint64_t>::decode(traceB[0][2].key), 12);
+}
+
+TEST(WorkloadTrace, rejects_long_keys) {
+  auto path = tempPath("workload_trace_rejects_long_keys");
+  AtomicUnorderedInsertMap<std::string, int> m(100);
+  std::string longKey(WorkloadTraceWriter::kMaxKeyLen + 1, 'x');
+  {
+    WorkloadTraceWriter writer(path);
+    RecordingMap<decltype(m)> recorded(m, writer);
+    EXPECT_THROW(recorded.emplace(longKey, 1), std::length_error);
+    longKey.pop_back();
+    recorded.emplace(longKey, 2);
+  }
+  EXPECT_TRUE(m.find(longKey + "x") == m.cend());
+
+  auto trace = readWorkloadTrace(path);
+  unlink(path.c_str());
+  ASSERT_EQ(trace.size(), 1);
+  ASSERT_EQ(trace[0].size(), 1);
+  EXPECT_EQ(trace[0][0].key, longKey);
+}
+
+TEST(WorkloadTrace, rejects_other_files) {
+  auto path = tempPath("workload_trace_rejects_other_files");
+  FILE *f = fopen(path.c_str(), "wb");
+  fputs("definitely not a trace", f);
+  fclose(f);
+  EXPECT_THROW(readWorkloadTrace(path), std::runtime_error);
+  unlink(path.c_str());
+}